@@ -4,6 +4,13 @@
 #include <switch_curl.h>
 #include <string.h>
 #include <switch_version.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <arpa/inet.h>
 
 SWITCH_MODULE_LOAD_FUNCTION(mod_apn_load);
 SWITCH_MODULE_SHUTDOWN_FUNCTION(mod_apn_shutdown);
@@ -15,21 +22,243 @@ SWITCH_MODULE_DEFINITION(mod_apn, mod_apn_load, mod_apn_shutdown, NULL);
 
 static switch_event_node_t *register_event = NULL;
 static switch_event_node_t *push_event = NULL;
+static switch_event_node_t *cancel_event = NULL;
+
+enum apn_db_kind {
+	APN_DB_CORE,	/* default sqlite db, statements prepared on own handles */
+	APN_DB_PGSQL,	/* server side PREPARE/EXECUTE */
+	APN_DB_ODBC		/* no prepare support, plain sql text */
+};
+
+/* Hot push_token_entries statements, prepared once per db handle */
+enum apn_stmt_id {
+	APN_STMT_SELECT_TOKENS,
+	APN_STMT_UPSERT_TOKEN,
+	APN_STMT_TOUCH_TOKEN,
+	APN_STMT_DELETE_TOKEN,
+	APN_STMT_UPDATE_TOKEN,	/* UPDATE and INSERT are upsert of backends without ON CONFLICT */
+	APN_STMT_INSERT_TOKEN,
+	APN_STMT_COUNT_TOKEN,	/* UPDATE of unchanged row may report 0 rows (MySQL) */
+	APN_STMT_MAX
+};
+
+/* Dimension tables of push_token_entries, repeated strings are stored once and referenced by small integer id */
+enum apn_dim {
+	APN_DIM_REALM,
+	APN_DIM_APP,
+	APN_DIM_TYPE,
+	APN_DIM_PLATFORM,
+	APN_DIM_MAX
+};
+
+/* Token tuple with dimension values replaced by ids: token, extension, realm_ref, app_ref, type_ref, platform_ref */
+struct apn_token_refs_obj {
+	char ids[APN_DIM_MAX][16];
+	const char *args[6];
+};
+typedef struct apn_token_refs_obj apn_token_refs_t;
+
+/* Cached id of dimension value, id 0 is a miss remembered until miss_until */
+struct apn_dim_id_obj {
+	uint32_t id;
+	switch_time_t miss_until;
+};
+typedef struct apn_dim_id_obj apn_dim_id_t;
+
+#define APN_DIM_MISS_TTL 10
+#define APN_DIM_MISS_MAX 1024
+
+struct apn_db_conn_obj {
+	switch_core_db_t *db;
+	switch_core_db_stmt_t *stmt[APN_STMT_MAX];
+	uint32_t shard;
+	struct apn_db_conn_obj *next;
+};
+typedef struct apn_db_conn_obj apn_db_conn_t;
+
+/* Free sqlite handles are split by thread, so workers don't wait each other on one list */
+#define APN_DB_SHARDS 16
+struct apn_db_shard_obj {
+	switch_mutex_t *mutex;
+	apn_db_conn_t *conns;
+};
+typedef struct apn_db_shard_obj apn_db_shard_t;
+
+/* Primary db or read replica, with health and latency of queries sent to it */
+struct apn_dsn_obj {
+	const char *name;
+	char *dsn;
+	enum apn_db_kind kind;
+	switch_mutex_t *mutex;
+	switch_bool_t down;
+	switch_bool_t lagging;
+	switch_bool_t checked;
+	time_t retry_at;
+	time_t check_at;
+	double lag;
+	uint64_t queries;
+	uint64_t errors;
+	uint64_t fallbacks;
+	switch_time_t avg_us;
+	switch_time_t max_us;
+};
+typedef struct apn_dsn_obj apn_dsn_t;
 
 static struct {
 	switch_memory_pool_t *pool;
 	switch_hash_t *profile_hash;
 	char *dbname;
 	char *odbc_dsn;
+	char *odbc_dsn_read;
+	char *odbc_read_lag_query;
+	uint32_t odbc_read_max_lag;
+	uint32_t odbc_read_check_interval;
+	uint32_t odbc_read_retry;
+	apn_dsn_t db_primary;
+	apn_dsn_t db_replica;
+	/*name -> id of dimension tables*/
+	switch_hash_t *dim_ids[APN_DIM_MAX];
+	uint32_t dim_misses;
+	switch_mutex_t *dim_mutex;
 	int db_online;
 	switch_sql_queue_manager_t *qm;
-	switch_mutex_t *dbh_mutex;
 	char *contact_voip_token_param;
 	char *contact_im_token_param;
 	char *contact_app_id_param;
 	char *contact_platform_param;
+	int running;
+	switch_queue_t *evict_queue;
+	switch_thread_t *evict_thread;
+	uint32_t evict_batch_size;
+	uint32_t evict_flush_interval;
+	switch_queue_t *register_queue;
+	switch_thread_t *register_thread;
+	uint32_t register_batch_size;
+	uint32_t register_flush_interval;
+	struct register_fingerprint_obj *fingerprints;
+	uint32_t fingerprints_size;
+	uint32_t fingerprints_used;
+	uint32_t fingerprints_hand;
+	uint32_t fingerprints_evicted;
+	uint32_t register_touch_interval;
+	switch_mutex_t *fingerprints_mutex;
+	/*Recent REGISTERs of voip tokens, user@realm/token to time_t until it is fresh*/
+	switch_hash_t *fresh_hash;
+	switch_mutex_t *fresh_mutex;
+	uint32_t fresh_register_window;
+	uint32_t fresh_register_delay;
+	time_t fresh_sweep_at;
+	uint64_t fresh_deferred;
+	uint64_t fresh_suppressed;
+	struct wakeup_bus_obj *wakeup_bus;
+	char *wakeup_bus_node;
+	char *wakeup_bus_route;
+	uint32_t wakeup_bus_poll_interval;
+	switch_thread_t *wakeup_bus_thread;
+	/*user@realm (lowercase) waited on other nodes, only their REGISTERs are published*/
+	switch_hash_t *wakeup_remote;
+	switch_mutex_t *wakeup_remote_mutex;
+	switch_mutex_t *waiters_mutex;
+	uint32_t waiters;
+	enum apn_db_kind db_kind;
+	apn_db_shard_t db_shards[APN_DB_SHARDS];
+	switch_hash_t *waiter_hash;
+	switch_mutex_t *waiter_mutex;
+	switch_bool_t wake_stats;
+	switch_bool_t adaptive_wake_timeout;
+	uint32_t wake_min_samples;
+	uint32_t wake_timeout_factor;
+	uint32_t wake_timeout_margin;
+	uint32_t wake_dead_misses;
+	uint32_t wake_dead_timeout;
+	uint32_t wake_sample_window;
+	switch_hash_t *wake_hash;
+	switch_hash_t *wake_pending_hash;
+	switch_hash_t *wake_platform_hash;
+	switch_mutex_t *wake_mutex;
+	switch_time_t wake_sweep_ms;
+	switch_time_t wake_cache_sweep_ms;
+	uint32_t wake_cache_size;
+	uint32_t wake_cache_ttl;
+	uint32_t wake_cache_count;
+	switch_queue_t *wake_write_queue;
+	switch_bool_t token_store;
+	char *token_snapshot_path;
+	uint32_t token_snapshot_interval;
+	uint32_t token_reconcile_interval;
+	switch_hash_t *token_store_sets;
+	switch_hash_t *token_store_intern;
+	switch_mutex_t *token_store_intern_mutex;
+	switch_thread_rwlock_t *token_store_rwlock;
+	switch_bool_t token_store_complete;
+	struct token_op_obj *token_store_journal;
+	struct token_op_obj *token_store_journal_tail;
+	void *token_store_map;
+	switch_size_t token_store_map_size;
+	switch_thread_t *token_store_thread;
+	switch_bool_t push_trace;
+	switch_hash_t *inflight_hash;
+	switch_mutex_t *inflight_mutex;
+	uint32_t fork_grace;
+	/*Joinable threads running requests of hedged profiles*/
+	switch_queue_t *attempt_queue;
+	switch_thread_t **attempt_threads;
+	uint32_t attempt_threads_count;
+	volatile switch_bool_t attempts_running;
+	/*Journal of im pushes*/
+	switch_bool_t outbox;
+	char *outbox_dir;
+	uint32_t outbox_segment_size;
+	uint32_t outbox_commit_interval;
+	uint32_t outbox_drain_timeout;
+	uint32_t outbox_retry_interval;
+	uint32_t outbox_max_attempts;
+	switch_queue_t *outbox_in;
+	switch_queue_t *outbox_send;
+	switch_queue_t *outbox_done;
+	switch_thread_t *outbox_writer_thread;
+	switch_thread_t *outbox_sender_thread;
+	volatile switch_bool_t outbox_stopping;
+	volatile switch_bool_t outbox_sender_done;
+	switch_time_t outbox_drain_deadline;
+	int outbox_fd;
+	uint32_t outbox_seq;
+	switch_size_t outbox_seq_size;
+	uint64_t outbox_next_id;
+	switch_mutex_t *outbox_mutex;
+	struct outbox_segment_obj *outbox_segments;
+	uint32_t outbox_live;
+	uint32_t outbox_retrying;
+	/*Pushes queued or being sent (routed workers, batches), done callback not called yet*/
+	uint32_t outbox_inflight;
+	/*Routed profiles by type|app_id|platform|realm, `*` is any*/
+	switch_hash_t *route_hash;
+	switch_mutex_t *push_jobs_mutex;
+	switch_thread_t *conn_keeper_thread;
+	switch_thread_t *dsn_check_thread;
+	switch_thread_t *loadtest_thread;
+	struct loadtest_obj *loadtest;
+	switch_mutex_t *loadtest_mutex;
+	/*Sink of pushes to APN_LOADTEST_REALM while load test runs*/
+	const char *loadtest_url;
 } globals;
 
+/* Delivers "user@realm registered at contact X" to nodes which wait for the device wake up */
+struct wakeup_bus_obj {
+	const char *name;
+	switch_status_t (*start)(void);
+	void (*publish)(switch_event_t *register_event);
+	void (*stop)(void);
+	/*Announce waiter of user@realm to other nodes, id is unique per waiter*/
+	void (*watch)(const char *id, const char *user, const char *realm, uint32_t timelimit);
+	void (*unwatch)(const char *id);
+};
+typedef struct wakeup_bus_obj wakeup_bus_t;
+
+#define APN_WAKEUP_SUBCLASS "mobile::push::wakeup"
+#define APN_TRACE_SUBCLASS "mobile::push::trace"
+#define APN_CANCEL_SUBCLASS "mobile::push::cancel"
+
 enum auth_type {
 	NONE,
 	JWT,
@@ -37,25 +266,236 @@ enum auth_type {
 	DIGEST
 };
 
+/* Last digest challenge of server, answered without extra round trip until server says nonce is stale */
+struct digest_state_obj {
+	switch_mutex_t *mutex;
+	char *username;
+	char *password;
+	char realm[128];
+	char nonce[256];
+	char opaque[256];
+	char qop[32];
+	char algorithm[32];
+	uint32_t nc;
+};
+typedef struct digest_state_obj digest_state_t;
+
 struct http_auth_obj {
 	enum auth_type type;
 	char *data;
+	digest_state_t *digest;
 };
 typedef struct http_auth_obj http_auth_t;
 
+/* Provider answer which means the token is dead: HTTP code and optional reason found in response body */
+struct evict_rule_obj {
+	long code;
+	char *reason;
+	struct evict_rule_obj *next;
+};
+typedef struct evict_rule_obj evict_rule_t;
+
+/* Idle curl handle, keeps its connection (and TLS session) to gateway */
+struct conn_obj {
+	switch_CURL *curl;
+	time_t last_used;
+	struct conn_obj *next;
+};
+typedef struct conn_obj conn_t;
+
+/* Gateway host pinned to address resolved out of push path and pool of warm connections */
+struct conn_pool_obj {
+	switch_mutex_t *mutex;
+	char *host;
+	char *port;
+	char *warm_url;
+	switch_bool_t https;
+	switch_bool_t resolve_host;
+	uint32_t dns_refresh;
+	char resolve[320];
+	time_t resolved_at;
+	uint32_t resolve_failures;
+	uint32_t warm_connections;
+	uint32_t keepalive_interval;
+	conn_t *idle;
+	uint32_t idle_count;
+	uint32_t busy_count;
+	uint64_t reused;
+	uint64_t created;
+	uint64_t pings;
+	uint64_t ping_failures;
+};
+typedef struct conn_pool_obj conn_pool_t;
+
+#define APN_ENDPOINT_MIN_SAMPLES 5
+
+/* Body template split on load into literal text and ${variable} parts */
+struct template_part_obj {
+	char *text;
+	switch_size_t len;
+	char *var;
+	struct template_part_obj *next;
+};
+typedef struct template_part_obj template_part_t;
+
+struct template_obj {
+	char *source;
+	/*NULL when template needs full expansion (functions, defaults)*/
+	template_part_t *parts;
+	uint32_t vars;
+};
+typedef struct template_obj template_t;
+
+
+/* Gateway url of profile (repeated `url` param) with its health */
+struct endpoint_obj {
+	char *url;
+	uint32_t index;
+	switch_mutex_t *mutex;
+	switch_bool_t healthy;
+	/*Unhealthy endpoint gets one probe request after this time*/
+	time_t retry_at;
+	/*Moving averages, per mille and ms*/
+	uint32_t error_rate;
+	uint32_t latency;
+	uint64_t requests;
+	uint64_t failures;
+	uint64_t hedged;
+	uint64_t wins;
+	struct endpoint_obj *next;
+};
+typedef struct endpoint_obj endpoint_t;
+
 struct profile_obj {
 	char *name;
 	uint16_t id;
+	/*Push type served by profile, name of base profile*/
+	char *type;
 	char *url;
+	endpoint_t *endpoints;
+	uint32_t endpoints_count;
+	uint32_t hedge_delay;
+	uint32_t unhealthy_error_rate;
+	uint32_t unhealthy_latency;
+	uint32_t unhealthy_retry;
+	/*Many tokens per request, pending batches by payload*/
+	char *batch_template;
+	uint32_t batch_max;
+	uint32_t batch_linger;
+	switch_mutex_t *batch_mutex;
+	switch_hash_t *batches;
+	/*Full batches, sent by workers of profile*/
+	switch_queue_t *batch_queue;
+	/*Own send queue, backlog of one profile doesn't hold others*/
+	uint32_t workers;
+	switch_queue_t *send_queue;
+	switch_thread_t **worker_threads;
 	char *method;
 	char *content_type;
 	char *post_data_template;
+	template_t *post_data;
+	/*post_data_template.<platform> variants by lower case platform*/
+	switch_hash_t *platform_templates;
+	template_t *cancel_data;
+	template_t *batch_data;
 	int timeout;
 	int connect_timeout;
 	http_auth_t *auth;
+	evict_rule_t *evict_rules;
+	char *cancel_template;
+	/*Content-Type and Basic/JWT Authorization, built once on load*/
+	switch_curl_slist_t *headers;
+	conn_pool_t *conns;
 };
 typedef struct profile_obj profile_t;
 
+#define APN_RESPONSE_BODY_MAX 2048
+#define APN_WAKE_RING 16
+#define APN_WAKE_BUCKETS 10
+#define APN_LOADTEST_REALM "loadtest.invalid"
+#define APN_LOADTEST_MAX_COUNT 1000000
+#define APN_LOADTEST_MAX_CONCURRENCY 256
+/*How long (sec) finished load test waits its pushes in flight*/
+#define APN_LOADTEST_DRAIN 30
+
+struct http_response_obj {
+	long code;
+	switch_size_t len;
+	char body[APN_RESPONSE_BODY_MAX];
+	/*Abort transfer when set (call is answered by other device)*/
+	volatile switch_bool_t *cancelled;
+	char challenge[512];
+	/*Whole body (results of batch), malloc'd*/
+	switch_bool_t keep_data;
+	char *data;
+	switch_size_t data_len;
+};
+typedef struct http_response_obj http_response_t;
+
+#define APN_BATCH_RESPONSE_MAX (1024 * 1024)
+
+struct push_batch_obj {
+	profile_t *profile;
+	char *payload;
+	switch_event_t *event;
+	cJSON *entries;
+	uint32_t count;
+	switch_time_t first_us;
+	/*Notifications with tokens in batch, released when batch is sent or dropped*/
+	struct push_job_group_obj **groups;
+	uint32_t groups_count;
+	uint32_t groups_size;
+	switch_bool_t sent;
+};
+typedef struct push_batch_obj push_batch_t;
+
+/* Pushes of one notification (uuid of waiter), lives while apn_wait waits for device */
+struct push_inflight_obj {
+	char *uuid;
+	volatile switch_bool_t cancelled;
+	int refs;
+	char *type;
+	char *user;
+	char *realm;
+	cJSON *sent;
+};
+typedef struct push_inflight_obj push_inflight_t;
+
+struct evict_item_obj {
+	char *token;
+	char *type;
+};
+typedef struct evict_item_obj evict_item_t;
+
+enum register_op {
+	REGISTER_UPSERT,
+	REGISTER_TOUCH	/* the same token tuple is already stored, refresh last_update only */
+};
+
+/* Token from REGISTER waiting for batched write */
+struct register_item_obj {
+	enum register_op op;
+	char *key;
+	const char *args[6];	/* token, extension, realm, app_id, type, platform */
+	char *data;
+};
+typedef struct register_item_obj register_item_t;
+
+/* Last stored state of token: key is hash of type/token (high half, picks home slot) and user/realm (low half),
+ * fp is hash of app_id/platform. 16 bytes per token, open addressing, key 0 is empty slot */
+struct register_fingerprint_obj {
+	uint64_t key;
+	uint32_t fp;
+	uint32_t touched;
+};
+typedef struct register_fingerprint_obj register_fingerprint_t;
+
+enum fingerprint_state {
+	FINGERPRINT_CHANGED,
+	FINGERPRINT_SAME,
+	FINGERPRINT_TOUCH	/* the same, but last_update should be refreshed */
+};
+
 struct callback {
 	cJSON *array;
 };
@@ -69,6 +509,11 @@ struct originate_register_data {
 	switch_mutex_t *mutex;
 	uint32_t *timelimit;
 	switch_bool_t wait_any_register;
+	switch_time_t register_us;
+	char *contact;
+	/*Parallel legs to all devices woken up within fork grace window*/
+	char *legs;
+	uint32_t legs_count;
 };
 typedef struct originate_register_data originate_register_t;
 
@@ -79,11 +524,26 @@ enum apn_state {
 };
 
 static void push_event_handler(switch_event_t *event);
+static switch_bool_t apn_stmt_exec(enum apn_stmt_id id, const char **argv, switch_core_db_callback_func_t callback, void *pdata);
+static switch_bool_t apn_stmt_exec_changes(enum apn_stmt_id id, const char **argv, switch_core_db_callback_func_t callback, void *pdata, int *changes);
+static switch_bool_t apn_stmt_exec_many(enum apn_stmt_id id, const char ***rows, int count);
+static switch_bool_t mod_apn_execute_sql_rows(char *sql, int *rows);
+static uint32_t apn_dim_ref(enum apn_dim dim, const char *name, switch_bool_t create, char *buf, switch_size_t len);
+static switch_bool_t apn_token_refs_resolve(apn_token_refs_t *refs, const char **args);
+static wakeup_bus_t *wakeup_bus_find(const char *name);
+static void token_store_remove(const char *user, const char *realm, const char *type, const char *token);
+static switch_bool_t token_store_has(const char *user, const char *realm, const char *type, const char *token, const char *app_id, const char *platform);
 
 struct response_event_data {
 	char uuid[SWITCH_UUID_FORMATTED_LENGTH + 1];
 	enum apn_state state;
 	switch_mutex_t *mutex;
+	switch_time_t response_ms;
+	uint32_t wake_deadline;
+	/*Push timeline, monotonic (switch_time_ref) us*/
+	switch_time_t lookup_us;
+	switch_time_t http_us;
+	switch_time_t response_us;
 };
 typedef struct response_event_data response_t;
 
@@ -105,6 +565,17 @@ static switch_cache_db_handle_t *mod_apn_get_db_handle(void)
 	return dbh;
 }
 
+static enum apn_db_kind apn_db_kind_of(const char *dsn)
+{
+	if (zstr(dsn)) {
+		return APN_DB_CORE;
+	}
+	if (!strncasecmp(dsn, "pgsql://", 8) || !strncasecmp(dsn, "postgresql://", 13)) {
+		return APN_DB_PGSQL;
+	}
+	return APN_DB_ODBC;
+}
+
 static void execute_sql_now(char **sqlp)
 {
 	char *sql;
@@ -112,1064 +583,8003 @@ static void execute_sql_now(char **sqlp)
 	switch_assert(sqlp && *sqlp);
 	sql = *sqlp;
 
-	switch_mutex_lock(globals.dbh_mutex);
 	switch_sql_queue_manager_push_confirm(globals.qm, sql, 0, SWITCH_FALSE);
-	switch_mutex_unlock(globals.dbh_mutex);
 
 	*sqlp = NULL;
 }
 
-
-static int do_curl(switch_event_t *event, profile_t *profile)
+static void launch_thread(switch_thread_t **thread, switch_thread_start_t func, void *obj)
 {
-	switch_CURL *curl_handle = NULL;
-	int httpRes = 0;
-	switch_curl_slist_t *headers = NULL;
-	char *query = NULL;
+	switch_threadattr_t *thd_attr = NULL;
 
-	const char *url_template = profile->url;
-	const char *method = profile->method;
-	const char *content_type = profile->content_type;
-
-	curl_handle = switch_curl_easy_init();
-	query = switch_event_expand_headers(event, url_template);
+	switch_threadattr_create(&thd_attr, globals.pool);
+	switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+	switch_thread_create(thread, thd_attr, func, obj, globals.pool);
+}
 
-	if (profile->connect_timeout) {
-		switch_curl_easy_setopt(curl_handle, CURLOPT_CONNECTTIMEOUT, profile->connect_timeout);
-	}
+static void join_thread(switch_thread_t **thread)
+{
+	switch_status_t st;
 
-	if (profile->timeout) {
-		switch_curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT, profile->timeout);
+	if (*thread) {
+		switch_thread_join(&st, *thread);
+		*thread = NULL;
 	}
+}
 
-	if (!strncasecmp(query, "https", 5)) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Not verifying TLS cert for %s; connection is not secure\n", query);
-		switch_curl_easy_setopt(curl_handle, CURLOPT_SSL_VERIFYPEER, 0);
-		switch_curl_easy_setopt(curl_handle, CURLOPT_SSL_VERIFYHOST, 0);
+static size_t http_response_write_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	http_response_t *response = (http_response_t *)userdata;
+	size_t realsize = size * nmemb;
+	size_t room = sizeof(response->body) - 1 - response->len;
+
+	/*Keep only the head of body, it's enough for find provider reason*/
+	if (room > 0) {
+		size_t copy = realsize < room ? realsize : room;
+		memcpy(response->body + response->len, ptr, copy);
+		response->len += copy;
+		response->body[response->len] = '\0';
 	}
 
-	if (!strcasecmp(method, "post")) {
-		if (!zstr(profile->post_data_template)) {
-			char *post_data = switch_event_expand_headers(event, profile->post_data_template);
-			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "method: %s, url: %s, data: %s\n", method, query,
-							  post_data);
-			switch_curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDSIZE, strlen(post_data));
-			switch_curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, (void *) post_data);
+	if (response->keep_data && response->data_len + realsize <= APN_BATCH_RESPONSE_MAX) {
+		char *data = realloc(response->data, response->data_len + realsize + 1);
 
-			if (post_data != profile->post_data_template)
-				switch_safe_free(post_data);
+		if (data) {
+			memcpy(data + response->data_len, ptr, realsize);
+			response->data = data;
+			response->data_len += realsize;
+			response->data[response->data_len] = '\0';
 		}
-		if (content_type) {
-			char *ct = switch_mprintf("Content-Type: %s", content_type);
-			headers = switch_curl_slist_append(headers, ct);
-			switch_safe_free(ct);
-		}
-	} else {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "method: %s, url: %s\n", method, query);
-		switch_curl_easy_setopt(curl_handle, CURLOPT_HTTPGET, 1);
-	}
-	switch_curl_easy_setopt(curl_handle, CURLOPT_FOLLOWLOCATION, 1);
-	switch_curl_easy_setopt(curl_handle, CURLOPT_MAXREDIRS, 15);
-	if (profile->auth) {
-		if (profile->auth->type == DIGEST) {
-			switch_curl_easy_setopt(curl_handle, CURLOPT_HTTPAUTH, CURLAUTH_DIGEST);
-			switch_curl_easy_setopt(curl_handle, CURLOPT_USERPWD, profile->auth->data);
-		} else if (profile->auth->type == BASIC) {
-			switch_curl_easy_setopt(curl_handle, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
-			switch_curl_easy_setopt(curl_handle, CURLOPT_USERPWD, profile->auth->data);
-		} else if (profile->auth->type == JWT && !zstr(profile->auth->data)) {
-			char *token = switch_mprintf("Authorization: Bearer %s", profile->auth->data);
-			headers = switch_curl_slist_append(headers, token);
-			switch_safe_free(token);
-		}
-	}
-	if (headers) {
-		switch_curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, headers);
 	}
-	switch_curl_easy_setopt(curl_handle, CURLOPT_URL, query);
-	switch_curl_easy_setopt(curl_handle, CURLOPT_NOSIGNAL, 1);
-	switch_curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "freeswitch-mod_apn/2.0");
 
-	switch_curl_easy_perform(curl_handle);
-	switch_curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &httpRes);
-	switch_curl_easy_cleanup(curl_handle);
-	switch_curl_slist_free_all(headers);
+	return realsize;
+}
 
-	if (query != url_template) switch_safe_free(query);
+static int http_response_xferinfo_callback(void *userdata, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
+{
+	http_response_t *response = (http_response_t *)userdata;
 
-	return httpRes;
+	return response->cancelled && *response->cancelled ? 1 : 0;
 }
 
-
-static switch_bool_t mod_apn_send(switch_event_t *event, profile_t *profile)
+static size_t http_response_header_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
 {
-	switch_bool_t ret = SWITCH_FALSE;
+	http_response_t *response = (http_response_t *)userdata;
+	size_t realsize = size * nmemb;
 
-	if (!profile) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "CARUSTO. APN profile not found\n");
-		return ret;
-	}
+	if (realsize > 24 && !strncasecmp(ptr, "WWW-Authenticate:", 17) && switch_stristr("digest", ptr)) {
+		size_t len = realsize < sizeof(response->challenge) - 1 ? realsize : sizeof(response->challenge) - 1;
 
-	if (do_curl(event, profile) == CURLE_OK) {
-		ret = SWITCH_TRUE;
+		memcpy(response->challenge, ptr, len);
+		response->challenge[len] = '\0';
+		while (len && (response->challenge[len - 1] == '\r' || response->challenge[len - 1] == '\n')) {
+			response->challenge[--len] = '\0';
+		}
 	}
 
-	return ret;
+	return realsize;
 }
 
-static char *mod_apn_execute_sql2str(char *sql, char *resbuf, size_t len)
+static void digest_copy_param(const char *challenge, const char *name, char *buf, switch_size_t len)
 {
-	char *ret = NULL, *err = NULL;
-	switch_cache_db_handle_t *dbh = NULL;
+	const char *p = challenge;
+	switch_size_t name_len = strlen(name), n = 0;
 
-	switch_mutex_lock(globals.dbh_mutex);
+	*buf = '\0';
 
-	if (!(dbh = mod_apn_get_db_handle())) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Error Opening DB\n");
-		switch_mutex_unlock(globals.dbh_mutex);
-		return NULL;
+	while ((p = switch_stristr(name, p))) {
+		/*Whole parameter name only: "nonce" is not part of "cnonce"*/
+		if ((p == challenge || strchr(" ,\t", *(p - 1))) && p[name_len] == '=') {
+			break;
+		}
+		p += name_len;
 	}
 
-	ret = switch_cache_db_execute_sql2str(dbh, sql, resbuf, len, &err);
-
-	switch_mutex_unlock(globals.dbh_mutex);
+	if (!p) {
+		return;
+	}
 
-	if (err) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "SQL ERR: [%s]\n%s\n", err, sql);
-		free(err);
+	p += name_len + 1;
+	if (*p == '"') {
+		for (p++; *p && *p != '"' && n < len - 1; p++) {
+			buf[n++] = *p;
+		}
+	} else {
+		for (; *p && *p != ',' && *p != ' ' && n < len - 1; p++) {
+			buf[n++] = *p;
+		}
 	}
+	buf[n] = '\0';
+}
 
-	switch_cache_db_release_db_handle(&dbh);
+/* Remember new challenge, returns SWITCH_TRUE when request should be repeated with it */
+static switch_bool_t digest_update(digest_state_t *digest, const char *challenge)
+{
+	char stale[8], nonce[sizeof(digest->nonce)];
+	switch_bool_t retry;
 
-	return ret;
+	digest_copy_param(challenge, "nonce", nonce, sizeof(nonce));
+	if (!*nonce) {
+		return SWITCH_FALSE;
+	}
+	digest_copy_param(challenge, "stale", stale, sizeof(stale));
+
+	switch_mutex_lock(digest->mutex);
+	/*Wrong credentials are answered by not stale challenge to known nonce, don't loop on them*/
+	retry = !*digest->nonce || switch_true(stale) || strcmp(digest->nonce, nonce);
+	switch_copy_string(digest->nonce, nonce, sizeof(digest->nonce));
+	digest_copy_param(challenge, "realm", digest->realm, sizeof(digest->realm));
+	digest_copy_param(challenge, "opaque", digest->opaque, sizeof(digest->opaque));
+	digest_copy_param(challenge, "qop", digest->qop, sizeof(digest->qop));
+	digest_copy_param(challenge, "algorithm", digest->algorithm, sizeof(digest->algorithm));
+	/*"auth,auth-int" - only auth is supported*/
+	if (switch_stristr("auth", digest->qop)) {
+		switch_copy_string(digest->qop, "auth", sizeof(digest->qop));
+	}
+	digest->nc = 0;
+	switch_mutex_unlock(digest->mutex);
+
+	return retry;
 }
 
-static switch_bool_t mod_apn_execute_sql_callback(char *sql, switch_core_db_callback_func_t callback, void *pdata)
+/* Authorization header from cached challenge (RFC 2617, MD5 and MD5-sess), NULL while there is no challenge yet */
+static char *digest_authorization(digest_state_t *digest, const char *method, const char *url)
 {
-	switch_bool_t ret = SWITCH_FALSE;
-	char *errmsg = NULL;
-	switch_cache_db_handle_t *dbh = NULL;
+	char ha1[SWITCH_MD5_DIGEST_STRING_SIZE], ha2[SWITCH_MD5_DIGEST_STRING_SIZE], res[SWITCH_MD5_DIGEST_STRING_SIZE];
+	char cnonce[SWITCH_UUID_FORMATTED_LENGTH + 1], nc[9];
+	const char *uri = "/", *p;
+	char *tmp, *header = NULL;
+	switch_bool_t qop, sess;
+
+	if ((p = strstr(url, "://")) && (p = strchr(p + 3, '/'))) {
+		uri = p;
+	}
 
-	if (!(dbh = mod_apn_get_db_handle())) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Error Opening DB\n");
+	switch_mutex_lock(digest->mutex);
+	if (zstr(digest->nonce)) {
 		goto end;
 	}
 
-	switch_cache_db_execute_sql_callback(dbh, sql, callback, pdata, &errmsg);
+	qop = !zstr(digest->qop);
+	sess = !strcasecmp(digest->algorithm, "MD5-sess");
+	switch_uuid_str(cnonce, sizeof(cnonce));
+	switch_snprintf(nc, sizeof(nc), "%08x", ++digest->nc);
+
+	tmp = switch_mprintf("%s:%s:%s", digest->username, digest->realm, digest->password);
+	switch_md5_string(ha1, tmp, strlen(tmp));
+	switch_safe_free(tmp);
+	if (sess) {
+		tmp = switch_mprintf("%s:%s:%s", ha1, digest->nonce, cnonce);
+		switch_md5_string(ha1, tmp, strlen(tmp));
+		switch_safe_free(tmp);
+	}
 
-	if (errmsg) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "SQL ERR: [%s] %s\n", sql, errmsg);
-		free(errmsg);
+	tmp = switch_mprintf("%s:%s", method, uri);
+	switch_md5_string(ha2, tmp, strlen(tmp));
+	switch_safe_free(tmp);
+
+	if (qop) {
+		tmp = switch_mprintf("%s:%s:%s:%s:%s:%s", ha1, digest->nonce, nc, cnonce, digest->qop, ha2);
+	} else {
+		tmp = switch_mprintf("%s:%s:%s", ha1, digest->nonce, ha2);
 	}
+	switch_md5_string(res, tmp, strlen(tmp));
+	switch_safe_free(tmp);
 
-end:
-	if (dbh) {
-		switch_cache_db_release_db_handle(&dbh);
+	if (qop) {
+		tmp = switch_mprintf(", qop=auth, nc=%s, cnonce=\"%s\"", nc, cnonce);
 	}
+	header = switch_mprintf("Authorization: Digest username=\"%s\", realm=\"%s\", nonce=\"%s\", uri=\"%s\", response=\"%s\"%s%s%s%s%s%s",
+							digest->username, digest->realm, digest->nonce, uri, res,
+							zstr(digest->opaque) ? "" : ", opaque=\"", zstr(digest->opaque) ? "" : digest->opaque, zstr(digest->opaque) ? "" : "\"",
+							zstr(digest->algorithm) ? "" : ", algorithm=", zstr(digest->algorithm) ? "" : digest->algorithm, switch_str_nil(tmp));
+	switch_safe_free(tmp);
 
-	return ret;
+end:
+	switch_mutex_unlock(digest->mutex);
+
+	return header;
 }
 
-static int sql2str_callback(void *pArg, int argc, char **argv, char **columnNames)
+/* Split url of profile to host and port, gateway host with template variables can't be pinned */
+static switch_bool_t conn_pool_parse_url(conn_pool_t *conns, const char *url, switch_memory_pool_t *pool)
 {
-	callback_t *cbt = (callback_t *) pArg;
-	cJSON *item = NULL;
+	const char *p, *end;
+	char *host;
 
-	if (!cbt) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Something wrong with callback structure\n");
-		return 0;
+	if (!(p = strstr(url, "://"))) {
+		return SWITCH_FALSE;
 	}
 
-	if (argc < 3) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Something wrong with SQL callback (%d)\n", argc);
-		return 0;
+	conns->https = !strncasecmp(url, "https", 5);
+	p += 3;
+	end = p + strcspn(p, "/?#");
+	host = switch_core_alloc(pool, end - p + 1);
+	memcpy(host, p, end - p);
+
+	if (strchr(host, '$') || strchr(host, '@') || *host == '[') {
+		return SWITCH_FALSE;
 	}
 
-	if (zstr(argv[0]) || zstr(argv[1]) || zstr(argv[2])) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Something wrong with SQL callback (token: '%s', platform: '%s', app_id: '%s')\n", argv[0], argv[1], argv[2]);
-		return 0;
+	if ((conns->port = strchr(host, ':'))) {
+		*conns->port++ = '\0';
+	} else {
+		conns->port = conns->https ? "443" : "80";
 	}
+	conns->host = host;
 
-	item = cJSON_CreateObject();
-	cJSON_AddItemToArray(cbt->array, item);
-	cJSON_AddItemToObject(item, "platform", cJSON_CreateString(argv[0]));
-	cJSON_AddItemToObject(item, "app_id", cJSON_CreateString(argv[1]));
-	cJSON_AddItemToObject(item, "token", cJSON_CreateString(argv[2]));
+	if (!conns->warm_url) {
+		conns->warm_url = switch_core_sprintf(pool, "%s://%s:%s/", conns->https ? "https" : "http", conns->host, conns->port);
+	}
 
-	return 0;
+	return SWITCH_TRUE;
 }
 
-#define APN_USAGE """{\"uuid\":\"\",\"realm\":\"\",\"user\":\"\",\"type\":\"[im|voip]\",\"payload\":{\"body\":\"\",\"sound\":\"\",\"\":[{\"name\":\"\",\"value\":\"\"},\"image\":\"\",\"category\":\"\"}}"""
-SWITCH_STANDARD_API(apn_api_function)
+/* getaddrinfo() is done here, by load and by keeper thread only */
+static void conn_pool_resolve(profile_t *profile)
 {
-	char *pdata = NULL, *json_payload = NULL;
-	cJSON *root = NULL, *payload = NULL;
-	switch_event_t *event = NULL;
-	switch_status_t res = SWITCH_STATUS_FALSE;
+	conn_pool_t *conns = profile->conns;
+	struct addrinfo hints, *res = NULL;
+	char addr[INET6_ADDRSTRLEN] = "";
+	int err;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if ((err = getaddrinfo(conns->host, conns->port, &hints, &res)) || !res) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Can't resolve %s of profile '%s': %s, keep previous address\n",
+						  conns->host, profile->name, gai_strerror(err));
+		switch_mutex_lock(conns->mutex);
+		conns->resolve_failures++;
+		conns->resolved_at = switch_epoch_time_now(NULL);
+		switch_mutex_unlock(conns->mutex);
+		return;
+	}
 
-	if (cmd) {
-		pdata = strdup(cmd);
+	if (res->ai_family == AF_INET6) {
+		inet_ntop(AF_INET6, &((struct sockaddr_in6 *) res->ai_addr)->sin6_addr, addr, sizeof(addr));
+	} else {
+		inet_ntop(AF_INET, &((struct sockaddr_in *) res->ai_addr)->sin_addr, addr, sizeof(addr));
 	}
 
-	if (!pdata) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "No data\n");
-		stream->write_function(stream, "USAGE: %s", APN_USAGE);
-		goto end;
+	switch_mutex_lock(conns->mutex);
+	switch_snprintf(conns->resolve, sizeof(conns->resolve), res->ai_family == AF_INET6 ? "%s:%s:[%s]" : "%s:%s:%s", conns->host, conns->port, addr);
+	conns->resolved_at = switch_epoch_time_now(NULL);
+	switch_mutex_unlock(conns->mutex);
+
+	freeaddrinfo(res);
+}
+
+/* CURLOPT_RESOLVE entry of pinned address, list lives until transfer is done */
+static switch_curl_slist_t *conn_pool_resolve_list(conn_pool_t *conns)
+{
+	switch_curl_slist_t *list = NULL;
+
+	if (!conns || !conns->resolve_host) {
+		return NULL;
 	}
 
-	root = cJSON_Parse(pdata);
-	if (!root) {
-		stream->write_function(stream, "Wrong JSON data. USAGE: %s", APN_USAGE);
-		goto end;
+	switch_mutex_lock(conns->mutex);
+	if (!zstr(conns->resolve)) {
+		list = switch_curl_slist_append(list, conns->resolve);
 	}
+	switch_mutex_unlock(conns->mutex);
 
-	if (switch_event_create(&event, SWITCH_EVENT_CUSTOM) != SWITCH_STATUS_SUCCESS) {
-		stream->write_function(stream, "Can't create event");
-		goto end;
+	return list;
+}
+
+static switch_CURL *conn_acquire(profile_t *profile)
+{
+	conn_pool_t *conns = profile->conns;
+	conn_t *conn = NULL;
+	switch_CURL *curl = NULL;
+
+	if (!conns) {
+		return switch_curl_easy_init();
 	}
 
-	payload = cJSON_GetObjectItem(root, "payload");
-	if (payload) {
-		json_payload = cJSON_PrintUnformatted(payload);
-		switch_event_add_body(event, json_payload);
+	switch_mutex_lock(conns->mutex);
+	if ((conn = conns->idle)) {
+		conns->idle = conn->next;
+		conns->idle_count--;
+		conns->reused++;
+	} else {
+		conns->created++;
 	}
-	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "type", cJSON_GetObjectCstr(root, "type"));
-	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "user", cJSON_GetObjectCstr(root, "user"));
-	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "realm", cJSON_GetObjectCstr(root, "realm"));
-	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "uuid", cJSON_GetObjectCstr(root, "uuid"));
+	conns->busy_count++;
+	switch_mutex_unlock(conns->mutex);
 
-	push_event_handler(event);
+	if (conn) {
+		curl = conn->curl;
+		free(conn);
+	} else {
+		curl = switch_curl_easy_init();
+	}
 
-	res = SWITCH_STATUS_SUCCESS;
-	stream->write_function(stream, "Sent");
+	return curl;
+}
 
-end:
+/* Keep handle with its connection while pool has room, broken ones are closed */
+static void conn_release(profile_t *profile, switch_CURL *curl, switch_bool_t reusable)
+{
+	conn_pool_t *conns = profile->conns;
+	conn_t *conn = NULL;
 
-	if (event) {
-		switch_event_destroy(&event);
+	if (!conns) {
+		switch_curl_easy_cleanup(curl);
+		return;
 	}
 
-	if (root) {
-		cJSON_Delete(root);
+	switch_mutex_lock(conns->mutex);
+	conns->busy_count--;
+	if (reusable && conns->idle_count < conns->warm_connections) {
+		switch_zmalloc(conn, sizeof(*conn));
+		curl_easy_reset(curl);
+		conn->curl = curl;
+		conn->last_used = switch_epoch_time_now(NULL);
+		conn->next = conns->idle;
+		conns->idle = conn;
+		conns->idle_count++;
 	}
+	switch_mutex_unlock(conns->mutex);
 
-	switch_safe_free(json_payload);
-	switch_safe_free(pdata);
-
-	return res;
+	if (!conn) {
+		switch_curl_easy_cleanup(curl);
+	}
 }
 
-// auth_type: "none|jwt|basic|digest"
-// auth_data: "token"|"login:password"
-static http_auth_t *parse_auth_param(char *auth_type, char *auth_data, switch_memory_pool_t *pool)
+/* HEAD to gateway: opens connection of new handle or keeps idle one alive */
+static switch_bool_t conn_ping(profile_t *profile, switch_CURL *curl)
 {
-	http_auth_t *res = NULL;
+	conn_pool_t *conns = profile->conns;
+	switch_curl_slist_t *resolve = conn_pool_resolve_list(conns);
+	CURLcode res;
+
+	switch_curl_easy_setopt(curl, CURLOPT_URL, conns->warm_url);
+	switch_curl_easy_setopt(curl, CURLOPT_NOBODY, 1);
+	switch_curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
+	switch_curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1);
+	switch_curl_easy_setopt(curl, CURLOPT_USERAGENT, "freeswitch-mod_apn/2.0");
+	switch_curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, profile->connect_timeout ? profile->connect_timeout : 10);
+	switch_curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10);
+	if (conns->https) {
+		switch_curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
+		switch_curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0);
+	}
+	if (resolve) {
+		switch_curl_easy_setopt(curl, CURLOPT_RESOLVE, resolve);
+	}
 
-	if ((res = switch_core_alloc(pool, sizeof(*res))) == NULL) {
-		return NULL;
+	res = switch_curl_easy_perform(curl);
+	curl_easy_reset(curl);
+	switch_curl_slist_free_all(resolve);
+
+	switch_mutex_lock(conns->mutex);
+	conns->pings++;
+	if (res != CURLE_OK) {
+		conns->ping_failures++;
 	}
-	res->type = NONE;
+	switch_mutex_unlock(conns->mutex);
 
-	if (zstr(auth_type)) {
-		return res;
+	return res == CURLE_OK ? SWITCH_TRUE : SWITCH_FALSE;
+}
+
+/* Top up pool to warm_connections and ping handles idle longer than keepalive_interval */
+static void conn_pool_maintain(profile_t *profile)
+{
+	conn_pool_t *conns = profile->conns;
+	time_t now = switch_epoch_time_now(NULL);
+	conn_t *stale = NULL, **link, *conn;
+	switch_CURL *curl;
+	uint32_t missing;
+
+	switch_mutex_lock(conns->mutex);
+	for (link = &conns->idle; (conn = *link);) {
+		if (conns->keepalive_interval && now - conn->last_used >= (time_t) conns->keepalive_interval) {
+			*link = conn->next;
+			conn->next = stale;
+			stale = conn;
+			conns->idle_count--;
+			conns->busy_count++;
+		} else {
+			link = &conn->next;
+		}
+	}
+	missing = conns->idle_count + conns->busy_count < conns->warm_connections ? conns->warm_connections - conns->idle_count - conns->busy_count : 0;
+	conns->busy_count += missing;
+	switch_mutex_unlock(conns->mutex);
+
+	while ((conn = stale)) {
+		stale = conn->next;
+		curl = conn->curl;
+		free(conn);
+		conn_release(profile, curl, conn_ping(profile, curl));
 	}
 
-	if (!zstr(auth_type)) {
-		if (!strcasecmp(auth_type, "jwt")) {
-			res->type = JWT;
-		} else if (!strcasecmp(auth_type, "basic")) {
-			res->type = BASIC;
-		} else if (!strcasecmp(auth_type, "digest")) {
-			res->type = DIGEST;
-		} else if (!strcasecmp(auth_type, "none")) {
-			res->type = NONE;
-		} else {
-			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "mod_apn doesn't support type auth: %s\n", auth_type);
-		}
-
-		if (!zstr(auth_data)) {
-			res->data = switch_core_strdup(pool, auth_data);
-		} else {
-			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Something wrong with auth data\n");
-			res->type = NONE;
-		}
+	for (; missing > 0; missing--) {
+		curl = switch_curl_easy_init();
+		switch_mutex_lock(conns->mutex);
+		conns->created++;
+		switch_mutex_unlock(conns->mutex);
+		conn_release(profile, curl, conn_ping(profile, curl));
 	}
-
-	return res;
 }
 
-static switch_status_t do_config(switch_memory_pool_t *pool)
+static void conn_pool_destroy(profile_t *profile)
 {
-	char *cf = "apn.conf";
-	switch_xml_t cfg, xml, settings, param, x_profile, x_profiles;
-	switch_status_t status = SWITCH_STATUS_SUCCESS;
-	profile_t *profile = NULL;
-	switch_cache_db_handle_t *dbh = NULL;
+	conn_pool_t *conns = profile->conns;
+	conn_t *conn;
 
-	if (!(xml = switch_xml_open_cfg(cf, &cfg, NULL))) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "open of %s failed\n", cf);
-		return SWITCH_STATUS_TERM;
+	if (!conns) {
+		return;
 	}
 
-	if (globals.db_online) {
-		switch_mutex_destroy(globals.dbh_mutex);
-		globals.db_online = 0;
+	switch_mutex_lock(conns->mutex);
+	while ((conn = conns->idle)) {
+		conns->idle = conn->next;
+		switch_curl_easy_cleanup(conn->curl);
+		free(conn);
 	}
+	conns->idle_count = 0;
+	switch_mutex_unlock(conns->mutex);
+}
 
-	if (globals.qm) {
-		switch_sql_queue_manager_destroy(&globals.qm);
-		globals.qm = NULL;
-	}
+static void *SWITCH_THREAD_FUNC conn_keeper_thread_run(switch_thread_t *thread, void *obj)
+{
+	switch_hash_index_t *hi;
+	profile_t *profile;
+	time_t now;
 
-	memset(&globals, 0, sizeof(globals));
-	globals.pool = pool;
-	globals.db_online = 1;
-	switch_mutex_init(&globals.dbh_mutex, SWITCH_MUTEX_NESTED, pool);
+	while (globals.running) {
+		switch_yield(1000000);
 
-	if ((settings = switch_xml_child(cfg, "settings"))) {
-		for (param = switch_xml_child(settings, "param"); param; param = param->next) {
-			char *var = NULL;
-			char *val = NULL;
-			var = (char *) switch_xml_attr_soft(param, "name");
-			val = (char *) switch_xml_attr_soft(param, "value");
-			if (!strcasecmp(var, "odbc_dsn") && !zstr(val)) {
-				globals.odbc_dsn = switch_core_strdup(globals.pool, val);
-			} else if (!strcasecmp(var, "contact_voip_token_param") && !zstr(val)) {
-				globals.contact_voip_token_param = switch_core_strdup(globals.pool, val);
-			} else if (!strcasecmp(var, "contact_platform_param") && !zstr(val)) {
-				globals.contact_platform_param = switch_core_strdup(globals.pool, val);
-			} else if (!strcasecmp(var, "contact_im_token_param") && !zstr(val)) {
-				globals.contact_im_token_param = switch_core_strdup(globals.pool, val);
-			} else if (!strcasecmp(var, "contact_app_id_param") && !zstr(val)) {
-				globals.contact_app_id_param = switch_core_strdup(globals.pool, val);
+		for (hi = switch_core_hash_first(globals.profile_hash); hi && globals.running; hi = switch_core_hash_next(&hi)) {
+			const void *key;
+			void *val;
+
+			switch_core_hash_this(hi, &key, NULL, &val);
+			profile = (profile_t *) val;
+			if (!profile->conns) {
+				continue;
 			}
+
+			now = switch_epoch_time_now(NULL);
+			if (profile->conns->resolve_host && profile->conns->dns_refresh && now - profile->conns->resolved_at >= (time_t) profile->conns->dns_refresh) {
+				conn_pool_resolve(profile);
+			}
+			conn_pool_maintain(profile);
 		}
+		switch_safe_free(hi);
 	}
 
-	if (zstr(globals.contact_voip_token_param)) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "contact_voip_token_param not set\n");
-		switch_goto_status(SWITCH_STATUS_FALSE, done);
-	}
+	return NULL;
+}
 
-	if (zstr(globals.contact_platform_param)) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "contact_platform_param not set\n");
-		switch_goto_status(SWITCH_STATUS_FALSE, done);
-	}
+static void conn_pool_dump(switch_stream_handle_t *stream)
+{
+	switch_hash_index_t *hi;
+	profile_t *profile;
+	conn_pool_t *conns;
+	time_t now = switch_epoch_time_now(NULL);
 
-	if (zstr(globals.contact_app_id_param)) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "contact_app_id_param not set\n");
-		switch_goto_status(SWITCH_STATUS_FALSE, done);
-	}
+	for (hi = switch_core_hash_first(globals.profile_hash); hi; hi = switch_core_hash_next(&hi)) {
+		const void *key;
+		void *val;
 
-	if (globals.odbc_dsn) {
-		if (!(dbh = mod_apn_get_db_handle())) {
-			globals.odbc_dsn = NULL;
+		switch_core_hash_this(hi, &key, NULL, &val);
+		profile = (profile_t *) val;
+
+		if (!(conns = profile->conns)) {
+			stream->write_function(stream, "%s: no pinning, no warm connections\n", profile->name);
+			continue;
 		}
-	}
 
-	if (zstr(globals.odbc_dsn)) {
-		globals.dbname = "carusto";
-		dbh = mod_apn_get_db_handle();
+		switch_mutex_lock(conns->mutex);
+		stream->write_function(stream, "%s: host %s:%s, pinned %s (%ld sec ago, %u failures)\n", profile->name, conns->host, conns->port,
+							   conns->resolve_host && !zstr(conns->resolve) ? conns->resolve : "no", conns->resolved_at ? (long)(now - conns->resolved_at) : -1L,
+							   conns->resolve_failures);
+		stream->write_function(stream, "%s: warm %u, idle %u, busy %u, reused %" SWITCH_UINT64_T_FMT ", created %" SWITCH_UINT64_T_FMT
+							   ", pings %" SWITCH_UINT64_T_FMT " (%" SWITCH_UINT64_T_FMT " failed)\n", profile->name, conns->warm_connections,
+							   conns->idle_count, conns->busy_count, conns->reused, conns->created, conns->pings, conns->ping_failures);
+		switch_mutex_unlock(conns->mutex);
 	}
+}
 
-	if (!dbh) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "dbh is NULL\n");
-		switch_goto_status(SWITCH_STATUS_FALSE, done);
+/* Milliseconds left before header deadline-ms (epoch ms) of push, -1 when push has no deadline */
+static long push_deadline_left(switch_event_t *event)
+{
+	const char *val = switch_event_get_header(event, "deadline-ms");
+	int64_t deadline, now;
+
+	if (zstr(val) || (deadline = strtoll(val, NULL, 10)) <= 0) {
+		return -1;
 	}
 
-	switch_core_hash_init(&globals.profile_hash);
-	if ((x_profiles = switch_xml_child(cfg, "profiles"))) {
-		for (x_profile = switch_xml_child(x_profiles, "profile"); x_profile; x_profile = x_profile->next) {
-			char *name = (char *) switch_xml_attr_soft(x_profile, "name");
-			char *id_s = NULL, *url = NULL, *method = NULL, *auth_type = NULL, *auth_data = NULL, *content_type = NULL,
-					*connect_timeout = NULL, *timeout = NULL, *post_data_template = NULL;
+	now = switch_micro_time_now() / 1000;
 
-			for (param = switch_xml_child(x_profile, "param"); param; param = param->next) {
-				char *var, *val;
-				var = (char *) switch_xml_attr_soft(param, "name");
-				val = (char *) switch_xml_attr_soft(param, "value");
+	return deadline > now ? (long)(deadline - now) : 0;
+}
 
-				if (!strcasecmp(var, "id") && !zstr(val)) {
-					id_s = val;
-				} else if (!strcasecmp(var, "url") && !zstr(val)) {
-					url = val;
-				} else if (!strcasecmp(var, "method") && !zstr(val)) {
-					method = val;
-				} else if (!strcasecmp(var, "auth_type") && !zstr(val)) {
-					auth_type = val;
-				} else if (!strcasecmp(var, "auth_data") && !zstr(val)) {
-					auth_data = val;
-				} else if (!strcasecmp(var, "content_type") && !zstr(val)) {
-					content_type = val;
-				} else if (!strcasecmp(var, "connect_timeout") && !zstr(val)) {
-					connect_timeout = val;
-				} else if (!strcasecmp(var, "timeout") && !zstr(val)) {
-					timeout = val;
-				} else if (!strcasecmp(var, "post_data_template") && !zstr(val)) {
-					post_data_template = val;
-				}
+/* Only plain ${name} variables are compiled, anything else is left to switch_event_expand_headers */
+static template_t *template_compile(const char *source, switch_memory_pool_t *pool)
+{
+	template_t *tpl = switch_core_alloc(pool, sizeof(*tpl));
+	template_part_t *head = NULL, **tail = &head, *part;
+	const char *p = source, *start, *end, *c;
+
+	memset(tpl, 0, sizeof(*tpl));
+	tpl->source = switch_core_strdup(pool, source);
+
+	while (*p) {
+		start = strstr(p, "${");
+		part = switch_core_alloc(pool, sizeof(*part));
+		memset(part, 0, sizeof(*part));
+
+		part->len = start ? (switch_size_t)(start - p) : strlen(p);
+		part->text = switch_core_alloc(pool, part->len + 1);
+		memcpy(part->text, p, part->len);
+		part->text[part->len] = '\0';
+
+		if (start) {
+			if (!(end = strchr(start + 2, '}')) || end == start + 2) {
+				return tpl;
 			}
-
-			if (zstr(url) || zstr(method)) {
-				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "No url (%s) or method (%s) specified.\n", url, method);
-				goto done;
+			for (c = start + 2; c < end; c++) {
+				if (!isalnum((unsigned char) *c) && *c != '_' && *c != '-' && *c != '.') {
+					return tpl;
+				}
 			}
+			part->var = switch_core_alloc(pool, end - start - 1);
+			memcpy(part->var, start + 2, end - start - 2);
+			part->var[end - start - 2] = '\0';
+			tpl->vars++;
+			p = end + 1;
+		} else {
+			p += part->len;
+		}
 
-			if (strcasecmp(method, "get") && strcasecmp(method, "post")) {
-				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Method %s doesn't support\n", method);
-				goto done;
-			}
+		*tail = part;
+		tail = &part->next;
+	}
 
-			if (zstr(name)) {
-				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "No name specified.\n");
-			} else {
-				profile = switch_core_alloc(globals.pool, sizeof(*profile));
-				memset(profile, 0, sizeof(profile_t));
-				profile->name = switch_core_strdup(globals.pool, name);
+	tpl->parts = head;
+	return tpl;
+}
 
-				if (!zstr(id_s)) {
-					profile->id = (uint16_t)strtol(id_s, NULL, 10);
-				}
+/* Substitute values into compiled template, result is malloc'd. Like switch_event_expand_headers,
+ * name which isn't header of event is looked up in global variables */
+static char *template_render(template_t *tpl, switch_event_t *event)
+{
+	template_part_t *part;
+	switch_size_t len = 0, vlen;
+	const char **vals = NULL;
+	char **globals_vals = NULL, *out, *o;
+	uint32_t i;
+
+	if (!tpl->parts) {
+		out = switch_event_expand_headers(event, tpl->source);
+		return out == tpl->source ? strdup(out) : out;
+	}
 
-				profile->url = switch_core_strdup(globals.pool, url);
-				profile->method = switch_core_strdup(globals.pool, method);
-				if (!zstr(content_type)) {
-					profile->content_type = switch_core_strdup(globals.pool, content_type);
-				}
-				if (!zstr(connect_timeout)) {
-					profile->connect_timeout = (int)strtol(connect_timeout, NULL, 10);
-				}
-				if (!zstr(timeout)) {
-					profile->timeout = (int)strtol(timeout, NULL, 10);
-				}
-				if (!zstr(post_data_template)) {
-					profile->post_data_template = switch_core_strdup(globals.pool, post_data_template);
-				} else {
-					profile->post_data_template = switch_core_strdup(globals.pool, "{\"type\": \"${type}\",\"app\":\"${app_id}\","
-																				   "\"token\":\"${token}\",\"user\":\"${user}\","
-																				   "\"realm\":\"${realm}\",\"payload\":${payload}"
-																				   "\"platform\":\"${platform}\"}");
-				}
-				profile->auth = parse_auth_param(auth_type, auth_data, globals.pool);
-				if (!zstr(content_type)) {
-					profile->content_type = switch_core_strdup(globals.pool, content_type);
-				}
+	if (tpl->vars) {
+		switch_zmalloc(vals, sizeof(*vals) * tpl->vars);
+		switch_zmalloc(globals_vals, sizeof(*globals_vals) * tpl->vars);
+	}
 
-				switch_core_hash_insert(globals.profile_hash, profile->name, profile);
-				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Loaded APN profile '%s'\n", profile->name);
+	for (part = tpl->parts, i = 0; part; part = part->next) {
+		len += part->len;
+		if (part->var) {
+			if (!(vals[i] = switch_event_get_header(event, part->var))) {
+				vals[i] = globals_vals[i] = switch_core_get_variable_dup(part->var);
+			}
+			if (vals[i]) {
+				len += strlen(vals[i]);
 			}
+			i++;
 		}
-	} else {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "No APN profiles defined.\n");
 	}
 
-	switch_sql_queue_manager_init_name("mod_apn", &globals.qm, 2, globals.odbc_dsn ? globals.odbc_dsn : globals.dbname, SWITCH_MAX_TRANS, NULL, NULL, NULL, NULL);
-	switch_sql_queue_manager_start(globals.qm);
+	switch_malloc(out, len + 1);
+	o = out;
+	for (part = tpl->parts, i = 0; part; part = part->next) {
+		memcpy(o, part->text, part->len);
+		o += part->len;
+		if (part->var) {
+			if (vals[i]) {
+				vlen = strlen(vals[i]);
+				memcpy(o, vals[i], vlen);
+				o += vlen;
+			}
+			i++;
+		}
+	}
+	*o = '\0';
 
-done:
-	if (dbh) {
-		switch_cache_db_release_db_handle(&dbh);
+	for (i = 0; i < tpl->vars; i++) {
+		switch_safe_free(globals_vals[i]);
 	}
-	switch_xml_free(xml);
-	return status;
+	switch_safe_free(globals_vals);
+	switch_safe_free(vals);
+
+	return out;
 }
 
-static void db_get_tokens_array(char *user, char *realm, char *type, callback_t *cbt)
+/* Variant of body for platform of token, default template otherwise */
+static char *profile_render_body(profile_t *profile, switch_event_t *event)
 {
-	char *query = NULL;
-	if (zstr(user) || zstr(realm)) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. No parameters for get token. user: '%s', realm: '%s'\n", user, realm);
-		return;
+	const char *platform = switch_event_get_header(event, "platform");
+	template_t *tpl = profile->post_data;
+	char key[64], *k;
+
+	if (profile->platform_templates && !zstr(platform)) {
+		switch_copy_string(key, platform, sizeof(key));
+		for (k = key; *k; k++) {
+			*k = (char) switch_tolower(*k);
+		}
+		if ((k = switch_core_hash_find(profile->platform_templates, key))) {
+			tpl = (template_t *) k;
+		}
 	}
 
-	query = switch_mprintf("SELECT platform, app_id, token FROM push_tokens WHERE extension = '%q' AND realm = '%q' AND type = '%q'", user, realm, type);
-	mod_apn_execute_sql_callback(query, sql2str_callback, cbt);
+	if (!tpl) {
+		char *out = switch_event_expand_headers(event, profile->post_data_template);
+		return out == profile->post_data_template ? strdup(out) : out;
+	}
 
-	switch_safe_free(query);
+	return template_render(tpl, event);
 }
 
-static void add_item_to_event(switch_event_t *event, char *name, cJSON *obj)
+/* Definitive answer of gateway (delivered or rejected token). Transport errors, 5xx and 429 are troubles of gateway */
+static switch_bool_t endpoint_answered(CURLcode res, http_response_t *response)
 {
-	if (zstr(name) || !event || !obj) {
+	return res == CURLE_OK && response->code > 0 && response->code < 500 && response->code != 429 ? SWITCH_TRUE : SWITCH_FALSE;
+}
+
+/* Endpoint leaves rotation when error rate or latency goes over limits of profile, comes back after successful probe */
+static void endpoint_report(profile_t *profile, endpoint_t *endpoint, switch_bool_t answered, uint32_t latency_ms)
+{
+	time_t now = switch_epoch_time_now(NULL);
+
+	if (!endpoint) {
 		return;
 	}
 
-	switch_event_del_header(event, name);
-	if (obj->type == cJSON_String && obj->valuestring && !zstr(obj->valuestring)) {
-		switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, name, obj->valuestring);
+	switch_mutex_lock(endpoint->mutex);
+	endpoint->requests++;
+	if (!answered) {
+		endpoint->failures++;
 	}
+	endpoint->error_rate = (endpoint->error_rate * 9 + (answered ? 0 : 1000)) / 10;
+	endpoint->latency = endpoint->latency ? (endpoint->latency * 7 + latency_ms) / 8 : latency_ms;
+
+	if (endpoint->healthy) {
+		if (endpoint->requests >= APN_ENDPOINT_MIN_SAMPLES && (endpoint->error_rate > profile->unhealthy_error_rate * 10 ||
+			(profile->unhealthy_latency && endpoint->latency > profile->unhealthy_latency))) {
+			endpoint->healthy = SWITCH_FALSE;
+			endpoint->retry_at = now + profile->unhealthy_retry;
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "CARUSTO. Endpoint %s of profile '%s' is unhealthy (errors %u%%, latency %u ms)\n",
+							  endpoint->url, profile->name, endpoint->error_rate / 10, endpoint->latency);
+		}
+	} else if (answered && (!profile->unhealthy_latency || latency_ms <= profile->unhealthy_latency)) {
+		endpoint->healthy = SWITCH_TRUE;
+		endpoint->error_rate = 0;
+		endpoint->latency = latency_ms;
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "CARUSTO. Endpoint %s of profile '%s' is back in rotation\n", endpoint->url, profile->name);
+	} else {
+		endpoint->retry_at = now + profile->unhealthy_retry;
+	}
+	switch_mutex_unlock(endpoint->mutex);
 }
 
-static void push_event_handler(switch_event_t *event)
+/* Healthy endpoints and ones due for probe in configured order, the rest as last resort */
+static uint32_t endpoint_order(profile_t *profile, endpoint_t **order)
 {
-	char *payload = NULL, *user = NULL, *realm = NULL, *type = NULL, *uuid = NULL, *json_tokens = NULL;
-	profile_t *profile = NULL;
-	callback_t cbt = { cJSON_CreateArray() };
-	switch_bool_t res = SWITCH_FALSE;
-	cJSON *iterator;
-	int size, i;
-	switch_event_t *res_event;
-
-	payload = switch_event_get_body(event);
-	type = switch_event_get_header(event, "type");
-	user = switch_event_get_header(event, "user");
-	realm = switch_event_get_header(event, "realm");
-	uuid = switch_event_get_header(event, "uuid");
+	endpoint_t *endpoint;
+	time_t now = switch_epoch_time_now(NULL);
+	switch_bool_t usable;
+	uint32_t count = 0;
+	int pass;
+
+	for (pass = 0; pass < 2; pass++) {
+		for (endpoint = profile->endpoints; endpoint; endpoint = endpoint->next) {
+			switch_mutex_lock(endpoint->mutex);
+			usable = endpoint->healthy || endpoint->retry_at <= now ? SWITCH_TRUE : SWITCH_FALSE;
+			if (pass == 0 && usable && !endpoint->healthy) {
+				/*One probe per unhealthy_retry*/
+				endpoint->retry_at = now + profile->unhealthy_retry;
+			}
+			switch_mutex_unlock(endpoint->mutex);
 
-	if (zstr(type) || zstr(user) || zstr(realm)) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. No parameters, data: '%s', type: '%s', user: '%s', realm: '%s'\n", payload, type, user, realm);
-		goto end;
+			if ((pass == 0) == (usable == SWITCH_TRUE)) {
+				order[count++] = endpoint;
+			}
+		}
 	}
 
-	if (!(profile = switch_core_hash_find(globals.profile_hash, type))) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Profile '%s' not found\n", type);
-		goto end;
-	}
+	return count;
+}
 
-	if (!zstr(payload)) {
-		switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "payload", payload);
+static void endpoint_dump(switch_stream_handle_t *stream)
+{
+	switch_hash_index_t *hi;
+	profile_t *profile;
+	endpoint_t *endpoint;
+
+	for (hi = switch_core_hash_first(globals.profile_hash); hi; hi = switch_core_hash_next(&hi)) {
+		const void *key;
+		void *val;
+
+		switch_core_hash_this(hi, &key, NULL, &val);
+		profile = (profile_t *) val;
+
+		for (endpoint = profile->endpoints; endpoint; endpoint = endpoint->next) {
+			switch_mutex_lock(endpoint->mutex);
+			stream->write_function(stream, "%s: endpoint %u %s, %s, requests %" SWITCH_UINT64_T_FMT " (%" SWITCH_UINT64_T_FMT " failed), errors %u%%, latency %u ms, "
+								   "hedged %" SWITCH_UINT64_T_FMT ", won %" SWITCH_UINT64_T_FMT "\n", profile->name, endpoint->index, endpoint->url,
+								   endpoint->healthy ? "healthy" : "unhealthy", endpoint->requests, endpoint->failures, endpoint->error_rate / 10,
+								   endpoint->latency, endpoint->hedged, endpoint->wins);
+			switch_mutex_unlock(endpoint->mutex);
+		}
 	}
+}
 
-	db_get_tokens_array(user, realm, type, &cbt);
+/* Request to one endpoint, NULL is url of profile. Warm connections and pinned address belong to first endpoint */
+static CURLcode do_curl_endpoint(switch_event_t *event, profile_t *profile, endpoint_t *endpoint, http_response_t *response)
+{
+	switch_CURL *curl_handle = NULL;
+	long httpRes = 0;
+	switch_curl_slist_t *headers = NULL;
+	char *query = NULL, *post_data = NULL;
+	switch_curl_slist_t *resolve = NULL;
+	CURLcode res = CURLE_OK;
+	digest_state_t *digest = profile->auth && profile->auth->type == DIGEST ? profile->auth->digest : NULL;
+	int attempt;
+	long left, timeout_ms, connect_ms;
+
+	const char *url_template = endpoint ? endpoint->url : profile->url;
+	const char *loadtest_url = globals.loadtest_url;
+	const char *method = profile->method;
+	switch_bool_t pooled = !endpoint || endpoint->index == 0 ? SWITCH_TRUE : SWITCH_FALSE;
 
-	if ((size = cJSON_GetArraySize(cbt.array)) == 0) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. No one token found for type: '%s', user: '%s', realm: '%s'\n", type, user, realm);
-		goto end;
+	if (loadtest_url && !strcmp(switch_str_nil(switch_event_get_header(event, "realm")), APN_LOADTEST_REALM)) {
+		url_template = loadtest_url;
 	}
 
-	for (i = 0; i < size; i++) {
-		if ((iterator = cJSON_GetArrayItem(cbt.array, i)) == NULL) {
-			break;
-		}
-		add_item_to_event(event, "token", cJSON_GetObjectItem(iterator, "token"));
-		add_item_to_event(event, "app_id", cJSON_GetObjectItem(iterator, "app_id"));
-		add_item_to_event(event, "platform", cJSON_GetObjectItem(iterator, "platform"));
+	curl_handle = pooled ? conn_acquire(profile) : switch_curl_easy_init();
+	query = switch_event_expand_headers(event, url_template);
 
-		res |= mod_apn_send(event, profile);
+	/*Pinned address of gateway, no DNS lookup on push path*/
+	if (pooled && (resolve = conn_pool_resolve_list(profile->conns))) {
+		switch_curl_easy_setopt(curl_handle, CURLOPT_RESOLVE, resolve);
 	}
 
-end:
-	if (!zstr(uuid) && switch_event_create_subclass(&res_event, SWITCH_EVENT_CUSTOM, "mobile::push::response") == SWITCH_STATUS_SUCCESS) {
-		switch_event_add_header_string(res_event, SWITCH_STACK_BOTTOM, "uuid", uuid);
-		switch_event_add_header_string(res_event, SWITCH_STACK_BOTTOM, "response", res ? "sent" : "notsent");
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. Fire event mobile::push::response with ID: '%s' and result: '%s'\n", uuid, res ? "sent" : "notsent");
-		switch_event_fire(&res_event);
-		switch_event_destroy(&res_event);
+	if (profile->connect_timeout) {
+		switch_curl_easy_setopt(curl_handle, CURLOPT_CONNECTTIMEOUT, profile->connect_timeout);
 	}
 
-	switch_safe_free(json_tokens);
+	if (profile->timeout) {
+		switch_curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT, profile->timeout);
+	}
 
-	if (cbt.array) {
-		cJSON_Delete(cbt.array);
+	if (!strncasecmp(query, "https", 5)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Not verifying TLS cert for %s; connection is not secure\n", query);
+		switch_curl_easy_setopt(curl_handle, CURLOPT_SSL_VERIFYPEER, 0);
+		switch_curl_easy_setopt(curl_handle, CURLOPT_SSL_VERIFYHOST, 0);
 	}
-}
 
-static char *get_url_from_contact(char *buf)
-{
-	char *url = NULL, *e;
+	if (!strcasecmp(method, "post")) {
+		if (!zstr(profile->post_data_template)) {
+			post_data = profile_render_body(profile, event);
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "method: %s, url: %s, data: %s\n", method, query,
+							  post_data);
+			switch_curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDSIZE, strlen(post_data));
+			switch_curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, (void *) post_data);
+		}
+	} else {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "method: %s, url: %s\n", method, query);
+		switch_curl_easy_setopt(curl_handle, CURLOPT_HTTPGET, 1);
+	}
+	switch_curl_easy_setopt(curl_handle, CURLOPT_FOLLOWLOCATION, 1);
+	switch_curl_easy_setopt(curl_handle, CURLOPT_MAXREDIRS, 15);
+	switch_curl_easy_setopt(curl_handle, CURLOPT_URL, query);
+	switch_curl_easy_setopt(curl_handle, CURLOPT_NOSIGNAL, 1);
+	switch_curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "freeswitch-mod_apn/2.0");
+	switch_curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, http_response_write_callback);
+	switch_curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *) response);
+	if (digest) {
+		switch_curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, http_response_header_callback);
+		switch_curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA, (void *) response);
+	}
+	if (response->cancelled) {
+		switch_curl_easy_setopt(curl_handle, CURLOPT_NOPROGRESS, 0);
+		switch_curl_easy_setopt(curl_handle, CURLOPT_XFERINFOFUNCTION, http_response_xferinfo_callback);
+		switch_curl_easy_setopt(curl_handle, CURLOPT_XFERINFODATA, (void *) response);
+	}
 
-	switch_assert(buf);
+	/*Second attempt only for digest challenge, on the same handle (and connection)*/
+	for (attempt = 0; attempt < 2; attempt++) {
+		/*Call deadline bounds connect and transfer, profile timeouts only when they are shorter*/
+		if ((left = push_deadline_left(event)) == 0) {
+			/*Not sent at all, endpoint isn't blamed*/
+			res = CURLE_ABORTED_BY_CALLBACK;
+			break;
+		} else if (left > 0) {
+			timeout_ms = profile->timeout && profile->timeout * 1000L < left ? profile->timeout * 1000L : left;
+			connect_ms = profile->connect_timeout && profile->connect_timeout * 1000L < timeout_ms ? profile->connect_timeout * 1000L : timeout_ms;
+			switch_curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT_MS, timeout_ms);
+			switch_curl_easy_setopt(curl_handle, CURLOPT_CONNECTTIMEOUT_MS, connect_ms);
+		}
 
-	while(*buf == ' ') {
-		buf++;
-	}
+		if (digest) {
+			char *authorization = digest_authorization(digest, !strcasecmp(method, "post") ? "POST" : "GET", query);
 
-	if (*buf == '"') {
-		buf++;
-		if((e = strchr(buf, '"'))) {
-			buf = e+1;
+			switch_curl_slist_free_all(headers);
+			headers = NULL;
+			if (profile->content_type) {
+				char *ct = switch_mprintf("Content-Type: %s", profile->content_type);
+				headers = switch_curl_slist_append(headers, ct);
+				switch_safe_free(ct);
+			}
+			if (authorization) {
+				headers = switch_curl_slist_append(headers, authorization);
+				switch_safe_free(authorization);
+			}
+			switch_curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, headers);
+		} else if (profile->headers) {
+			switch_curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, profile->headers);
+		}
+
+		response->len = 0;
+		response->body[0] = '\0';
+		response->data_len = 0;
+		response->challenge[0] = '\0';
+		httpRes = 0;
+
+		res = switch_curl_easy_perform(curl_handle);
+		switch_curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &httpRes);
+
+		if (!digest || httpRes != 401 || zstr(response->challenge) || !digest_update(digest, response->challenge)) {
+			break;
 		}
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. New digest challenge from %s, repeat request\n", query);
 	}
 
-	while(*buf == ' ') {
-		buf++;
+	if (pooled) {
+		conn_release(profile, curl_handle, res == CURLE_OK ? SWITCH_TRUE : SWITCH_FALSE);
+	} else {
+		switch_curl_easy_cleanup(curl_handle);
 	}
+	switch_curl_slist_free_all(headers);
+	switch_curl_slist_free_all(resolve);
 
-	url = strchr(buf, '<');
+	response->code = httpRes;
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "response code: %ld, body: %s\n", response->code, response->body);
 
-	if (url && (e = switch_find_end_paren(url, '<', '>'))) {
-		url++;
-		url = strdup(url);
-		e = strchr(url, '>');
-		*e = '\0';
-	} else {
-		if (url) buf++;
-		url = strdup(buf);
+	switch_safe_free(post_data);
+	if (query != url_template) switch_safe_free(query);
+
+	return res;
+}
+
+/* One push sent to several endpoints, shared by caller and threads of requests */
+struct push_race_obj {
+	switch_memory_pool_t *pool;
+	switch_mutex_t *mutex;
+	switch_thread_cond_t *cond;
+	switch_event_t *event;
+	/*Copy, caller may pass profile from stack*/
+	profile_t profile;
+	int refs;
+	uint32_t running;
+	/*Winner is found or caller gave up, requests still in flight abort*/
+	volatile switch_bool_t done;
+	switch_bool_t keep_data;
+	switch_bool_t answered;
+	switch_bool_t has_result;
+	http_response_t result;
+};
+typedef struct push_race_obj push_race_t;
+
+struct push_attempt_obj {
+	push_race_t *race;
+	endpoint_t *endpoint;
+};
+typedef struct push_attempt_obj push_attempt_t;
+
+static void push_race_release(push_race_t **race_p)
+{
+	push_race_t *race = *race_p;
+	switch_memory_pool_t *pool;
+	int refs;
+
+	*race_p = NULL;
+	switch_mutex_lock(race->mutex);
+	refs = --race->refs;
+	switch_mutex_unlock(race->mutex);
+
+	if (refs == 0) {
+		switch_safe_free(race->result.data);
+		switch_event_destroy(&race->event);
+		pool = race->pool;
+		switch_core_destroy_memory_pool(&pool);
 	}
-	return url;
 }
 
-static void originate_register_event_handler(switch_event_t *event)
+/* Request of race, skip == SWITCH_TRUE when pool is stopping and request wasn't started */
+static void push_attempt_exec(push_attempt_t *attempt, switch_bool_t skip)
 {
-	char *dest = NULL;
-	originate_register_t *originate_data = (struct originate_register_data *)event->bind_user_data;
-	char *event_username = NULL, *event_realm = NULL, *event_call_id = NULL, *event_contact = NULL, *event_profile = NULL;
-	char *destination = NULL;
-	const char *domain_name = NULL, *dial_user = NULL, *update_reg = NULL;
-	uint32_t timelimit_sec = 0;
+	push_race_t *race = attempt->race;
+	endpoint_t *endpoint = attempt->endpoint;
+	http_response_t response;
+	switch_time_t start = switch_time_ref();
+	switch_bool_t answered = SWITCH_FALSE;
+	CURLcode res = CURLE_ABORTED_BY_CALLBACK;
+
+	memset(&response, 0, sizeof(response));
+	response.cancelled = &race->done;
+	response.keep_data = race->keep_data;
+	if (!skip && !race->done) {
+		res = do_curl_endpoint(race->event, &race->profile, endpoint, &response);
+		answered = endpoint_answered(res, &response);
+	}
 
-	switch_memory_pool_t *pool;
-	switch_mutex_t *handles_mutex;
+	/*Aborted request tells nothing about endpoint*/
+	if (res != CURLE_ABORTED_BY_CALLBACK) {
+		endpoint_report(&race->profile, endpoint, answered, (uint32_t)((switch_time_ref() - start) / 1000));
+	}
 
-	if (!originate_data) {
-		return;
+	switch_mutex_lock(race->mutex);
+	race->running--;
+	if (!race->answered && res != CURLE_ABORTED_BY_CALLBACK) {
+		race->answered = answered;
+		switch_safe_free(race->result.data);
+		race->result = response;
+		response.data = NULL;
+		race->has_result = SWITCH_TRUE;
+		if (answered) {
+			switch_mutex_lock(endpoint->mutex);
+			endpoint->wins++;
+			switch_mutex_unlock(endpoint->mutex);
+		}
 	}
+	switch_thread_cond_signal(race->cond);
+	switch_mutex_unlock(race->mutex);
 
-	pool = originate_data->pool;
-	handles_mutex = originate_data->mutex;
-	domain_name = originate_data->realm;
-	dial_user = originate_data->user;
+	switch_safe_free(response.data);
+	push_race_release(&race);
+	free(attempt);
+}
 
-	update_reg = switch_event_get_header(event, "update-reg");
-	if (!zstr(update_reg) && switch_true(update_reg)) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. Update existing registration, skip originate\n");
-		return;
+static void *SWITCH_THREAD_FUNC push_attempt_thread_run(switch_thread_t *thread, void *obj)
+{
+	void *pop = NULL;
+
+	while (globals.attempts_running) {
+		if (switch_queue_pop_timeout(globals.attempt_queue, &pop, 100000) == SWITCH_STATUS_SUCCESS && pop) {
+			push_attempt_exec((push_attempt_t *) pop, SWITCH_FALSE);
+		}
 	}
 
-	event_username = switch_event_get_header(event, "username");
-	event_realm = switch_event_get_header(event, "realm");
-	event_call_id = switch_event_get_header(event, "call-id");
-	event_contact = switch_event_get_header(event, "contact");
-	event_profile = switch_event_get_header(event, "profile-name");
+	/*Callers wait for every launched request*/
+	while (switch_queue_trypop(globals.attempt_queue, &pop) == SWITCH_STATUS_SUCCESS && pop) {
+		push_attempt_exec((push_attempt_t *) pop, SWITCH_TRUE);
+	}
 
-	if (zstr(event_username) || zstr(event_realm) || zstr(event_call_id) || zstr(event_profile) ||  zstr(event_contact) || zstr(domain_name) || zstr(dial_user)) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. No parameter for originate call via sofia::register\n");
-		return;
+	return NULL;
+}
+
+/* Threads for requests are started only when some profile hedges */
+static void push_attempts_start(void)
+{
+	switch_hash_index_t *hi;
+	profile_t *profile;
+	switch_bool_t hedged = SWITCH_FALSE;
+	uint32_t i;
+
+	for (hi = switch_core_hash_first(globals.profile_hash); hi; hi = switch_core_hash_next(&hi)) {
+		const void *key;
+		void *val;
+
+		switch_core_hash_this(hi, &key, NULL, &val);
+		profile = (profile_t *) val;
+		if (profile->hedge_delay && profile->endpoints_count > 1) {
+			hedged = SWITCH_TRUE;
+		}
 	}
 
-	if (strcasecmp(event_realm, domain_name) || strcasecmp(event_username, dial_user)) {
+	if (!hedged) {
 		return;
 	}
 
-	dest = get_url_from_contact(event_contact);
+	switch_queue_create(&globals.attempt_queue, SWITCH_CORE_QUEUE_LEN, globals.pool);
+	globals.attempt_threads = switch_core_alloc(globals.pool, sizeof(switch_thread_t *) * globals.attempt_threads_count);
+	globals.attempts_running = SWITCH_TRUE;
+	for (i = 0; i < globals.attempt_threads_count; i++) {
+		launch_thread(&globals.attempt_threads[i], push_attempt_thread_run, NULL);
+	}
+}
 
-	if (zstr(dest)) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. No destination contact data string\n");
-		goto end;
+static void push_attempts_stop(void)
+{
+	void *pop = NULL;
+	uint32_t i;
+
+	globals.attempts_running = SWITCH_FALSE;
+	for (i = 0; globals.attempt_threads && i < globals.attempt_threads_count; i++) {
+		join_thread(&globals.attempt_threads[i]);
 	}
 
-	timelimit_sec = *originate_data->timelimit;
+	/*Launched while threads were exiting*/
+	while (globals.attempt_queue && switch_queue_trypop(globals.attempt_queue, &pop) == SWITCH_STATUS_SUCCESS && pop) {
+		push_attempt_exec((push_attempt_t *) pop, SWITCH_TRUE);
+	}
+}
 
-	destination = switch_mprintf("[registration_token=%s,originate_timeout=%u]sofia/%s/%s:_:[originate_timeout=%u,enable_send_apn=false,apn_wait_any_register=%s]apn_wait/%s@%s",
-								 event_call_id,
-								 timelimit_sec,
-								 event_profile,
-								 dest,
-								 timelimit_sec,
-								 originate_data->wait_any_register == SWITCH_TRUE ? "true" : "false",
-								 event_username,
-								 event_realm);
+/* Caller holds race->mutex */
+static switch_bool_t push_race_launch(push_race_t *race, endpoint_t *endpoint)
+{
+	push_attempt_t *attempt = NULL;
 
-	switch_mutex_lock(handles_mutex);
-	originate_data->destination = switch_core_strdup(pool, destination);
-	switch_mutex_unlock(handles_mutex);
+	if (!globals.attempts_running) {
+		return SWITCH_FALSE;
+	}
 
-	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. Try originate to '%s' (by registration event)\n", destination);
+	switch_zmalloc(attempt, sizeof(*attempt));
+	attempt->race = race;
+	attempt->endpoint = endpoint;
+	race->refs++;
+	race->running++;
+
+	if (switch_queue_trypush(globals.attempt_queue, attempt) != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "CARUSTO. Can't start request to %s, queue is full\n", endpoint->url);
+		race->refs--;
+		race->running--;
+		free(attempt);
+		return SWITCH_FALSE;
+	}
 
-end:
-	switch_safe_free(destination);
-	switch_safe_free(dest);
+	return SWITCH_TRUE;
 }
 
-static void register_event_handler(switch_event_t *event)
+/* Ordered failover on the calling thread: next endpoint is tried when request fails */
+static void do_curl_failover(switch_event_t *event, profile_t *profile, endpoint_t **order, uint32_t count, http_response_t *response)
 {
-	char *event_user = NULL, *event_realm = NULL, *event_contact = NULL;
-	char *contact_ptr = NULL, *voip_token = NULL, *im_token = NULL, *platform = NULL, *foo = NULL, *query = NULL, *app_id = NULL;
-	char *update_reg = NULL;
+	switch_time_t start;
+	CURLcode res;
+	uint32_t i;
 
-	update_reg = switch_event_get_header(event, "update-reg");
-	if (!zstr(update_reg) && switch_true(update_reg)) {
-		return;
+	for (i = 0; i < count; i++) {
+		if (response->cancelled && *response->cancelled) {
+			break;
+		}
+		if (i) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. Profile '%s' fails over to %s\n", profile->name, order[i]->url);
+			switch_safe_free(response->data);
+			response->data_len = 0;
+			response->len = 0;
+			response->body[0] = '\0';
+			response->code = 0;
+		}
+
+		start = switch_time_ref();
+		if ((res = do_curl_endpoint(event, profile, order[i], response)) == CURLE_ABORTED_BY_CALLBACK) {
+			break;
+		}
+		endpoint_report(profile, order[i], endpoint_answered(res, response), (uint32_t)((switch_time_ref() - start) / 1000));
+		if (endpoint_answered(res, response)) {
+			break;
+		}
 	}
+}
 
-	event_contact = switch_event_get_header(event, "contact");
-	if (zstr(event_contact)) {
+/* Push goes to first usable endpoint. Next endpoint is tried right away when request fails (ordered failover)
+ * or in addition when there is no answer within hedge_delay (hedged request). First answer wins, others are aborted.
+ * Without hedge_delay everything runs on the calling thread */
+static void do_curl(switch_event_t *event, profile_t *profile, http_response_t *response)
+{
+	switch_memory_pool_t *pool = NULL;
+	push_race_t *race = NULL;
+	endpoint_t **order = NULL;
+	uint32_t count, next = 0;
+	switch_time_t start, now, hedge_at = 0;
+	switch_interval_time_t wait_us;
+	CURLcode res;
+
+	if (profile->endpoints_count < 2) {
+		start = switch_time_ref();
+		res = do_curl_endpoint(event, profile, profile->endpoints, response);
+		if (res != CURLE_ABORTED_BY_CALLBACK) {
+			endpoint_report(profile, profile->endpoints, endpoint_answered(res, response), (uint32_t)((switch_time_ref() - start) / 1000));
+		}
 		return;
 	}
 
-	contact_ptr = app_id = voip_token = im_token = platform = strdup(event_contact);
-
-	if (zstr(contact_ptr)) {
-		goto end;
+	if (!profile->hedge_delay || !globals.attempts_running) {
+		switch_zmalloc(order, sizeof(endpoint_t *) * profile->endpoints_count);
+		count = endpoint_order(profile, order);
+		do_curl_failover(event, profile, order, count, response);
+		free(order);
+		return;
 	}
 
-	/*Get contact parameter pn-os */
-	if (!zstr(globals.contact_platform_param) && (foo = strcasestr(platform, globals.contact_platform_param))) {
-		platform = foo + strlen(globals.contact_platform_param) + 1;
-	} else {
-		platform = NULL;
+	if (switch_core_new_memory_pool(&pool) != SWITCH_STATUS_SUCCESS || !pool) {
+		return;
 	}
 
-	/*Get contact parameter pn-voip-tok */
-	if (!zstr(globals.contact_voip_token_param) && (foo = strcasestr(voip_token, globals.contact_voip_token_param))) {
-		voip_token = foo + strlen(globals.contact_voip_token_param) + 1;
-	} else {
-		voip_token = NULL;
+	race = switch_core_alloc(pool, sizeof(*race));
+	memset(race, 0, sizeof(*race));
+	race->pool = pool;
+	race->refs = 1;
+	race->profile = *profile;
+	race->keep_data = response->keep_data;
+	switch_mutex_init(&race->mutex, SWITCH_MUTEX_NESTED, pool);
+	switch_thread_cond_create(&race->cond, pool);
+	switch_event_dup(&race->event, event);
+
+	order = switch_core_alloc(pool, sizeof(endpoint_t *) * profile->endpoints_count);
+	count = endpoint_order(profile, order);
+
+	switch_mutex_lock(race->mutex);
+	while (!race->answered) {
+		if (response->cancelled && *response->cancelled) {
+			break;
+		}
+
+		now = switch_time_ref();
+		if (!race->running) {
+			if (next >= count) {
+				break;
+			}
+			if (next) {
+				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. Profile '%s' fails over to %s\n", profile->name, order[next]->url);
+			}
+			push_race_launch(race, order[next++]);
+			hedge_at = now + (switch_time_t) profile->hedge_delay * 1000;
+			continue;
+		}
+
+		if (next < count && now >= hedge_at) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. No answer within %u ms, profile '%s' hedges to %s\n",
+							  profile->hedge_delay, profile->name, order[next]->url);
+			switch_mutex_lock(order[next]->mutex);
+			order[next]->hedged++;
+			switch_mutex_unlock(order[next]->mutex);
+			push_race_launch(race, order[next++]);
+			hedge_at = now + (switch_time_t) profile->hedge_delay * 1000;
+			continue;
+		}
+
+		/*Wake up for hedge or to notice cancelled call*/
+		wait_us = 100000;
+		if (next < count && hedge_at - now < wait_us) {
+			wait_us = hedge_at - now;
+		}
+		switch_thread_cond_timedwait(race->cond, race->mutex, wait_us);
 	}
 
-	/*Get contact parameter pn-im-tok */
-	if (!zstr(globals.contact_im_token_param) && (foo = strcasestr(im_token, globals.contact_im_token_param))) {
-		im_token = foo + strlen(globals.contact_im_token_param) + 1;
-	} else {
-		im_token = NULL;
+	race->done = SWITCH_TRUE;
+	if (race->has_result) {
+		response->code = race->result.code;
+		response->len = race->result.len;
+		memcpy(response->body, race->result.body, sizeof(response->body));
+		response->data = race->result.data;
+		response->data_len = race->result.data_len;
+		race->result.data = NULL;
 	}
+	switch_mutex_unlock(race->mutex);
 
-	/*Get contact parameter app-id */
-	if (!zstr(globals.contact_app_id_param) && (foo = strcasestr(app_id, globals.contact_app_id_param))) {
-		app_id = foo + strlen(globals.contact_app_id_param) + 1;
-	} else {
-		app_id = NULL;
+	push_race_release(&race);
+}
+
+static switch_bool_t profile_should_evict(profile_t *profile, http_response_t *response)
+{
+	evict_rule_t *rule;
+
+	for (rule = profile->evict_rules; rule; rule = rule->next) {
+		if (rule->code != response->code) {
+			continue;
+		}
+		if (zstr(rule->reason) || (response->len && switch_stristr(rule->reason, response->body))) {
+			return SWITCH_TRUE;
+		}
 	}
 
-	if (voip_token && (foo = strchr(voip_token, ';')) != NULL) {
-		*foo = '\0';
+	return SWITCH_FALSE;
+}
+
+static uint64_t fingerprint_hash(uint64_t hash, const char *str)
+{
+	for (; str && *str; str++) {
+		hash ^= (unsigned char) *str;
+		hash *= 1099511628211ULL;
 	}
-	if (im_token && (foo = strchr(im_token, ';')) != NULL) {
-		*foo = '\0';
+	/*Separator, "ab"+"c" differs from "a"+"bc"*/
+	hash ^= 0xff;
+	hash *= 1099511628211ULL;
+
+	return hash;
+}
+
+static uint32_t fingerprint_fold(uint64_t hash)
+{
+	return (uint32_t)(hash ^ (hash >> 32));
+}
+
+/* All users of one token share home slot, eviction of token finds them in one probe chain */
+static uint64_t fingerprint_key(const char *type, const char *token, const char *user, const char *realm)
+{
+	uint64_t key = 14695981039346656037ULL, token_key;
+
+	token_key = fingerprint_hash(fingerprint_hash(key, type), token);
+	key = fingerprint_hash(fingerprint_hash(key, user), realm);
+	key = ((uint64_t) fingerprint_fold(token_key) << 32) | fingerprint_fold(key);
+
+	return key ? key : 1;
+}
+
+static uint32_t fingerprint_home(uint64_t key)
+{
+	return (uint32_t)(key >> 32) & (globals.fingerprints_size - 1);
+}
+
+/* Caller holds globals.fingerprints_mutex */
+static register_fingerprint_t *fingerprint_slot(uint64_t key)
+{
+	uint32_t mask = globals.fingerprints_size - 1, i = fingerprint_home(key);
+
+	while (globals.fingerprints[i].key && globals.fingerprints[i].key != key) {
+		i = (i + 1) & mask;
 	}
-	if (app_id && (foo = strchr(app_id, ';')) != NULL) {
-		*foo = '\0';
+
+	return &globals.fingerprints[i];
+}
+
+/* Caller holds globals.fingerprints_mutex. Backward shift deletion keeps probe chains without tombstones */
+static void fingerprint_delete_at(uint32_t i)
+{
+	uint32_t mask = globals.fingerprints_size - 1, j, home;
+
+	globals.fingerprints_used--;
+	for (j = (i + 1) & mask; globals.fingerprints[j].key; j = (j + 1) & mask) {
+		home = fingerprint_home(globals.fingerprints[j].key);
+		/*Move entry back when its home slot is not in (i, j]*/
+		if ((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j))) {
+			globals.fingerprints[i] = globals.fingerprints[j];
+			i = j;
+		}
 	}
-	if (platform && (foo = strchr(platform, ';')) != NULL) {
-		*foo = '\0';
+	memset(&globals.fingerprints[i], 0, sizeof(register_fingerprint_t));
+}
+
+/* Caller holds globals.fingerprints_mutex. Drop the least recently touched of next slots of clock hand */
+static void fingerprint_evict_one(void)
+{
+	uint32_t mask = globals.fingerprints_size - 1, i, n, victim = 0;
+	switch_bool_t found = SWITCH_FALSE;
+
+	for (n = 0; n < 64 || !found; n++) {
+		i = globals.fingerprints_hand;
+		globals.fingerprints_hand = (i + 1) & mask;
+		if (globals.fingerprints[i].key && (!found || globals.fingerprints[i].touched < globals.fingerprints[victim].touched)) {
+			victim = i;
+			found = SWITCH_TRUE;
+		}
 	}
 
-	if (zstr(app_id) || (zstr(voip_token) && zstr(im_token)) || zstr(platform)) {
-		goto end;
+	fingerprint_delete_at(victim);
+	globals.fingerprints_evicted++;
+}
+
+/* Compare REGISTER with last stored state of token and remember it */
+static enum fingerprint_state fingerprint_check(const char *type, const char *token, const char *user, const char *realm,
+												const char *app_id, const char *platform)
+{
+	uint64_t key = fingerprint_key(type, token, user, realm);
+	uint32_t fp = (uint32_t) fingerprint_hash(fingerprint_hash(14695981039346656037ULL, app_id), platform);
+	uint32_t now = (uint32_t) switch_epoch_time_now(NULL);
+	enum fingerprint_state state = FINGERPRINT_CHANGED;
+	register_fingerprint_t *slot;
+
+	switch_mutex_lock(globals.fingerprints_mutex);
+	slot = fingerprint_slot(key);
+	if (slot->key && slot->fp == fp) {
+		state = FINGERPRINT_SAME;
+		if (now - slot->touched >= globals.register_touch_interval) {
+			state = FINGERPRINT_TOUCH;
+			slot->touched = now;
+		}
+	} else {
+		if (!slot->key) {
+			/*Keep load factor under 3/4, forget least recently touched tokens rather than probe long chains*/
+			if (globals.fingerprints_used + 1 > globals.fingerprints_size / 4 * 3) {
+				fingerprint_evict_one();
+				slot = fingerprint_slot(key);
+			}
+			globals.fingerprints_used++;
+		}
+		slot->key = key;
+		slot->fp = fp;
+		slot->touched = now;
 	}
+	switch_mutex_unlock(globals.fingerprints_mutex);
 
-	event_user = switch_event_get_header(event, "from-user");
-	event_realm = switch_event_get_header(event, "realm");
+	return state;
+}
 
-	if (zstr(event_user) || zstr(event_realm)) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. No parameter\n");
-		goto end;
+/* Forget token of every user, db rows of token are deleted by token and type */
+static void fingerprint_remove(const char *type, const char *token)
+{
+	uint64_t key;
+	uint32_t mask, i;
+
+	if (!globals.fingerprints || zstr(type) || zstr(token)) {
+		return;
 	}
 
-	/*Check existing VoIP token*/
-	if (!zstr(voip_token)) {
-		char voip_count[2] = {0, };
-		query = switch_mprintf("SELECT count(*) FROM push_tokens WHERE token = '%q' AND extension = '%q' AND realm = '%q' AND app_id = '%q' AND type = 'voip'", voip_token, event_user, event_realm, app_id);
-		mod_apn_execute_sql2str(query, voip_count, sizeof(voip_count));
-		switch_safe_free(query);
+	key = fingerprint_key(type, token, NULL, NULL);
+	mask = globals.fingerprints_size - 1;
 
-		if (!zstr(voip_count) && strtol(voip_count, NULL, 10) == 0) {
-			/*Add new VoIP token to DB*/
-			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. Add new VoIP token: '%s' to push_tokens for user %s@%s and application: %s\n", voip_token, event_user, event_realm, app_id);
-			query = switch_mprintf("INSERT INTO push_tokens (token, extension, realm, app_id, type, platform) VALUES ('%q', '%q', '%q', '%q', 'voip', '%q')", voip_token, event_user, event_realm, app_id, platform);
-			execute_sql_now(&query);
-			switch_safe_free(query);
+	switch_mutex_lock(globals.fingerprints_mutex);
+	for (i = fingerprint_home(key); globals.fingerprints[i].key;) {
+		if ((globals.fingerprints[i].key >> 32) == (key >> 32)) {
+			/*Next entry may be shifted into this slot*/
+			fingerprint_delete_at(i);
 		} else {
-			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. VoIP token: '%s' for user %s@%s and application: %s already exists\n", voip_token, event_user, event_realm, app_id);
-			query = switch_mprintf("UPDATE push_tokens SET last_update = CURRENT_TIMESTAMP WHERE token = '%q' AND extension = '%q' AND realm = '%q' AND app_id = '%q' AND type = 'voip'", im_token, event_user, event_realm, app_id);
-			execute_sql_now(&query);
-			switch_safe_free(query);
+			i = (i + 1) & mask;
 		}
 	}
+	switch_mutex_unlock(globals.fingerprints_mutex);
+}
 
-	/*Check existing IM token*/
-	if (!zstr(im_token)) {
-		char im_count[2] = {0, };
-		query = switch_mprintf("SELECT count(*) FROM push_tokens WHERE token = '%q' AND extension = '%q' AND realm = '%q' AND app_id = '%q' AND type = 'im'", im_token, event_user, event_realm, app_id);
-		mod_apn_execute_sql2str(query, im_count, sizeof(im_count));
-		switch_safe_free(query);
+static void evict_token(const char *user, const char *realm, const char *token, const char *type)
+{
+	evict_item_t *item = NULL;
+
+	if (zstr(token) || zstr(type) || !globals.evict_queue) {
+		return;
+	}
+
+	/*Don't push to it anymore, db is cleaned in background*/
+	token_store_remove(user, realm, type, token);
+	fingerprint_remove(type, token);
+
+	switch_zmalloc(item, sizeof(*item));
+	item->token = strdup(token);
+	item->type = strdup(type);
+
+	if (switch_queue_trypush(globals.evict_queue, item) != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "CARUSTO. Evict queue is full, keep token '%s' for now\n", token);
+		switch_safe_free(item->token);
+		switch_safe_free(item->type);
+		switch_safe_free(item);
+	}
+}
+
+static void evict_flush(evict_item_t **batch, uint32_t count)
+{
+	char (*type_refs)[16] = NULL;
+	uint32_t i, n, known = 0;
+
+	if (!count) {
+		return;
+	}
+
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. Evict %u dead token(s)\n", count);
+
+	switch_zmalloc(type_refs, sizeof(*type_refs) * count);
+	for (i = 0; i < count; i++) {
+		/*Unknown type has no stored tokens, unresolved item is left with empty ref*/
+		if (apn_dim_ref(APN_DIM_TYPE, batch[i]->type, SWITCH_FALSE, type_refs[i], sizeof(type_refs[i]))) {
+			known++;
+		} else {
+			*type_refs[i] = '\0';
+		}
+	}
+
+	if (!known) {
+		goto end;
+	}
+
+	if (globals.db_kind == APN_DB_CORE) {
+		/*One transaction with prepared statement*/
+		const char ***rows = NULL, **args = NULL;
+
+		switch_zmalloc(rows, sizeof(*rows) * known);
+		switch_zmalloc(args, sizeof(*args) * known * 2);
+		for (i = 0, n = 0; i < count; i++) {
+			if (!*type_refs[i]) {
+				continue;
+			}
+			rows[n] = &args[n * 2];
+			rows[n][0] = batch[i]->token;
+			rows[n][1] = type_refs[i];
+			n++;
+		}
+		apn_stmt_exec_many(APN_STMT_DELETE_TOKEN, rows, known);
+		switch_safe_free(args);
+		switch_safe_free(rows);
+	} else {
+		/*One statement for whole batch via queue manager*/
+		switch_stream_handle_t stream = { 0 };
+		char *sql = NULL;
+
+		SWITCH_STANDARD_STREAM(stream);
+		stream.write_function(&stream, "DELETE FROM push_token_entries WHERE ");
+
+		/*Only items with resolved type, empty ref would break the whole statement*/
+		for (i = 0, n = 0; i < count; i++) {
+			char *cond;
+
+			if (!*type_refs[i]) {
+				continue;
+			}
+			cond = switch_mprintf("%s(token = '%q' AND type_ref = %s)", n++ ? " OR " : "", batch[i]->token, type_refs[i]);
+			stream.write_function(&stream, "%s", cond);
+			switch_safe_free(cond);
+		}
+
+		sql = (char *) stream.data;
+		execute_sql_now(&sql);
+		switch_safe_free(stream.data);
+	}
+
+end:
+	switch_safe_free(type_refs);
+
+	for (i = 0; i < count; i++) {
+		switch_safe_free(batch[i]->token);
+		switch_safe_free(batch[i]->type);
+		switch_safe_free(batch[i]);
+	}
+}
+
+static void *SWITCH_THREAD_FUNC evict_thread_run(switch_thread_t *thread, void *obj)
+{
+	evict_item_t **batch = NULL;
+	uint32_t count = 0;
+	switch_time_t first = 0;
+	void *pop = NULL;
+
+	switch_zmalloc(batch, sizeof(*batch) * globals.evict_batch_size);
+
+	while (globals.running || switch_queue_size(globals.evict_queue) > 0) {
+		if (switch_queue_pop_timeout(globals.evict_queue, &pop, 100000) == SWITCH_STATUS_SUCCESS && pop) {
+			if (!count) {
+				first = switch_micro_time_now();
+			}
+			batch[count++] = (evict_item_t *) pop;
+			pop = NULL;
+		}
+
+		if (count && (count >= globals.evict_batch_size ||
+					  switch_micro_time_now() - first >= (switch_time_t) globals.evict_flush_interval * 1000)) {
+			evict_flush(batch, count);
+			count = 0;
+		}
+	}
+
+	evict_flush(batch, count);
+	switch_safe_free(batch);
+
+	return NULL;
+}
+static void register_item_free(register_item_t *item)
+{
+	if (item) {
+		switch_safe_free(item->key);
+		switch_safe_free(item->data);
+		free(item);
+	}
+}
+
+/* Write token from REGISTER in background, sofia::register dispatch thread only parses contact */
+static switch_bool_t register_enqueue(enum register_op op, const char *token, const char *user, const char *realm,
+									  const char *app_id, const char *type, const char *platform)
+{
+	register_item_t *item = NULL;
+	switch_size_t len[6], total = 0;
+	const char *src[6];
+	char *p;
+	int i;
+
+	if (!globals.register_queue) {
+		return SWITCH_FALSE;
+	}
+
+	src[0] = token; src[1] = user; src[2] = realm; src[3] = app_id; src[4] = type; src[5] = platform;
+	for (i = 0; i < 6; i++) {
+		len[i] = strlen(src[i]) + 1;
+		total += len[i];
+	}
+
+	/*One allocation for all strings of item*/
+	switch_zmalloc(item, sizeof(*item));
+	switch_zmalloc(item->data, total);
+	for (i = 0, p = item->data; i < 6; i++) {
+		memcpy(p, src[i], len[i]);
+		item->args[i] = p;
+		p += len[i];
+	}
+	item->op = op;
+	item->key = switch_mprintf("%s|%s|%s|%s|%s", token, user, realm, app_id, type);
+
+	if (switch_queue_trypush(globals.register_queue, item) != SWITCH_STATUS_SUCCESS) {
+		register_item_free(item);
+		return SWITCH_FALSE;
+	}
+
+	return SWITCH_TRUE;
+}
+
+static void register_flush(switch_hash_t *pending, register_item_t **batch, uint32_t count)
+{
+	switch_stream_handle_t upsert = { 0 }, touch = { 0 };
+	uint32_t i, upserts = 0, touches = 0, missed = 0;
+	apn_token_refs_t *refs = NULL;
+	switch_bool_t *resolved = NULL;
+	char *sql = NULL;
+	int touched = 0;
+
+	if (!count) {
+		return;
+	}
+
+	/*Realm, app, type and platform go to db as ids of dimension tables*/
+	switch_zmalloc(refs, sizeof(*refs) * count);
+	switch_zmalloc(resolved, sizeof(*resolved) * count);
+	for (i = 0; i < count; i++) {
+		resolved[i] = apn_token_refs_resolve(&refs[i], batch[i]->args);
+	}
+
+	SWITCH_STANDARD_STREAM(touch);
+	touch.write_function(&touch, "UPDATE push_token_entries SET last_update = CURRENT_TIMESTAMP WHERE ");
+
+	if (globals.db_kind == APN_DB_CORE) {
+		/*One transaction with prepared statement*/
+		const char ***rows = NULL;
+
+		switch_zmalloc(rows, sizeof(*rows) * count);
+		for (i = 0; i < count; i++) {
+			if (resolved[i] && batch[i]->op == REGISTER_UPSERT) {
+				rows[upserts++] = refs[i].args;
+			}
+		}
+		if (upserts) {
+			apn_stmt_exec_many(APN_STMT_UPSERT_TOKEN, rows, upserts);
+		}
+		switch_safe_free(rows);
+	} else if (globals.db_kind == APN_DB_ODBC) {
+		/*No multi-row upsert in generic sql, UPDATE + INSERT per token*/
+		for (i = 0; i < count; i++) {
+			if (resolved[i] && batch[i]->op == REGISTER_UPSERT) {
+				apn_stmt_exec(APN_STMT_UPSERT_TOKEN, refs[i].args, NULL, NULL);
+				upserts++;
+			}
+		}
+	} else {
+		/*Multi-row upsert, keys are unique within batch*/
+		SWITCH_STANDARD_STREAM(upsert);
+		upsert.write_function(&upsert, "INSERT INTO push_token_entries (token, extension, realm_ref, app_ref, type_ref, platform_ref) VALUES ");
+		for (i = 0; i < count; i++) {
+			if (resolved[i] && batch[i]->op == REGISTER_UPSERT) {
+				char *row = switch_mprintf("%s('%q', '%q', %s, %s, %s, %s)", upserts++ ? ", " : "", refs[i].args[0], refs[i].args[1],
+										   refs[i].args[2], refs[i].args[3], refs[i].args[4], refs[i].args[5]);
+				upsert.write_function(&upsert, "%s", row);
+				switch_safe_free(row);
+			}
+		}
+		upsert.write_function(&upsert, " ON CONFLICT (token, extension, realm_ref, app_ref, type_ref) DO UPDATE SET platform_ref = excluded.platform_ref, "
+							  "last_update = CURRENT_TIMESTAMP");
+		if (upserts) {
+			sql = (char *) upsert.data;
+			execute_sql_now(&sql);
+		}
+		switch_safe_free(upsert.data);
+	}
+
+	for (i = 0; i < count; i++) {
+		if (resolved[i] && batch[i]->op == REGISTER_TOUCH) {
+			char *cond = switch_mprintf("%s(token = '%q' AND extension = '%q' AND realm_ref = %s AND app_ref = %s AND type_ref = %s)",
+										touches++ ? " OR " : "", refs[i].args[0], refs[i].args[1], refs[i].args[2], refs[i].args[3], refs[i].args[4]);
+			touch.write_function(&touch, "%s", cond);
+			switch_safe_free(cond);
+		}
+	}
+	if (touches && mod_apn_execute_sql_rows((char *) touch.data, &touched) && touched < (int) touches) {
+		/*Some rows are gone (evicted, cleaned up elsewhere), find them and store again*/
+		for (i = 0; i < count; i++) {
+			if (resolved[i] && batch[i]->op == REGISTER_TOUCH &&
+				apn_stmt_exec_changes(APN_STMT_TOUCH_TOKEN, refs[i].args, NULL, NULL, &touched) && touched == 0) {
+				register_item_t *item = batch[i];
+
+				missed++;
+				if (!register_enqueue(REGISTER_UPSERT, item->args[0], item->args[1], item->args[2], item->args[3], item->args[4], item->args[5])) {
+					apn_stmt_exec(APN_STMT_UPSERT_TOKEN, refs[i].args, NULL, NULL);
+				}
+			}
+		}
+	}
+	switch_safe_free(touch.data);
+	switch_safe_free(resolved);
+	switch_safe_free(refs);
+
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. Stored %u token(s), refreshed %u token(s), %u of them stored again\n",
+					  upserts, touches, missed);
+
+	for (i = 0; i < count; i++) {
+		switch_core_hash_delete(pending, batch[i]->key);
+		register_item_free(batch[i]);
+	}
+}
+
+static void *SWITCH_THREAD_FUNC register_thread_run(switch_thread_t *thread, void *obj)
+{
+	register_item_t **batch = NULL, *item, *known;
+	switch_hash_t *pending = NULL;
+	uint32_t count = 0, i;
+	switch_time_t first = 0;
+	void *pop = NULL;
+
+	switch_zmalloc(batch, sizeof(*batch) * globals.register_batch_size);
+	switch_core_hash_init(&pending);
+
+	while (globals.running || switch_queue_size(globals.register_queue) > 0) {
+		if (switch_queue_pop_timeout(globals.register_queue, &pop, 100000) == SWITCH_STATUS_SUCCESS && pop) {
+			item = (register_item_t *) pop;
+			pop = NULL;
+
+			/*The same device registered again within flush interval, the latest one wins*/
+			if ((known = switch_core_hash_find(pending, item->key))) {
+				for (i = 0; i < count && batch[i] != known; i++);
+				if (known->op == REGISTER_UPSERT) {
+					item->op = REGISTER_UPSERT;
+				}
+				switch_core_hash_insert(pending, item->key, item);
+				batch[i] = item;
+				register_item_free(known);
+			} else {
+				if (!count) {
+					first = switch_micro_time_now();
+				}
+				switch_core_hash_insert(pending, item->key, item);
+				batch[count++] = item;
+			}
+		}
+
+		if (count && (count >= globals.register_batch_size ||
+					  switch_micro_time_now() - first >= (switch_time_t) globals.register_flush_interval * 1000)) {
+			register_flush(pending, batch, count);
+			count = 0;
+		}
+	}
+
+	register_flush(pending, batch, count);
+	switch_core_hash_destroy(&pending);
+	switch_safe_free(batch);
+
+	return NULL;
+}
+
+static switch_bool_t mod_apn_send(switch_event_t *event, profile_t *profile, push_inflight_t *inflight)
+{
+	switch_bool_t ret = SWITCH_FALSE;
+	http_response_t response;
+
+	if (!profile) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "CARUSTO. APN profile not found\n");
+		return ret;
+	}
+
+	/*Call is over or about to be, device would ring for nobody*/
+	if (push_deadline_left(event) == 0) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "CARUSTO. Drop push to '%s', deadline expired\n",
+						  switch_str_nil(switch_event_get_header(event, "token")));
+		return ret;
+	}
+
+	memset(&response, 0, sizeof(response));
+	if (inflight) {
+		response.cancelled = &inflight->cancelled;
+	}
+	do_curl(event, profile, &response);
+
+	if (inflight && inflight->cancelled) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. Push '%s' cancelled, call is taken by other device\n", inflight->uuid);
+		return SWITCH_FALSE;
+	}
+
+	if (response.code >= 200 && response.code < 300) {
+		ret = SWITCH_TRUE;
+	}
+
+	if (profile_should_evict(profile, &response)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "CARUSTO. Token '%s' rejected by provider (%ld), evict it\n",
+						  switch_str_nil(switch_event_get_header(event, "token")), response.code);
+		evict_token(switch_event_get_header(event, "user"), switch_event_get_header(event, "realm"),
+					switch_event_get_header(event, "token"), switch_event_get_header(event, "type"));
+		ret = SWITCH_FALSE;
+	}
+
+	return ret;
+}
+
+static char *mod_apn_execute_sql2str(char *sql, char *resbuf, size_t len)
+{
+	char *ret = NULL, *err = NULL;
+	switch_cache_db_handle_t *dbh = NULL;
+
+	/*Cache db gives each thread own handle, no need to serialize here*/
+	if (!(dbh = mod_apn_get_db_handle())) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Error Opening DB\n");
+		return NULL;
+	}
+
+	ret = switch_cache_db_execute_sql2str(dbh, sql, resbuf, len, &err);
+
+	if (err) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "SQL ERR: [%s]\n%s\n", err, sql);
+		free(err);
+	}
+
+	switch_cache_db_release_db_handle(&dbh);
+
+	return ret;
+}
+
+static switch_bool_t mod_apn_execute_sql_callback(char *sql, switch_core_db_callback_func_t callback, void *pdata)
+{
+	switch_bool_t ret = SWITCH_FALSE;
+	char *errmsg = NULL;
+	switch_cache_db_handle_t *dbh = NULL;
+
+	if (!(dbh = mod_apn_get_db_handle())) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Error Opening DB\n");
+		goto end;
+	}
+
+	switch_cache_db_execute_sql_callback(dbh, sql, callback, pdata, &errmsg);
+
+	if (errmsg) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "SQL ERR: [%s] %s\n", sql, errmsg);
+		free(errmsg);
+	}
+
+end:
+	if (dbh) {
+		switch_cache_db_release_db_handle(&dbh);
+	}
+
+	return ret;
+}
+
+/* Run statement now, rows is number of rows it changed */
+static switch_bool_t mod_apn_execute_sql_rows(char *sql, int *rows)
+{
+	switch_bool_t ret = SWITCH_FALSE;
+	char *errmsg = NULL;
+	switch_cache_db_handle_t *dbh = NULL;
+
+	if (!(dbh = mod_apn_get_db_handle())) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Error Opening DB\n");
+		goto end;
+	}
+
+	switch_cache_db_execute_sql(dbh, sql, &errmsg);
+
+	if (errmsg) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "SQL ERR: [%s] %s\n", sql, errmsg);
+		free(errmsg);
+	} else {
+		ret = SWITCH_TRUE;
+		*rows = switch_cache_db_affected_rows(dbh);
+	}
+
+end:
+	if (dbh) {
+		switch_cache_db_release_db_handle(&dbh);
+	}
+
+	return ret;
+}
+
+static const char *apn_dim_tables[APN_DIM_MAX] = { "push_realms", "push_apps", "push_types", "push_platforms" };
+
+/* id 0 remembers a miss for APN_DIM_MISS_TTL sec, so lookups of unknown realm don't hit db every time */
+static void apn_dim_cache(enum apn_dim dim, const char *name, uint32_t id)
+{
+	apn_dim_id_t *cached;
+
+	switch_mutex_lock(globals.dim_mutex);
+	if (!(cached = switch_core_hash_find(globals.dim_ids[dim], name))) {
+		if (!id && globals.dim_misses >= APN_DIM_MISS_MAX) {
+			goto end;
+		}
+		switch_zmalloc(cached, sizeof(*cached));
+		switch_core_hash_insert(globals.dim_ids[dim], name, cached);
+		if (!id) {
+			globals.dim_misses++;
+		}
+	} else if (!cached->id && id) {
+		globals.dim_misses--;
+	} else if (cached->id && !id) {
+		/*Known id isn't replaced by a miss*/
+		goto end;
+	}
+	cached->id = id;
+	cached->miss_until = id ? 0 : switch_micro_time_now() + APN_DIM_MISS_TTL * 1000000;
+
+end:
+	switch_mutex_unlock(globals.dim_mutex);
+}
+
+static uint32_t apn_dim_select(switch_cache_db_handle_t *dbh, enum apn_dim dim, const char *name)
+{
+	char *sql, *err = NULL, res[32] = "";
+	uint32_t id = 0;
+
+	sql = switch_mprintf("SELECT id FROM %s WHERE name = '%q'", apn_dim_tables[dim], name);
+	if (switch_cache_db_execute_sql2str(dbh, sql, res, sizeof(res), &err) && !err) {
+		id = (uint32_t) strtoul(res, NULL, 10);
+	}
+	if (err) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "SQL ERR: [%s]\n%s\n", err, sql);
+		switch_safe_free(err);
+	}
+	switch_safe_free(sql);
+
+	return id;
+}
+
+/* Id of dimension value as decimal string in buf, 0 when it isn't known (and create is SWITCH_FALSE) or on db error */
+static uint32_t apn_dim_ref(enum apn_dim dim, const char *name, switch_bool_t create, char *buf, switch_size_t len)
+{
+	switch_cache_db_handle_t *dbh = NULL;
+	apn_dim_id_t *cached;
+	uint32_t id = 0;
+	switch_bool_t miss = SWITCH_FALSE;
+	char *sql = NULL, *err = NULL;
+	int attempt;
+
+	if (zstr(name)) {
+		goto end;
+	}
+
+	switch_mutex_lock(globals.dim_mutex);
+	if ((cached = switch_core_hash_find(globals.dim_ids[dim], name))) {
+		id = cached->id;
+		miss = !id && cached->miss_until > switch_micro_time_now();
+	}
+	switch_mutex_unlock(globals.dim_mutex);
+
+	if (id || (miss && !create)) {
+		goto end;
+	}
+
+	/*New realm, app or platform: first seen value, so it's rare*/
+	if (!(dbh = mod_apn_get_db_handle())) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Error Opening DB\n");
+		goto end;
+	}
+
+	/*SELECT, INSERT, SELECT again: INSERT of concurrent writer fails on unique name, then its row is read*/
+	for (attempt = 0; !(id = apn_dim_select(dbh, dim, name)) && create && attempt < 2; attempt++) {
+		sql = switch_mprintf("INSERT INTO %s (name) VALUES ('%q')", apn_dim_tables[dim], name);
+		switch_cache_db_execute_sql(dbh, sql, &err);
+		if (err) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. Insert of %s '%s' failed, reading it again: %s\n", apn_dim_tables[dim], name, err);
+			switch_safe_free(err);
+		}
+		switch_safe_free(sql);
+	}
+	switch_cache_db_release_db_handle(&dbh);
+
+	apn_dim_cache(dim, name, id);
+
+end:
+	if (buf) {
+		switch_snprintf(buf, len, "%u", id);
+	}
+
+	return id;
+}
+
+/* args is token, extension, realm, app_id, type, platform; creates missing dimension values */
+static switch_bool_t apn_token_refs_resolve(apn_token_refs_t *refs, const char **args)
+{
+	int i;
+
+	refs->args[0] = args[0];
+	refs->args[1] = args[1];
+	for (i = 0; i < APN_DIM_MAX; i++) {
+		if (!apn_dim_ref((enum apn_dim) i, args[i + 2], SWITCH_TRUE, refs->ids[i], sizeof(refs->ids[i]))) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "CARUSTO. No id for %s '%s', token %s isn't stored\n",
+							  apn_dim_tables[i], switch_str_nil(args[i + 2]), args[0]);
+			return SWITCH_FALSE;
+		}
+		refs->args[i + 2] = refs->ids[i];
+	}
+
+	return SWITCH_TRUE;
+}
+
+static int apn_dim_load_callback(void *pArg, int argc, char **argv, char **columnNames)
+{
+	enum apn_dim dim = *(enum apn_dim *) pArg;
+
+	if (argc >= 2 && !zstr(argv[0]) && !zstr(argv[1])) {
+		apn_dim_cache(dim, argv[1], (uint32_t) strtoul(argv[0], NULL, 10));
+	}
+
+	return 0;
+}
+
+/* Warm id cache, dimension tables are small */
+static void apn_dim_load(void)
+{
+	enum apn_dim dim;
+	char *sql;
+
+	for (dim = 0; dim < APN_DIM_MAX; dim++) {
+		sql = switch_mprintf("SELECT id, name FROM %s", apn_dim_tables[dim]);
+		mod_apn_execute_sql_callback(sql, apn_dim_load_callback, &dim);
+		switch_safe_free(sql);
+	}
+}
+
+static void apn_dim_destroy(void)
+{
+	switch_hash_index_t *hi;
+	const void *key;
+	void *val;
+	int i;
+
+	for (i = 0; i < APN_DIM_MAX; i++) {
+		if (!globals.dim_ids[i]) {
+			continue;
+		}
+		while ((hi = switch_core_hash_first(globals.dim_ids[i]))) {
+			switch_core_hash_this(hi, &key, NULL, &val);
+			switch_core_hash_delete(globals.dim_ids[i], (const char *) key);
+			free(val);
+		}
+		switch_core_hash_destroy(&globals.dim_ids[i]);
+	}
+}
+
+/* '?' is placeholder of bound parameter */
+static struct {
+	const char *name;
+	const char *sql;
+	int argc;
+} apn_stmt_defs[APN_STMT_MAX] = {
+	{ "apn_select_token_entries",
+	  "SELECT p.name, a.name, t.token, w.latencies, w.misses FROM push_token_entries t "
+	  "JOIN push_platforms p ON p.id = t.platform_ref JOIN push_apps a ON a.id = t.app_ref JOIN push_types ty ON ty.id = t.type_ref "
+	  "LEFT JOIN push_token_wake w ON w.token = t.token AND w.type = ty.name "
+	  "WHERE t.extension = ? AND t.realm_ref = ? AND t.type_ref = ?", 3 },
+	{ "apn_upsert_token_entry",
+	  "INSERT INTO push_token_entries (token, extension, realm_ref, app_ref, type_ref, platform_ref) VALUES (?, ?, ?, ?, ?, ?) "
+	  "ON CONFLICT (token, extension, realm_ref, app_ref, type_ref) DO UPDATE SET platform_ref = excluded.platform_ref, last_update = CURRENT_TIMESTAMP", 6 },
+	{ "apn_touch_token_entry",
+	  "UPDATE push_token_entries SET last_update = CURRENT_TIMESTAMP WHERE token = ? AND extension = ? AND realm_ref = ? AND app_ref = ? AND type_ref = ?", 5 },
+	{ "apn_delete_token_entry",
+	  "DELETE FROM push_token_entries WHERE token = ? AND type_ref = ?", 2 },
+	{ "apn_update_token_entry",
+	  "UPDATE push_token_entries SET platform_ref = ?, last_update = CURRENT_TIMESTAMP "
+	  "WHERE token = ? AND extension = ? AND realm_ref = ? AND app_ref = ? AND type_ref = ?", 6 },
+	{ "apn_insert_token_entry",
+	  "INSERT INTO push_token_entries (token, extension, realm_ref, app_ref, type_ref, platform_ref) VALUES (?, ?, ?, ?, ?, ?)", 6 },
+	{ "apn_count_token_entry",
+	  "SELECT count(*) FROM push_token_entries WHERE token = ? AND extension = ? AND realm_ref = ? AND app_ref = ? AND type_ref = ?", 5 }
+};
+
+/* Replace placeholders with $N (pgsql == SWITCH_TRUE) or with quoted values */
+static char *apn_stmt_render(enum apn_stmt_id id, const char **argv, switch_bool_t pgsql)
+{
+	switch_stream_handle_t stream = { 0 };
+	const char *p;
+	int n = 0;
+
+	SWITCH_STANDARD_STREAM(stream);
+
+	for (p = apn_stmt_defs[id].sql; *p; p++) {
+		if (*p != '?') {
+			stream.write_function(&stream, "%c", *p);
+		} else if (pgsql) {
+			stream.write_function(&stream, "$%d", ++n);
+		} else {
+			char *val = switch_mprintf("'%q'", switch_str_nil(argv[n++]));
+			stream.write_function(&stream, "%s", val);
+			switch_safe_free(val);
+		}
+	}
+
+	return (char *) stream.data;
+}
+
+static uint32_t apn_db_shard_index(void)
+{
+	uint64_t id = (uint64_t)(uintptr_t) switch_thread_self();
+
+	id ^= id >> 33;
+	id *= 0xff51afd7ed558ccdULL;
+	id ^= id >> 33;
+
+	return (uint32_t)(id % APN_DB_SHARDS);
+}
+
+static apn_db_conn_t *apn_db_conn_acquire(void)
+{
+	apn_db_conn_t *conn = NULL;
+	uint32_t shard = apn_db_shard_index();
+
+	switch_mutex_lock(globals.db_shards[shard].mutex);
+	if ((conn = globals.db_shards[shard].conns)) {
+		globals.db_shards[shard].conns = conn->next;
+		conn->next = NULL;
+	}
+	switch_mutex_unlock(globals.db_shards[shard].mutex);
+
+	if (!conn) {
+		switch_zmalloc(conn, sizeof(*conn));
+		conn->shard = shard;
+		if (!(conn->db = switch_core_db_open_file(globals.dbname))) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Error Opening DB %s\n", globals.dbname);
+			switch_safe_free(conn);
+		}
+	}
+
+	return conn;
+}
+
+static void apn_db_conn_release(apn_db_conn_t *conn)
+{
+	apn_db_shard_t *shard = &globals.db_shards[conn->shard];
+
+	switch_mutex_lock(shard->mutex);
+	conn->next = shard->conns;
+	shard->conns = conn;
+	switch_mutex_unlock(shard->mutex);
+}
+
+static void apn_db_conn_destroy_all(void)
+{
+	apn_db_conn_t *conn;
+	int i, n;
+
+	for (n = 0; n < APN_DB_SHARDS; n++) {
+		if (!globals.db_shards[n].mutex) {
+			continue;
+		}
+
+		switch_mutex_lock(globals.db_shards[n].mutex);
+		while ((conn = globals.db_shards[n].conns)) {
+			globals.db_shards[n].conns = conn->next;
+			for (i = 0; i < APN_STMT_MAX; i++) {
+				if (conn->stmt[i]) {
+					switch_core_db_finalize(conn->stmt[i]);
+				}
+			}
+			switch_core_db_close(conn->db);
+			free(conn);
+		}
+		switch_mutex_unlock(globals.db_shards[n].mutex);
+	}
+}
+
+static switch_core_db_stmt_t *apn_db_conn_stmt(apn_db_conn_t *conn, enum apn_stmt_id id)
+{
+	if (!conn->stmt[id] &&
+		switch_core_db_prepare(conn->db, apn_stmt_defs[id].sql, -1, &conn->stmt[id], NULL) != SWITCH_CORE_DB_OK) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "SQL ERR: [%s]\n%s\n", switch_core_db_errmsg(conn->db), apn_stmt_defs[id].sql);
+		conn->stmt[id] = NULL;
+	}
+
+	return conn->stmt[id];
+}
+
+static switch_bool_t apn_db_conn_step(apn_db_conn_t *conn, enum apn_stmt_id id, const char **argv,
+									   switch_core_db_callback_func_t callback, void *pdata)
+{
+	switch_core_db_stmt_t *stmt;
+	char *cols[8];
+	int i, rc, ncols, busy = 0;
+
+	if (!(stmt = apn_db_conn_stmt(conn, id))) {
+		return SWITCH_FALSE;
+	}
+
+	for (i = 0; i < apn_stmt_defs[id].argc; i++) {
+		switch_core_db_bind_text(stmt, i + 1, switch_str_nil(argv[i]), -1, SWITCH_CORE_DB_STATIC);
+	}
+
+	while ((rc = switch_core_db_step(stmt)) == SWITCH_CORE_DB_ROW || (rc == SWITCH_CORE_DB_BUSY && busy++ < 100)) {
+		if (rc == SWITCH_CORE_DB_BUSY) {
+			switch_yield(10000);
+			continue;
+		}
+
+		if (!callback) {
+			continue;
+		}
+
+		ncols = switch_core_db_column_count(stmt);
+		if (ncols > (int) (sizeof(cols) / sizeof(cols[0]))) {
+			ncols = sizeof(cols) / sizeof(cols[0]);
+		}
+		for (i = 0; i < ncols; i++) {
+			cols[i] = (char *) switch_core_db_column_text(stmt, i);
+		}
+		if (callback(pdata, ncols, cols, NULL)) {
+			break;
+		}
+	}
+
+	switch_core_db_reset(stmt);
+
+	if (rc != SWITCH_CORE_DB_DONE && rc != SWITCH_CORE_DB_ROW) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "SQL ERR: [%s]\n%s\n", switch_core_db_errmsg(conn->db), apn_stmt_defs[id].sql);
+		return SWITCH_FALSE;
+	}
+
+	return SWITCH_TRUE;
+}
+
+static char *apn_pgsql_exec(switch_cache_db_handle_t *dbh, enum apn_stmt_id id, const char **argv,
+							switch_core_db_callback_func_t callback, void *pdata)
+{
+	switch_stream_handle_t stream = { 0 };
+	char *err = NULL;
+	int i;
+
+	SWITCH_STANDARD_STREAM(stream);
+	stream.write_function(&stream, "EXECUTE %s(", apn_stmt_defs[id].name);
+	for (i = 0; i < apn_stmt_defs[id].argc; i++) {
+		char *val = switch_mprintf("%s'%q'", i ? ", " : "", switch_str_nil(argv[i]));
+		stream.write_function(&stream, "%s", val);
+		switch_safe_free(val);
+	}
+	stream.write_function(&stream, ")");
+
+	/*Plain exec keeps count of affected rows*/
+	if (callback) {
+		switch_cache_db_execute_sql_callback(dbh, (char *) stream.data, callback, pdata, &err);
+	} else {
+		switch_cache_db_execute_sql(dbh, (char *) stream.data, &err);
+	}
+	switch_safe_free(stream.data);
+
+	return err;
+}
+
+/* Upsert for odbc backends without ON CONFLICT (MySQL, MSSQL...): UPDATE, INSERT when no row was updated.
+ * With unique key of push_token_entries INSERT may lose the race with other node, then UPDATE is tried once more.
+ * Backend which refused the key may get duplicate rows from such race, readers skip them */
+static switch_bool_t apn_odbc_upsert(switch_cache_db_handle_t *dbh, const char **argv, int *changes)
+{
+	const char *update_args[6];
+	char *sql = NULL, *err = NULL, count[16] = "";
+	int attempt, rows = 0;
+
+	update_args[0] = argv[5];
+	memcpy(&update_args[1], argv, sizeof(*argv) * 5);
+
+	for (attempt = 0; attempt < 2; attempt++) {
+		sql = apn_stmt_render(APN_STMT_UPDATE_TOKEN, update_args, SWITCH_FALSE);
+		switch_cache_db_execute_sql(dbh, sql, &err);
+		switch_safe_free(sql);
+		if (err) {
+			break;
+		}
+		if ((rows = switch_cache_db_affected_rows(dbh)) > 0) {
+			break;
+		}
+
+		/*Row is there, but nothing changed in it*/
+		sql = apn_stmt_render(APN_STMT_COUNT_TOKEN, argv, SWITCH_FALSE);
+		switch_cache_db_execute_sql2str(dbh, sql, count, sizeof(count), &err);
+		switch_safe_free(sql);
+		if (err) {
+			break;
+		}
+		if (atoi(count) > 0) {
+			break;
+		}
+
+		sql = apn_stmt_render(APN_STMT_INSERT_TOKEN, argv, SWITCH_FALSE);
+		switch_cache_db_execute_sql(dbh, sql, &err);
+		switch_safe_free(sql);
+		if (!err) {
+			rows = 1;
+			break;
+		}
+		if (!attempt) {
+			switch_safe_free(err);
+		}
+	}
+
+	if (err) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "SQL ERR: [%s]\n%s\n", err, apn_stmt_defs[APN_STMT_UPDATE_TOKEN].sql);
+		free(err);
+		return SWITCH_FALSE;
+	}
+
+	if (changes) {
+		*changes = rows;
+	}
+
+	return SWITCH_TRUE;
+}
+
+/* Run prepared statement, one row of parameters per call of rows[] */
+static switch_bool_t apn_stmt_exec_many(enum apn_stmt_id id, const char ***rows, int count)
+{
+	switch_bool_t ret = SWITCH_TRUE;
+	int i;
+
+	if (globals.db_kind == APN_DB_CORE) {
+		apn_db_conn_t *conn;
+
+		if (!(conn = apn_db_conn_acquire())) {
+			return SWITCH_FALSE;
+		}
+		if (count > 1) {
+			switch_core_db_exec(conn->db, "BEGIN", NULL, NULL, NULL);
+		}
+		for (i = 0; i < count; i++) {
+			ret &= apn_db_conn_step(conn, id, rows[i], NULL, NULL);
+		}
+		if (count > 1) {
+			switch_core_db_exec(conn->db, "COMMIT", NULL, NULL, NULL);
+		}
+		apn_db_conn_release(conn);
+	} else {
+		for (i = 0; i < count; i++) {
+			ret &= apn_stmt_exec(id, rows[i], NULL, NULL);
+		}
+	}
+
+	return ret;
+}
+
+static switch_bool_t apn_stmt_exec_dbh(switch_cache_db_handle_t *dbh, enum apn_db_kind kind, enum apn_stmt_id id, const char **argv,
+									   switch_core_db_callback_func_t callback, void *pdata, int *changes)
+{
+	switch_bool_t ret = SWITCH_FALSE;
+	char *sql = NULL, *err = NULL;
+
+	if (kind == APN_DB_ODBC && id == APN_STMT_UPSERT_TOKEN) {
+		return apn_odbc_upsert(dbh, argv, changes);
+	}
+
+	if (kind == APN_DB_PGSQL) {
+		/*Statement isn't prepared on this connection yet (or connection was reopened), prepare and try again*/
+		if ((err = apn_pgsql_exec(dbh, id, argv, callback, pdata))) {
+			char *body = apn_stmt_render(id, argv, SWITCH_TRUE);
+
+			switch_safe_free(err);
+			sql = switch_mprintf("PREPARE %s AS %s", apn_stmt_defs[id].name, body);
+			switch_cache_db_execute_sql(dbh, sql, &err);
+			switch_safe_free(err);
+			switch_safe_free(body);
+
+			err = apn_pgsql_exec(dbh, id, argv, callback, pdata);
+		}
+	} else if (callback) {
+		sql = apn_stmt_render(id, argv, SWITCH_FALSE);
+		switch_cache_db_execute_sql_callback(dbh, sql, callback, pdata, &err);
+	} else {
+		sql = apn_stmt_render(id, argv, SWITCH_FALSE);
+		switch_cache_db_execute_sql(dbh, sql, &err);
+	}
+
+	if (err) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "SQL ERR: [%s]\n%s\n", err, apn_stmt_defs[id].sql);
+		free(err);
+	} else {
+		ret = SWITCH_TRUE;
+		if (changes) {
+			*changes = switch_cache_db_affected_rows(dbh);
+		}
+	}
+
+	switch_safe_free(sql);
+
+	return ret;
+}
+
+static void apn_dsn_report(apn_dsn_t *dsn, switch_time_t start, switch_bool_t ok)
+{
+	switch_time_t took = switch_time_now() - start;
+
+	switch_mutex_lock(dsn->mutex);
+	dsn->queries++;
+	if (!ok) {
+		dsn->errors++;
+	}
+	/*EWMA with 1/8 weight of the last query*/
+	dsn->avg_us = dsn->avg_us ? (dsn->avg_us * 7 + took) / 8 : took;
+	if (took > dsn->max_us) {
+		dsn->max_us = took;
+	}
+	switch_mutex_unlock(dsn->mutex);
+}
+
+static void apn_dsn_mark_down(apn_dsn_t *dsn, const char *reason)
+{
+	switch_mutex_lock(dsn->mutex);
+	if (!dsn->down) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "CARUSTO. Read replica %s, lookups go to primary for %u sec\n", reason, globals.odbc_read_retry);
+	}
+	dsn->down = SWITCH_TRUE;
+	dsn->retry_at = switch_epoch_time_now(NULL) + globals.odbc_read_retry;
+	switch_mutex_unlock(dsn->mutex);
+}
+
+/* Open replica and measure its lag, SWITCH_FALSE when it isn't fit for reads */
+static switch_bool_t apn_dsn_check(apn_dsn_t *dsn, double *lag)
+{
+	switch_cache_db_handle_t *dbh = NULL;
+	char buf[64] = "", *err = NULL;
+	switch_bool_t ret = SWITCH_TRUE;
+
+	*lag = 0;
+
+	if (switch_cache_db_get_db_handle_dsn(&dbh, dsn->dsn) != SWITCH_STATUS_SUCCESS) {
+		return SWITCH_FALSE;
+	}
+
+	if (globals.odbc_read_max_lag && !zstr(globals.odbc_read_lag_query)) {
+		if (!switch_cache_db_execute_sql2str(dbh, globals.odbc_read_lag_query, buf, sizeof(buf), &err) || err) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "SQL ERR: [%s]\n%s\n", switch_str_nil(err), globals.odbc_read_lag_query);
+			switch_safe_free(err);
+			ret = SWITCH_FALSE;
+		} else {
+			*lag = strtod(buf, NULL);
+		}
+	}
+
+	switch_cache_db_release_db_handle(&dbh);
+
+	return ret;
+}
+
+/* Lookups only read verdict of last check */
+static switch_bool_t apn_dsn_readable(apn_dsn_t *dsn)
+{
+	switch_bool_t ret;
+
+	switch_mutex_lock(dsn->mutex);
+	ret = !dsn->down;
+	switch_mutex_unlock(dsn->mutex);
+
+	return ret;
+}
+
+/* Check replica when it's due: every odbc_read_check_interval sec while up, after odbc_read_retry sec when down */
+static void apn_dsn_probe(apn_dsn_t *dsn)
+{
+	time_t now = switch_epoch_time_now(NULL);
+	switch_bool_t ok, lagging, due, first;
+	double lag = 0;
+
+	switch_mutex_lock(dsn->mutex);
+	first = !dsn->checked;
+	due = first || (dsn->down && now >= dsn->retry_at) || (!dsn->down && now >= dsn->check_at);
+	switch_mutex_unlock(dsn->mutex);
+
+	if (!due) {
+		return;
+	}
+
+	ok = apn_dsn_check(dsn, &lag);
+	lagging = ok && globals.odbc_read_max_lag && lag > globals.odbc_read_max_lag;
+
+	switch_mutex_lock(dsn->mutex);
+	dsn->check_at = now + globals.odbc_read_check_interval;
+	dsn->lag = lag;
+	if (ok && !lagging) {
+		if (dsn->down) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "CARUSTO. Read replica is %s, lag %.1f sec\n", dsn->checked ? "back" : "up", lag);
+		}
+		dsn->down = SWITCH_FALSE;
+		dsn->lagging = SWITCH_FALSE;
+	}
+	dsn->checked = SWITCH_TRUE;
+	switch_mutex_unlock(dsn->mutex);
+
+	if (first && (lagging || !ok)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "CARUSTO. Read replica %s on start, lookups go to primary\n", ok ? "is lagging" : "is unavailable");
+	}
+
+	if (lagging) {
+		switch_mutex_lock(dsn->mutex);
+		dsn->lagging = SWITCH_TRUE;
+		switch_mutex_unlock(dsn->mutex);
+		apn_dsn_mark_down(dsn, "is lagging");
+	} else if (!ok) {
+		apn_dsn_mark_down(dsn, "is unavailable");
+	}
+}
+
+static void *SWITCH_THREAD_FUNC apn_dsn_thread_run(switch_thread_t *thread, void *obj)
+{
+	apn_dsn_t *dsn = (apn_dsn_t *) obj;
+	int i;
+
+	while (globals.running) {
+		apn_dsn_probe(dsn);
+		for (i = 0; i < 10 && globals.running; i++) {
+			switch_yield(100000);
+		}
+	}
+
+	return NULL;
+}
+
+/* changes (optional) gets count of rows changed by statement */
+static switch_bool_t apn_stmt_exec_changes(enum apn_stmt_id id, const char **argv, switch_core_db_callback_func_t callback, void *pdata, int *changes)
+{
+	switch_bool_t ret = SWITCH_FALSE;
+	switch_cache_db_handle_t *dbh = NULL;
+	switch_time_t start = switch_time_now();
+
+	if (globals.db_kind == APN_DB_CORE) {
+		apn_db_conn_t *conn;
+
+		if ((conn = apn_db_conn_acquire())) {
+			ret = apn_db_conn_step(conn, id, argv, callback, pdata);
+			if (ret && changes) {
+				*changes = switch_core_db_changes(conn->db);
+			}
+			apn_db_conn_release(conn);
+		}
+		apn_dsn_report(&globals.db_primary, start, ret);
+		return ret;
+	}
+
+	if (!(dbh = mod_apn_get_db_handle())) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Error Opening DB\n");
+		apn_dsn_report(&globals.db_primary, start, SWITCH_FALSE);
+		return SWITCH_FALSE;
+	}
+
+	ret = apn_stmt_exec_dbh(dbh, globals.db_kind, id, argv, callback, pdata, changes);
+	switch_cache_db_release_db_handle(&dbh);
+	apn_dsn_report(&globals.db_primary, start, ret);
+
+	return ret;
+}
+
+static switch_bool_t apn_stmt_exec(enum apn_stmt_id id, const char **argv, switch_core_db_callback_func_t callback, void *pdata)
+{
+	return apn_stmt_exec_changes(id, argv, callback, pdata, NULL);
+}
+
+/* Lookup on read replica if it's up and not lagging, primary otherwise */
+static switch_bool_t apn_stmt_read(enum apn_stmt_id id, const char **argv, switch_core_db_callback_func_t callback, void *pdata)
+{
+	apn_dsn_t *replica = &globals.db_replica;
+	switch_cache_db_handle_t *dbh = NULL;
+	switch_time_t start;
+	switch_bool_t ok = SWITCH_FALSE;
+
+	if (zstr(replica->dsn) || !apn_dsn_readable(replica)) {
+		return apn_stmt_exec(id, argv, callback, pdata);
+	}
+
+	start = switch_time_now();
+	if (switch_cache_db_get_db_handle_dsn(&dbh, replica->dsn) == SWITCH_STATUS_SUCCESS) {
+		ok = apn_stmt_exec_dbh(dbh, replica->kind, id, argv, callback, pdata, NULL);
+		switch_cache_db_release_db_handle(&dbh);
+	}
+	apn_dsn_report(replica, start, ok);
+
+	if (ok) {
+		return SWITCH_TRUE;
+	}
+
+	apn_dsn_mark_down(replica, "query failed");
+	switch_mutex_lock(replica->mutex);
+	replica->fallbacks++;
+	switch_mutex_unlock(replica->mutex);
+
+	return apn_stmt_exec(id, argv, callback, pdata);
+}
+
+static void apn_dsn_dump(switch_stream_handle_t *stream)
+{
+	apn_dsn_t *list[2] = { &globals.db_primary, &globals.db_replica };
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		apn_dsn_t *dsn = list[i];
+
+		if (zstr(dsn->dsn)) {
+			continue;
+		}
+
+		switch_mutex_lock(dsn->mutex);
+		stream->write_function(stream, "db %s: %s, queries %" SWITCH_UINT64_T_FMT ", errors %" SWITCH_UINT64_T_FMT
+							   ", avg %.2f ms, max %.2f ms", dsn->name, dsn->lagging ? "lagging" : dsn->down ? "down" : "up",
+							   dsn->queries, dsn->errors, dsn->avg_us / 1000.0, dsn->max_us / 1000.0);
+		if (dsn == &globals.db_replica) {
+			stream->write_function(stream, ", lag %.1f sec, fallbacks %" SWITCH_UINT64_T_FMT, dsn->lag, dsn->fallbacks);
+		}
+		stream->write_function(stream, "\n");
+		switch_mutex_unlock(dsn->mutex);
+	}
+}
+
+static int sql2str_callback(void *pArg, int argc, char **argv, char **columnNames)
+{
+	callback_t *cbt = (callback_t *) pArg;
+	cJSON *item = NULL, *iterator;
+
+	if (!cbt) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Something wrong with callback structure\n");
+		return 0;
+	}
+
+	if (argc < 3) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Something wrong with SQL callback (%d)\n", argc);
+		return 0;
+	}
+
+	if (zstr(argv[0]) || zstr(argv[1]) || zstr(argv[2])) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Something wrong with SQL callback (token: '%s', platform: '%s', app_id: '%s')\n", argv[0], argv[1], argv[2]);
+		return 0;
+	}
+
+	/*Odbc backend without unique key of push_token_entries may have duplicate rows, push goes once per device*/
+	cJSON_ArrayForEach(iterator, cbt->array) {
+		if (!strcmp(switch_str_nil(cJSON_GetObjectCstr(iterator, "token")), argv[2]) && !strcmp(switch_str_nil(cJSON_GetObjectCstr(iterator, "app_id")), argv[1])) {
+			return 0;
+		}
+	}
+
+	item = cJSON_CreateObject();
+	cJSON_AddItemToArray(cbt->array, item);
+	cJSON_AddItemToObject(item, "platform", cJSON_CreateString(argv[0]));
+	cJSON_AddItemToObject(item, "app_id", cJSON_CreateString(argv[1]));
+	cJSON_AddItemToObject(item, "token", cJSON_CreateString(argv[2]));
+
+	if (argc > 4) {
+		cJSON_AddItemToObject(item, "latencies", cJSON_CreateString(switch_str_nil(argv[3])));
+		cJSON_AddItemToObject(item, "misses", cJSON_CreateNumber(zstr(argv[4]) ? 0 : strtol(argv[4], NULL, 10)));
+	}
+
+	return 0;
+}
+
+// auth_type: "none|jwt|basic|digest"
+// auth_data: "token"|"login:password"
+static http_auth_t *parse_auth_param(char *auth_type, char *auth_data, switch_memory_pool_t *pool)
+{
+	http_auth_t *res = NULL;
+
+	if ((res = switch_core_alloc(pool, sizeof(*res))) == NULL) {
+		return NULL;
+	}
+	res->type = NONE;
+
+	if (zstr(auth_type)) {
+		return res;
+	}
+
+	if (!zstr(auth_type)) {
+		if (!strcasecmp(auth_type, "jwt")) {
+			res->type = JWT;
+		} else if (!strcasecmp(auth_type, "basic")) {
+			res->type = BASIC;
+		} else if (!strcasecmp(auth_type, "digest")) {
+			res->type = DIGEST;
+		} else if (!strcasecmp(auth_type, "none")) {
+			res->type = NONE;
+		} else {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "mod_apn doesn't support type auth: %s\n", auth_type);
+		}
+
+		if (!zstr(auth_data)) {
+			res->data = switch_core_strdup(pool, auth_data);
+		} else {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Something wrong with auth data\n");
+			res->type = NONE;
+		}
+	}
+
+	if (res->type == DIGEST) {
+		char *password;
+
+		res->digest = switch_core_alloc(pool, sizeof(*res->digest));
+		memset(res->digest, 0, sizeof(*res->digest));
+		switch_mutex_init(&res->digest->mutex, SWITCH_MUTEX_NESTED, pool);
+		res->digest->username = switch_core_strdup(pool, res->data);
+		if ((password = strchr(res->digest->username, ':'))) {
+			*password++ = '\0';
+		}
+		res->digest->password = password ? password : "";
+	}
+
+	return res;
+}
+
+/* Lowercase "type|app_id|platform|realm" key of route_hash */
+static void route_key(char *key, size_t len, const char *type, const char *app_id, const char *platform, const char *realm)
+{
+	char *p;
+
+	switch_snprintf(key, len, "%s|%s|%s|%s", switch_str_nil(type), switch_str_nil(app_id), switch_str_nil(platform), switch_str_nil(realm));
+	for (p = key; *p; p++) {
+		*p = (char) switch_tolower(*p);
+	}
+}
+
+/* Most specific routed profile for token, base profile of type when no rule matches */
+static profile_t *push_route(const char *type, const char *app_id, const char *platform, const char *realm)
+{
+	/*Bits: 4 - app_id, 2 - platform, 1 - realm*/
+	static const int patterns[] = { 7, 6, 5, 3, 4, 2, 1, 0 };
+	char key[1024];
+	profile_t *profile;
+	int i;
+
+	if (globals.route_hash) {
+		for (i = 0; i < 8; i++) {
+			route_key(key, sizeof(key), type, patterns[i] & 4 ? app_id : "*", patterns[i] & 2 ? platform : "*", patterns[i] & 1 ? realm : "*");
+			if ((profile = switch_core_hash_find(globals.route_hash, key))) {
+				return profile;
+			}
+		}
+	}
+
+	return switch_core_hash_find(globals.profile_hash, type);
+}
+
+/* Comma separated lists of match_* params, every combination becomes key of route_hash */
+static void route_compile(profile_t *profile, const char *match_app_id, const char *match_platform, const char *match_realm)
+{
+	char *app_ids[32] = { 0 }, *platforms[32] = { 0 }, *realms[32] = { 0 };
+	char *app_data = strdup(zstr(match_app_id) ? "*" : match_app_id);
+	char *platform_data = strdup(zstr(match_platform) ? "*" : match_platform);
+	char *realm_data = strdup(zstr(match_realm) ? "*" : match_realm);
+	int app_count, platform_count, realm_count, a, b, c;
+	char key[1024];
+	profile_t *other;
+
+	app_count = switch_separate_string(app_data, ',', app_ids, 32);
+	platform_count = switch_separate_string(platform_data, ',', platforms, 32);
+	realm_count = switch_separate_string(realm_data, ',', realms, 32);
+
+	if (!globals.route_hash) {
+		switch_core_hash_init(&globals.route_hash);
+	}
+
+	for (a = 0; a < app_count; a++) {
+		for (b = 0; b < platform_count; b++) {
+			for (c = 0; c < realm_count; c++) {
+				route_key(key, sizeof(key), profile->type, app_ids[a], platforms[b], realms[c]);
+				if ((other = switch_core_hash_find(globals.route_hash, key))) {
+					switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Route %s of profile '%s' is taken by profile '%s'\n", key, profile->name, other->name);
+					continue;
+				}
+				switch_core_hash_insert(globals.route_hash, key, profile);
+				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Route %s to profile '%s'\n", key, profile->name);
+			}
+		}
+	}
+
+	switch_safe_free(app_data);
+	switch_safe_free(platform_data);
+	switch_safe_free(realm_data);
+}
+
+/* Headers which are the same for every push of profile */
+static switch_curl_slist_t *build_profile_headers(profile_t *profile)
+{
+	switch_curl_slist_t *headers = NULL;
+	char *header = NULL;
+
+	if (profile->content_type) {
+		header = switch_mprintf("Content-Type: %s", profile->content_type);
+		headers = switch_curl_slist_append(headers, header);
+		switch_safe_free(header);
+	}
+
+	if (profile->auth && profile->auth->type == BASIC) {
+		switch_size_t len = strlen(profile->auth->data), b64_len = ((len + 2) / 3) * 4 + 1;
+		unsigned char *b64 = malloc(b64_len);
+
+		switch_assert(b64);
+		switch_b64_encode((unsigned char *) profile->auth->data, len, b64, b64_len);
+		header = switch_mprintf("Authorization: Basic %s", b64);
+		headers = switch_curl_slist_append(headers, header);
+		switch_safe_free(header);
+		switch_safe_free(b64);
+	} else if (profile->auth && profile->auth->type == JWT) {
+		header = switch_mprintf("Authorization: Bearer %s", profile->auth->data);
+		headers = switch_curl_slist_append(headers, header);
+		switch_safe_free(header);
+	}
+
+	return headers;
+}
+
+static void destroy_profile_headers(void)
+{
+	switch_hash_index_t *hi;
+
+	if (!globals.profile_hash) {
+		return;
+	}
+
+	for (hi = switch_core_hash_first(globals.profile_hash); hi; hi = switch_core_hash_next(&hi)) {
+		const void *key;
+		void *val;
+		profile_t *profile;
+
+		switch_core_hash_this(hi, &key, NULL, &val);
+		profile = (profile_t *) val;
+		switch_curl_slist_free_all(profile->headers);
+		profile->headers = NULL;
+		conn_pool_destroy(profile);
+		if (profile->batches) {
+			switch_core_hash_destroy(&profile->batches);
+		}
+		if (profile->platform_templates) {
+			switch_core_hash_destroy(&profile->platform_templates);
+		}
+	}
+
+	if (globals.route_hash) {
+		switch_core_hash_destroy(&globals.route_hash);
+	}
+}
+
+// evict_on: "410,400:BadDeviceToken,200:NotRegistered" - http code and optional reason from response body
+static evict_rule_t *parse_evict_rules(char *evict_on, switch_memory_pool_t *pool)
+{
+	evict_rule_t *head = NULL, *tail = NULL, *rule = NULL;
+	char *data = NULL, *items[64] = { 0 }, *reason = NULL;
+	int argc, i;
+
+	if (zstr(evict_on)) {
+		return NULL;
+	}
+
+	data = switch_core_strdup(pool, evict_on);
+	argc = switch_split(data, ',', items);
+
+	for (i = 0; i < argc; i++) {
+		if (zstr(items[i])) {
+			continue;
+		}
+
+		if ((reason = strchr(items[i], ':'))) {
+			*reason++ = '\0';
+		}
+
+		rule = switch_core_alloc(pool, sizeof(*rule));
+		rule->code = strtol(items[i], NULL, 10);
+		rule->reason = zstr(reason) ? NULL : reason;
+
+		if (rule->code <= 0) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Wrong evict rule: %s\n", items[i]);
+			continue;
+		}
+
+		if (tail) {
+			tail->next = rule;
+		} else {
+			head = rule;
+		}
+		tail = rule;
+	}
+
+	return head;
+}
+
+static switch_status_t do_config(switch_memory_pool_t *pool)
+{
+	char *cf = "apn.conf";
+	switch_xml_t cfg, xml, settings, param, x_profile, x_profiles;
+	switch_status_t status = SWITCH_STATUS_SUCCESS;
+	profile_t *profile = NULL;
+	switch_cache_db_handle_t *dbh = NULL;
+	switch_bool_t snapshot_path_set = SWITCH_FALSE;
+	int i;
+
+	if (!(xml = switch_xml_open_cfg(cf, &cfg, NULL))) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "open of %s failed\n", cf);
+		return SWITCH_STATUS_TERM;
+	}
+
+	globals.db_online = 0;
+
+	if (globals.qm) {
+		switch_sql_queue_manager_destroy(&globals.qm);
+		globals.qm = NULL;
+	}
+
+	memset(&globals, 0, sizeof(globals));
+	globals.pool = pool;
+	globals.db_online = 1;
+	globals.evict_batch_size = 100;
+	globals.evict_flush_interval = 1000;
+	globals.register_batch_size = 200;
+	globals.register_flush_interval = 500;
+	globals.fingerprints_size = 0;
+	globals.register_touch_interval = 3600;
+	switch_mutex_init(&globals.fingerprints_mutex, SWITCH_MUTEX_NESTED, pool);
+	globals.fresh_register_window = 30;
+	globals.fresh_register_delay = 3000;
+	switch_core_hash_init(&globals.fresh_hash);
+	switch_mutex_init(&globals.fresh_mutex, SWITCH_MUTEX_NESTED, pool);
+	globals.wakeup_bus_poll_interval = 250;
+	switch_mutex_init(&globals.wakeup_remote_mutex, SWITCH_MUTEX_NESTED, pool);
+	switch_mutex_init(&globals.waiters_mutex, SWITCH_MUTEX_NESTED, pool);
+	for (i = 0; i < APN_DB_SHARDS; i++) {
+		switch_mutex_init(&globals.db_shards[i].mutex, SWITCH_MUTEX_NESTED, pool);
+	}
+	globals.odbc_read_max_lag = 5;
+	globals.odbc_read_check_interval = 5;
+	globals.odbc_read_retry = 10;
+	globals.db_primary.name = "primary";
+	globals.db_replica.name = "replica";
+	switch_mutex_init(&globals.db_primary.mutex, SWITCH_MUTEX_NESTED, pool);
+	switch_mutex_init(&globals.db_replica.mutex, SWITCH_MUTEX_NESTED, pool);
+	/*Replica gets lookups after first check of its thread*/
+	globals.db_replica.down = SWITCH_TRUE;
+	for (i = 0; i < APN_DIM_MAX; i++) {
+		switch_core_hash_init(&globals.dim_ids[i]);
+	}
+	switch_mutex_init(&globals.dim_mutex, SWITCH_MUTEX_NESTED, pool);
+	switch_mutex_init(&globals.waiter_mutex, SWITCH_MUTEX_NESTED, pool);
+	switch_core_hash_init(&globals.waiter_hash);
+	globals.wake_stats = SWITCH_TRUE;
+	globals.adaptive_wake_timeout = SWITCH_TRUE;
+	globals.wake_min_samples = 5;
+	globals.wake_timeout_factor = 150;
+	globals.wake_timeout_margin = 1000;
+	globals.wake_dead_misses = 3;
+	globals.wake_dead_timeout = 5000;
+	globals.wake_sample_window = 120;
+	globals.wake_cache_size = 10000;
+	globals.wake_cache_ttl = 3600;
+	switch_mutex_init(&globals.wake_mutex, SWITCH_MUTEX_NESTED, pool);
+	switch_mutex_init(&globals.loadtest_mutex, SWITCH_MUTEX_NESTED, pool);
+	switch_queue_create(&globals.wake_write_queue, 10000, pool);
+	switch_core_hash_init(&globals.wake_hash);
+	switch_core_hash_init(&globals.wake_pending_hash);
+	switch_core_hash_init(&globals.wake_platform_hash);
+	globals.token_store = SWITCH_FALSE;
+	globals.push_trace = SWITCH_TRUE;
+	globals.fork_grace = 1000;
+	switch_core_hash_init(&globals.inflight_hash);
+	switch_mutex_init(&globals.inflight_mutex, SWITCH_MUTEX_NESTED, pool);
+	globals.attempt_threads_count = 16;
+	switch_mutex_init(&globals.push_jobs_mutex, SWITCH_MUTEX_NESTED, pool);
+	globals.token_snapshot_interval = 60;
+	globals.outbox = SWITCH_FALSE;
+	globals.outbox_segment_size = 4 * 1024 * 1024;
+	globals.outbox_commit_interval = 10;
+	globals.outbox_drain_timeout = 5000;
+	globals.outbox_retry_interval = 10;
+	globals.outbox_max_attempts = 5;
+	globals.token_reconcile_interval = 300;
+	switch_core_hash_init(&globals.token_store_sets);
+	switch_core_hash_init(&globals.token_store_intern);
+	switch_mutex_init(&globals.token_store_intern_mutex, SWITCH_MUTEX_NESTED, pool);
+	switch_thread_rwlock_create(&globals.token_store_rwlock, pool);
+
+	if ((settings = switch_xml_child(cfg, "settings"))) {
+		for (param = switch_xml_child(settings, "param"); param; param = param->next) {
+			char *var = NULL;
+			char *val = NULL;
+			var = (char *) switch_xml_attr_soft(param, "name");
+			val = (char *) switch_xml_attr_soft(param, "value");
+			if (!strcasecmp(var, "odbc_dsn") && !zstr(val)) {
+				globals.odbc_dsn = switch_core_strdup(globals.pool, val);
+			} else if (!strcasecmp(var, "fresh_register_window") && !zstr(val)) {
+				int tmp = (int)strtol(val, NULL, 10);
+				if (tmp >= 0) {
+					globals.fresh_register_window = (uint32_t) tmp;
+				}
+			} else if (!strcasecmp(var, "fresh_register_delay") && !zstr(val)) {
+				int tmp = (int)strtol(val, NULL, 10);
+				if (tmp >= 0) {
+					globals.fresh_register_delay = (uint32_t) tmp;
+				}
+			} else if (!strcasecmp(var, "odbc_dsn_read") && !zstr(val)) {
+				globals.odbc_dsn_read = switch_core_strdup(globals.pool, val);
+			} else if (!strcasecmp(var, "odbc_read_lag_query") && !zstr(val)) {
+				globals.odbc_read_lag_query = switch_core_strdup(globals.pool, val);
+			} else if (!strcasecmp(var, "odbc_read_max_lag") && !zstr(val)) {
+				int tmp = (int)strtol(val, NULL, 10);
+				if (tmp >= 0) {
+					globals.odbc_read_max_lag = (uint32_t) tmp;
+				}
+			} else if (!strcasecmp(var, "odbc_read_check_interval") && !zstr(val)) {
+				int tmp = (int)strtol(val, NULL, 10);
+				if (tmp > 0) {
+					globals.odbc_read_check_interval = (uint32_t) tmp;
+				}
+			} else if (!strcasecmp(var, "odbc_read_retry") && !zstr(val)) {
+				int tmp = (int)strtol(val, NULL, 10);
+				if (tmp > 0) {
+					globals.odbc_read_retry = (uint32_t) tmp;
+				}
+			} else if (!strcasecmp(var, "contact_voip_token_param") && !zstr(val)) {
+				globals.contact_voip_token_param = switch_core_strdup(globals.pool, val);
+			} else if (!strcasecmp(var, "contact_platform_param") && !zstr(val)) {
+				globals.contact_platform_param = switch_core_strdup(globals.pool, val);
+			} else if (!strcasecmp(var, "contact_im_token_param") && !zstr(val)) {
+				globals.contact_im_token_param = switch_core_strdup(globals.pool, val);
+			} else if (!strcasecmp(var, "contact_app_id_param") && !zstr(val)) {
+				globals.contact_app_id_param = switch_core_strdup(globals.pool, val);
+			} else if (!strcasecmp(var, "evict_batch_size") && !zstr(val)) {
+				int tmp = (int)strtol(val, NULL, 10);
+				if (tmp > 0) {
+					globals.evict_batch_size = (uint32_t) tmp;
+				}
+			} else if (!strcasecmp(var, "evict_flush_interval") && !zstr(val)) {
+				int tmp = (int)strtol(val, NULL, 10);
+				if (tmp > 0) {
+					globals.evict_flush_interval = (uint32_t) tmp;
+				}
+			} else if (!strcasecmp(var, "register_batch_size") && !zstr(val)) {
+				int tmp = (int)strtol(val, NULL, 10);
+				if (tmp > 0) {
+					globals.register_batch_size = (uint32_t) tmp;
+				}
+			} else if (!strcasecmp(var, "register_flush_interval") && !zstr(val)) {
+				int tmp = (int)strtol(val, NULL, 10);
+				if (tmp > 0) {
+					globals.register_flush_interval = (uint32_t) tmp;
+				}
+			} else if (!strcasecmp(var, "register_fingerprints") && !zstr(val)) {
+				globals.fingerprints_size = (uint32_t) strtoul(val, NULL, 10);
+			} else if (!strcasecmp(var, "register_touch_interval") && !zstr(val)) {
+				globals.register_touch_interval = (uint32_t) strtoul(val, NULL, 10);
+			} else if (!strcasecmp(var, "wake_stats") && !zstr(val)) {
+				globals.wake_stats = switch_true(val) ? SWITCH_TRUE : SWITCH_FALSE;
+			} else if (!strcasecmp(var, "adaptive_wake_timeout") && !zstr(val)) {
+				globals.adaptive_wake_timeout = switch_true(val) ? SWITCH_TRUE : SWITCH_FALSE;
+			} else if (!strcasecmp(var, "wake_min_samples") && !zstr(val)) {
+				int tmp = (int)strtol(val, NULL, 10);
+				if (tmp > 0 && tmp <= APN_WAKE_RING) {
+					globals.wake_min_samples = (uint32_t) tmp;
+				}
+			} else if (!strcasecmp(var, "wake_timeout_factor") && !zstr(val)) {
+				double tmp = strtod(val, NULL);
+				if (tmp >= 1) {
+					globals.wake_timeout_factor = (uint32_t)(tmp * 100);
+				}
+			} else if (!strcasecmp(var, "wake_timeout_margin") && !zstr(val)) {
+				globals.wake_timeout_margin = (uint32_t) strtoul(val, NULL, 10);
+			} else if (!strcasecmp(var, "wake_dead_misses") && !zstr(val)) {
+				globals.wake_dead_misses = (uint32_t) strtoul(val, NULL, 10);
+			} else if (!strcasecmp(var, "wake_dead_timeout") && !zstr(val)) {
+				int tmp = (int)strtol(val, NULL, 10);
+				if (tmp > 0) {
+					globals.wake_dead_timeout = (uint32_t) tmp;
+				}
+			} else if (!strcasecmp(var, "wake_sample_window") && !zstr(val)) {
+				int tmp = (int)strtol(val, NULL, 10);
+				if (tmp > 0) {
+					globals.wake_sample_window = (uint32_t) tmp;
+				}
+			} else if (!strcasecmp(var, "wake_cache_size") && !zstr(val)) {
+				int tmp = (int)strtol(val, NULL, 10);
+				if (tmp > 0) {
+					globals.wake_cache_size = (uint32_t) tmp;
+				}
+			} else if (!strcasecmp(var, "wake_cache_ttl") && !zstr(val)) {
+				int tmp = (int)strtol(val, NULL, 10);
+				if (tmp > 0) {
+					globals.wake_cache_ttl = (uint32_t) tmp;
+				}
+			} else if (!strcasecmp(var, "hedge_threads") && !zstr(val)) {
+				int tmp = (int)strtol(val, NULL, 10);
+				if (tmp > 0) {
+					globals.attempt_threads_count = (uint32_t) tmp;
+				}
+			} else if (!strcasecmp(var, "fork_grace") && !zstr(val)) {
+				globals.fork_grace = (uint32_t) strtoul(val, NULL, 10);
+			} else if (!strcasecmp(var, "push_trace") && !zstr(val)) {
+				globals.push_trace = switch_true(val) ? SWITCH_TRUE : SWITCH_FALSE;
+			} else if (!strcasecmp(var, "token_store") && !zstr(val)) {
+				globals.token_store = switch_true(val) ? SWITCH_TRUE : SWITCH_FALSE;
+			} else if (!strcasecmp(var, "token_snapshot_path") && !zstr(val)) {
+				globals.token_snapshot_path = strcasecmp(val, "none") ? switch_core_strdup(globals.pool, val) : NULL;
+				snapshot_path_set = SWITCH_TRUE;
+			} else if (!strcasecmp(var, "token_snapshot_interval") && !zstr(val)) {
+				int tmp = (int)strtol(val, NULL, 10);
+				if (tmp > 0) {
+					globals.token_snapshot_interval = (uint32_t) tmp;
+				}
+			} else if (!strcasecmp(var, "outbox") && !zstr(val)) {
+				globals.outbox = switch_true(val) ? SWITCH_TRUE : SWITCH_FALSE;
+			} else if (!strcasecmp(var, "outbox_dir") && !zstr(val)) {
+				globals.outbox_dir = switch_core_strdup(globals.pool, val);
+			} else if (!strcasecmp(var, "outbox_segment_size") && !zstr(val)) {
+				globals.outbox_segment_size = (uint32_t) strtoul(val, NULL, 10);
+			} else if (!strcasecmp(var, "outbox_commit_interval") && !zstr(val)) {
+				globals.outbox_commit_interval = (uint32_t) strtoul(val, NULL, 10);
+			} else if (!strcasecmp(var, "outbox_drain_timeout") && !zstr(val)) {
+				globals.outbox_drain_timeout = (uint32_t) strtoul(val, NULL, 10);
+			} else if (!strcasecmp(var, "outbox_retry_interval") && !zstr(val)) {
+				globals.outbox_retry_interval = (uint32_t) strtoul(val, NULL, 10);
+			} else if (!strcasecmp(var, "outbox_max_attempts") && !zstr(val)) {
+				globals.outbox_max_attempts = (uint32_t) strtoul(val, NULL, 10);
+			} else if (!strcasecmp(var, "token_reconcile_interval") && !zstr(val)) {
+				globals.token_reconcile_interval = (uint32_t) strtoul(val, NULL, 10);
+			} else if (!strcasecmp(var, "wakeup_bus") && !zstr(val)) {
+				if (strcasecmp(val, "none") && !(globals.wakeup_bus = wakeup_bus_find(val))) {
+					switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Unknown wake up bus: %s\n", val);
+				}
+			} else if (!strcasecmp(var, "wakeup_bus_node") && !zstr(val)) {
+				globals.wakeup_bus_node = switch_core_strdup(globals.pool, val);
+			} else if (!strcasecmp(var, "wakeup_bus_route") && !zstr(val)) {
+				globals.wakeup_bus_route = switch_core_strdup(globals.pool, val);
+			} else if (!strcasecmp(var, "wakeup_bus_poll_interval") && !zstr(val)) {
+				int tmp = (int)strtol(val, NULL, 10);
+				if (tmp > 0) {
+					globals.wakeup_bus_poll_interval = (uint32_t) tmp;
+				}
+			}
+		}
+	}
+
+	if (globals.fingerprints_size) {
+		uint32_t size = 1024;
+
+		/*Power of two for mask instead of modulo*/
+		while (size < globals.fingerprints_size && size < (1U << 30)) {
+			size <<= 1;
+		}
+		globals.fingerprints_size = size;
+		globals.fingerprints = switch_core_alloc(globals.pool, sizeof(register_fingerprint_t) * size);
+		memset(globals.fingerprints, 0, sizeof(register_fingerprint_t) * size);
+	}
+
+	if (!snapshot_path_set) {
+		globals.token_snapshot_path = switch_core_sprintf(globals.pool, "%s%smod_apn_tokens.snap", SWITCH_GLOBAL_dirs.db_dir, SWITCH_PATH_SEPARATOR);
+	}
+
+	if (zstr(globals.outbox_dir)) {
+		globals.outbox_dir = switch_core_sprintf(globals.pool, "%s%smod_apn_outbox", SWITCH_GLOBAL_dirs.db_dir, SWITCH_PATH_SEPARATOR);
+	}
+	if (!globals.outbox_commit_interval) {
+		globals.outbox_commit_interval = 1;
+	}
+
+	if (zstr(globals.wakeup_bus_node)) {
+		globals.wakeup_bus_node = switch_core_strdup(globals.pool, switch_core_get_switchname());
+	}
+
+	if (zstr(globals.contact_voip_token_param)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "contact_voip_token_param not set\n");
+		switch_goto_status(SWITCH_STATUS_FALSE, done);
+	}
+
+	if (zstr(globals.contact_platform_param)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "contact_platform_param not set\n");
+		switch_goto_status(SWITCH_STATUS_FALSE, done);
+	}
+
+	if (zstr(globals.contact_app_id_param)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "contact_app_id_param not set\n");
+		switch_goto_status(SWITCH_STATUS_FALSE, done);
+	}
+
+	if (globals.odbc_dsn) {
+		if (!(dbh = mod_apn_get_db_handle())) {
+			globals.odbc_dsn = NULL;
+		}
+	}
+
+	if (zstr(globals.odbc_dsn)) {
+		globals.dbname = "carusto";
+		dbh = mod_apn_get_db_handle();
+	}
+
+	if (!dbh) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "dbh is NULL\n");
+		switch_goto_status(SWITCH_STATUS_FALSE, done);
+	}
+
+	globals.db_kind = apn_db_kind_of(globals.odbc_dsn);
+	globals.db_primary.dsn = zstr(globals.odbc_dsn) ? globals.dbname : globals.odbc_dsn;
+	globals.db_primary.kind = globals.db_kind;
+
+	if (!zstr(globals.odbc_dsn_read) && globals.db_kind == APN_DB_CORE) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "CARUSTO. odbc_dsn_read needs odbc_dsn, read replica disabled\n");
+	} else if (!zstr(globals.odbc_dsn_read)) {
+		globals.db_replica.dsn = globals.odbc_dsn_read;
+		globals.db_replica.kind = apn_db_kind_of(globals.odbc_dsn_read);
+		if (zstr(globals.odbc_read_lag_query) && globals.db_replica.kind == APN_DB_PGSQL) {
+			/*Idle primary leaves replay timestamp behind, so lag is zero once everything received is replayed*/
+			globals.odbc_read_lag_query = "SELECT CASE WHEN pg_last_wal_receive_lsn() = pg_last_wal_replay_lsn() THEN 0 "
+										  "ELSE COALESCE(EXTRACT(EPOCH FROM now() - pg_last_xact_replay_timestamp()), 0) END";
+		}
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "CARUSTO. Token lookups go to read replica, max lag %u sec\n", globals.odbc_read_max_lag);
+	}
+
+	switch_core_hash_init(&globals.profile_hash);
+	if ((x_profiles = switch_xml_child(cfg, "profiles"))) {
+		for (x_profile = switch_xml_child(x_profiles, "profile"); x_profile; x_profile = x_profile->next) {
+			char *name = (char *) switch_xml_attr_soft(x_profile, "name");
+			char *id_s = NULL, *url = NULL, *method = NULL, *auth_type = NULL, *auth_data = NULL, *content_type = NULL,
+					*connect_timeout = NULL, *timeout = NULL, *post_data_template = NULL, *evict_on = NULL, *cancel_template = NULL,
+					*resolve_host = NULL, *dns_refresh = NULL, *warm_connections = NULL, *keepalive_interval = NULL, *warm_url = NULL,
+					*hedge_delay = NULL, *unhealthy_error_rate = NULL, *unhealthy_latency = NULL, *unhealthy_retry = NULL,
+					*batch_template = NULL, *batch_max = NULL, *batch_linger = NULL, *type = NULL, *match_app_id = NULL,
+					*match_platform = NULL, *match_realm = NULL, *workers = NULL;
+
+			for (param = switch_xml_child(x_profile, "param"); param; param = param->next) {
+				char *var, *val;
+				var = (char *) switch_xml_attr_soft(param, "name");
+				val = (char *) switch_xml_attr_soft(param, "value");
+
+				if (!strcasecmp(var, "id") && !zstr(val)) {
+					id_s = val;
+				} else if (!strcasecmp(var, "url") && !zstr(val)) {
+					/*Repeated url adds failover endpoint, first one is main*/
+					if (!url) {
+						url = val;
+					}
+				} else if (!strcasecmp(var, "method") && !zstr(val)) {
+					method = val;
+				} else if (!strcasecmp(var, "auth_type") && !zstr(val)) {
+					auth_type = val;
+				} else if (!strcasecmp(var, "auth_data") && !zstr(val)) {
+					auth_data = val;
+				} else if (!strcasecmp(var, "content_type") && !zstr(val)) {
+					content_type = val;
+				} else if (!strcasecmp(var, "connect_timeout") && !zstr(val)) {
+					connect_timeout = val;
+				} else if (!strcasecmp(var, "timeout") && !zstr(val)) {
+					timeout = val;
+				} else if (!strcasecmp(var, "post_data_template") && !zstr(val)) {
+					post_data_template = val;
+				} else if (!strcasecmp(var, "evict_on") && !zstr(val)) {
+					evict_on = val;
+				} else if (!strcasecmp(var, "cancel_template") && !zstr(val)) {
+					cancel_template = val;
+				} else if (!strcasecmp(var, "resolve_host") && !zstr(val)) {
+					resolve_host = val;
+				} else if (!strcasecmp(var, "dns_refresh") && !zstr(val)) {
+					dns_refresh = val;
+				} else if (!strcasecmp(var, "warm_connections") && !zstr(val)) {
+					warm_connections = val;
+				} else if (!strcasecmp(var, "keepalive_interval") && !zstr(val)) {
+					keepalive_interval = val;
+				} else if (!strcasecmp(var, "warm_url") && !zstr(val)) {
+					warm_url = val;
+				} else if (!strcasecmp(var, "hedge_delay") && !zstr(val)) {
+					hedge_delay = val;
+				} else if (!strcasecmp(var, "unhealthy_error_rate") && !zstr(val)) {
+					unhealthy_error_rate = val;
+				} else if (!strcasecmp(var, "unhealthy_latency") && !zstr(val)) {
+					unhealthy_latency = val;
+				} else if (!strcasecmp(var, "unhealthy_retry") && !zstr(val)) {
+					unhealthy_retry = val;
+				} else if (!strcasecmp(var, "batch_template") && !zstr(val)) {
+					batch_template = val;
+				} else if (!strcasecmp(var, "batch_max") && !zstr(val)) {
+					batch_max = val;
+				} else if (!strcasecmp(var, "batch_linger") && !zstr(val)) {
+					batch_linger = val;
+				} else if (!strcasecmp(var, "type") && !zstr(val)) {
+					type = val;
+				} else if (!strcasecmp(var, "match_app_id") && !zstr(val)) {
+					match_app_id = val;
+				} else if (!strcasecmp(var, "match_platform") && !zstr(val)) {
+					match_platform = val;
+				} else if (!strcasecmp(var, "match_realm") && !zstr(val)) {
+					match_realm = val;
+				} else if (!strcasecmp(var, "workers") && !zstr(val)) {
+					workers = val;
+				}
+			}
+
+			if (zstr(url) || zstr(method)) {
+				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "No url (%s) or method (%s) specified.\n", url, method);
+				goto done;
+			}
+
+			if (strcasecmp(method, "get") && strcasecmp(method, "post")) {
+				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Method %s doesn't support\n", method);
+				goto done;
+			}
+
+			if (zstr(name)) {
+				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "No name specified.\n");
+			} else {
+				profile = switch_core_alloc(globals.pool, sizeof(*profile));
+				memset(profile, 0, sizeof(profile_t));
+				profile->name = switch_core_strdup(globals.pool, name);
+				profile->type = switch_core_strdup(globals.pool, zstr(type) ? name : type);
+
+				if (!zstr(id_s)) {
+					profile->id = (uint16_t)strtol(id_s, NULL, 10);
+				}
+
+				profile->url = switch_core_strdup(globals.pool, url);
+				profile->method = switch_core_strdup(globals.pool, method);
+				{
+					endpoint_t **tail = &profile->endpoints;
+
+					for (param = switch_xml_child(x_profile, "param"); param; param = param->next) {
+						const char *val = switch_xml_attr_soft(param, "value");
+
+						if (strcasecmp(switch_xml_attr_soft(param, "name"), "url") || zstr(val)) {
+							continue;
+						}
+						*tail = switch_core_alloc(globals.pool, sizeof(endpoint_t));
+						memset(*tail, 0, sizeof(endpoint_t));
+						(*tail)->url = switch_core_strdup(globals.pool, val);
+						(*tail)->index = profile->endpoints_count++;
+						(*tail)->healthy = SWITCH_TRUE;
+						switch_mutex_init(&(*tail)->mutex, SWITCH_MUTEX_NESTED, globals.pool);
+						tail = &(*tail)->next;
+					}
+				}
+				profile->hedge_delay = zstr(hedge_delay) ? 0 : (uint32_t) strtoul(hedge_delay, NULL, 10);
+				profile->unhealthy_error_rate = zstr(unhealthy_error_rate) ? 50 : (uint32_t) strtoul(unhealthy_error_rate, NULL, 10);
+				profile->unhealthy_latency = zstr(unhealthy_latency) ? 0 : (uint32_t) strtoul(unhealthy_latency, NULL, 10);
+				profile->unhealthy_retry = zstr(unhealthy_retry) ? 10 : (uint32_t) strtoul(unhealthy_retry, NULL, 10);
+				if (!zstr(batch_template)) {
+					profile->batch_template = switch_core_strdup(globals.pool, batch_template);
+					profile->batch_data = template_compile(batch_template, globals.pool);
+					profile->batch_max = zstr(batch_max) ? 100 : (uint32_t) strtoul(batch_max, NULL, 10);
+					profile->batch_linger = zstr(batch_linger) ? 50 : (uint32_t) strtoul(batch_linger, NULL, 10);
+					if (!profile->batch_max) {
+						profile->batch_max = 1;
+					}
+					switch_mutex_init(&profile->batch_mutex, SWITCH_MUTEX_NESTED, globals.pool);
+					switch_core_hash_init(&profile->batches);
+				}
+				if (!zstr(content_type)) {
+					profile->content_type = switch_core_strdup(globals.pool, content_type);
+				}
+				if (!zstr(connect_timeout)) {
+					profile->connect_timeout = (int)strtol(connect_timeout, NULL, 10);
+				}
+				if (!zstr(timeout)) {
+					profile->timeout = (int)strtol(timeout, NULL, 10);
+				}
+				if (!zstr(post_data_template)) {
+					profile->post_data_template = switch_core_strdup(globals.pool, post_data_template);
+				} else {
+					profile->post_data_template = switch_core_strdup(globals.pool, "{\"type\": \"${type}\",\"app\":\"${app_id}\","
+																				   "\"token\":\"${token}\",\"user\":\"${user}\","
+																				   "\"realm\":\"${realm}\",\"payload\":${payload}"
+																				   "\"platform\":\"${platform}\"}");
+				}
+				profile->post_data = template_compile(profile->post_data_template, globals.pool);
+				for (param = switch_xml_child(x_profile, "param"); param; param = param->next) {
+					const char *var = switch_xml_attr_soft(param, "name"), *val = switch_xml_attr_soft(param, "value");
+					char *platform, *k;
+
+					if (strncasecmp(var, "post_data_template.", 19) || zstr(var + 19) || zstr(val)) {
+						continue;
+					}
+					if (!profile->platform_templates) {
+						switch_core_hash_init(&profile->platform_templates);
+					}
+					platform = switch_core_strdup(globals.pool, var + 19);
+					for (k = platform; *k; k++) {
+						*k = (char) switch_tolower(*k);
+					}
+					switch_core_hash_insert(profile->platform_templates, platform, template_compile(val, globals.pool));
+				}
+				profile->auth = parse_auth_param(auth_type, auth_data, globals.pool);
+				profile->evict_rules = parse_evict_rules(evict_on, globals.pool);
+				if (!zstr(cancel_template)) {
+					profile->cancel_template = switch_core_strdup(globals.pool, cancel_template);
+					profile->cancel_data = template_compile(cancel_template, globals.pool);
+				}
+				if (!zstr(content_type)) {
+					profile->content_type = switch_core_strdup(globals.pool, content_type);
+				}
+				profile->headers = build_profile_headers(profile);
+
+				/*Base profile is found by name (type), routed one by its match rules*/
+				if (!zstr(type) || !zstr(match_app_id) || !zstr(match_platform) || !zstr(match_realm)) {
+					route_compile(profile, match_app_id, match_platform, match_realm);
+				}
+				/*Event thread never waits for http*/
+				profile->workers = 2;
+				if (!zstr(workers) && strtoul(workers, NULL, 10) > 0) {
+					profile->workers = (uint32_t) strtoul(workers, NULL, 10);
+				}
+
+				if (switch_true(resolve_host) || (!zstr(warm_connections) && strtol(warm_connections, NULL, 10) > 0)) {
+					conn_pool_t *conns = switch_core_alloc(globals.pool, sizeof(*conns));
+
+					memset(conns, 0, sizeof(*conns));
+					switch_mutex_init(&conns->mutex, SWITCH_MUTEX_NESTED, globals.pool);
+					conns->resolve_host = switch_true(resolve_host);
+					conns->dns_refresh = zstr(dns_refresh) ? 60 : (uint32_t) strtoul(dns_refresh, NULL, 10);
+					conns->warm_connections = zstr(warm_connections) ? 0 : (uint32_t) strtoul(warm_connections, NULL, 10);
+					conns->keepalive_interval = zstr(keepalive_interval) ? 30 : (uint32_t) strtoul(keepalive_interval, NULL, 10);
+					if (!zstr(warm_url)) {
+						conns->warm_url = switch_core_strdup(globals.pool, warm_url);
+					}
+
+					if (conn_pool_parse_url(conns, profile->url, globals.pool)) {
+						profile->conns = conns;
+						if (conns->resolve_host) {
+							conn_pool_resolve(profile);
+						}
+						/*Open warm connections right away, first push shouldn't pay for handshake*/
+						conn_pool_maintain(profile);
+					} else {
+						switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Can't pin host of url '%s' (profile '%s'), warm connections are disabled\n",
+										  profile->url, profile->name);
+					}
+				}
+
+				switch_core_hash_insert(globals.profile_hash, profile->name, profile);
+				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Loaded APN profile '%s'\n", profile->name);
+			}
+		}
+	} else {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "No APN profiles defined.\n");
+	}
+
+	switch_sql_queue_manager_init_name("mod_apn", &globals.qm, 2, globals.odbc_dsn ? globals.odbc_dsn : globals.dbname, SWITCH_MAX_TRANS, NULL, NULL, NULL, NULL);
+	switch_sql_queue_manager_start(globals.qm);
+
+done:
+	if (dbh) {
+		switch_cache_db_release_db_handle(&dbh);
+	}
+	switch_xml_free(xml);
+	return status;
+}
+
+/* Wake up latency of device: time from sent push to REGISTER with the same token */
+struct wake_stats_obj {
+	uint32_t ring[APN_WAKE_RING];
+	uint32_t count;
+	uint32_t pos;
+	uint32_t misses;
+	switch_time_t used_ms;
+};
+typedef struct wake_stats_obj wake_stats_t;
+
+struct wake_pending_obj {
+	switch_time_t push_ms;
+	char *type;
+	char *platform;
+};
+typedef struct wake_pending_obj wake_pending_t;
+
+/* Histogram per platform, bucket N holds latencies < 250ms * 2^N */
+struct wake_platform_obj {
+	uint32_t buckets[APN_WAKE_BUCKETS + 1];
+	uint32_t misses;
+};
+typedef struct wake_platform_obj wake_platform_t;
+
+static uint32_t wake_percentile(const uint32_t *values, uint32_t count, uint32_t percent)
+{
+	uint32_t sorted[APN_WAKE_RING], i, j, tmp, idx;
+
+	if (!count) {
+		return 0;
+	}
+
+	memcpy(sorted, values, sizeof(uint32_t) * count);
+	for (i = 1; i < count; i++) {
+		for (j = i; j > 0 && sorted[j - 1] > sorted[j]; j--) {
+			tmp = sorted[j];
+			sorted[j] = sorted[j - 1];
+			sorted[j - 1] = tmp;
+		}
+	}
+
+	idx = (count * percent + 99) / 100;
+	return sorted[idx ? idx - 1 : 0];
+}
+
+/* Caller holds globals.wake_mutex. Drops entries unused for wake_cache_ttl sec, or the least recently used one when cache is full */
+static void wake_stats_evict(switch_time_t now_ms, switch_bool_t full)
+{
+	switch_hash_index_t *hi;
+	const void *key;
+	void *val;
+	char *oldest_key = NULL;
+	switch_time_t oldest_ms = 0;
+
+	for (hi = switch_core_hash_first(globals.wake_hash); hi;) {
+		wake_stats_t *stats;
+
+		switch_core_hash_this(hi, &key, NULL, &val);
+		hi = switch_core_hash_next(&hi);
+		stats = (wake_stats_t *) val;
+
+		if (now_ms - stats->used_ms > (switch_time_t) globals.wake_cache_ttl * 1000) {
+			switch_core_hash_delete(globals.wake_hash, (const char *) key);
+			free(stats);
+			globals.wake_cache_count--;
+			full = SWITCH_FALSE;
+		} else if (full && (!oldest_key || stats->used_ms < oldest_ms)) {
+			switch_safe_free(oldest_key);
+			oldest_key = strdup((const char *) key);
+			oldest_ms = stats->used_ms;
+		}
+	}
+
+	if (full && oldest_key && (val = switch_core_hash_find(globals.wake_hash, oldest_key))) {
+		switch_core_hash_delete(globals.wake_hash, oldest_key);
+		free(val);
+		globals.wake_cache_count--;
+	}
+	switch_safe_free(oldest_key);
+}
+
+/* Caller holds globals.wake_mutex */
+static wake_stats_t *wake_stats_get(const char *token, const char *latencies, uint32_t misses)
+{
+	wake_stats_t *stats;
+	switch_time_t now_ms = switch_micro_time_now() / 1000;
+
+	if ((stats = switch_core_hash_find(globals.wake_hash, token))) {
+		stats->used_ms = now_ms;
+		return stats;
+	}
+
+	if (globals.wake_cache_count >= globals.wake_cache_size) {
+		wake_stats_evict(now_ms, SWITCH_TRUE);
+	}
+
+	switch_zmalloc(stats, sizeof(*stats));
+	stats->used_ms = now_ms;
+	stats->misses = misses;
+
+	if (!zstr(latencies)) {
+		char *dup = strdup(latencies), *items[APN_WAKE_RING] = { 0 };
+		int argc = switch_split(dup, ',', items), i;
+
+		for (i = 0; i < argc; i++) {
+			stats->ring[stats->pos] = (uint32_t) strtoul(items[i], NULL, 10);
+			stats->pos = (stats->pos + 1) % APN_WAKE_RING;
+			stats->count++;
+		}
+		switch_safe_free(dup);
+	}
+
+	switch_core_hash_insert(globals.wake_hash, token, stats);
+	globals.wake_cache_count++;
+
+	return stats;
+}
+
+/* Caller holds globals.wake_mutex */
+static wake_platform_t *wake_platform_get(const char *platform)
+{
+	wake_platform_t *stats;
+
+	if (!(stats = switch_core_hash_find(globals.wake_platform_hash, platform))) {
+		stats = switch_core_alloc(globals.pool, sizeof(*stats));
+		memset(stats, 0, sizeof(*stats));
+		switch_core_hash_insert(globals.wake_platform_hash, platform, stats);
+	}
+
+	return stats;
+}
+
+/* Caller holds globals.wake_mutex. Row is replaced by DELETE + INSERT, queued as one string to wait in wake_write_queue for wake_stats_flush */
+static void wake_stats_persist(const char *token, const char *type, const char *platform, wake_stats_t *stats)
+{
+	char latencies[APN_WAKE_RING * 11] = "", *sql;
+	switch_size_t len = 0;
+	uint32_t i;
+
+	for (i = 0; i < stats->count; i++) {
+		len += switch_snprintf(latencies + len, sizeof(latencies) - len, "%s%u", i ? "," : "", stats->ring[i]);
+	}
+
+	/*Both or neither: lone INSERT hits the key, lone DELETE loses the history*/
+	sql = switch_mprintf("DELETE FROM push_token_wake WHERE token = '%q' AND type = '%q';\n"
+						 "INSERT INTO push_token_wake (token, type, platform, latencies, misses) VALUES ('%q', '%q', '%q', '%q', %u)",
+						 token, type, token, type, platform, latencies, stats->misses);
+
+	if (switch_queue_trypush(globals.wake_write_queue, sql) != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "CARUSTO. Wake up stats queue is full, token %s isn't saved\n", token);
+		switch_safe_free(sql);
+	}
+}
+
+/* Hand queued wake up stats to sql queue manager, called without globals.wake_mutex */
+static void wake_stats_flush(void)
+{
+	void *pop = NULL;
+
+	if (!globals.wake_write_queue) {
+		return;
+	}
+
+	while (switch_queue_trypop(globals.wake_write_queue, &pop) == SWITCH_STATUS_SUCCESS && pop) {
+		if (globals.qm) {
+			switch_sql_queue_manager_push(globals.qm, (char *) pop, 0, SWITCH_FALSE);
+		} else {
+			free(pop);
+		}
+		pop = NULL;
+	}
+}
+
+/* Caller holds globals.wake_mutex */
+static void wake_record_miss(const char *token, wake_pending_t *pending)
+{
+	wake_stats_t *stats = wake_stats_get(token, NULL, 0);
+
+	stats->misses++;
+	wake_platform_get(pending->platform)->misses++;
+	wake_stats_persist(token, pending->type, pending->platform, stats);
+}
+
+static void wake_pending_free(wake_pending_t *pending)
+{
+	switch_safe_free(pending->type);
+	switch_safe_free(pending->platform);
+	switch_safe_free(pending);
+}
+
+/* Caller holds globals.wake_mutex */
+static void wake_pending_sweep(switch_time_t now_ms)
+{
+	switch_hash_index_t *hi;
+
+	if (now_ms - globals.wake_sweep_ms < 1000) {
+		return;
+	}
+	globals.wake_sweep_ms = now_ms;
+
+	if (now_ms - globals.wake_cache_sweep_ms >= 60000) {
+		globals.wake_cache_sweep_ms = now_ms;
+		wake_stats_evict(now_ms, SWITCH_FALSE);
+	}
+
+	for (hi = switch_core_hash_first(globals.wake_pending_hash); hi;) {
+		const void *key;
+		void *val;
+		wake_pending_t *pending;
+
+		switch_core_hash_this(hi, &key, NULL, &val);
+		hi = switch_core_hash_next(&hi);
+		pending = (wake_pending_t *) val;
+
+		if (now_ms - pending->push_ms > (switch_time_t) globals.wake_sample_window * 1000) {
+			wake_record_miss((const char *) key, pending);
+			switch_core_hash_delete(globals.wake_pending_hash, (const char *) key);
+			wake_pending_free(pending);
+		}
+	}
+}
+
+/* Push to token is sent, wait REGISTER with it */
+static void wake_track_push(const char *token, const char *type, const char *platform)
+{
+	wake_pending_t *pending;
+	switch_time_t now_ms = switch_micro_time_now() / 1000;
+
+	if (!globals.wake_stats || zstr(token) || zstr(type) || zstr(platform)) {
+		return;
+	}
+
+	switch_mutex_lock(globals.wake_mutex);
+	wake_pending_sweep(now_ms);
+	if (!(pending = switch_core_hash_find(globals.wake_pending_hash, token))) {
+		switch_zmalloc(pending, sizeof(*pending));
+		pending->type = strdup(type);
+		pending->platform = strdup(platform);
+		switch_core_hash_insert(globals.wake_pending_hash, token, pending);
+	}
+	pending->push_ms = now_ms;
+	switch_mutex_unlock(globals.wake_mutex);
+
+	wake_stats_flush();
+}
+
+/* REGISTER with token received */
+static void wake_track_register(const char *token)
+{
+	wake_pending_t *pending;
+	wake_stats_t *stats;
+	wake_platform_t *platform_stats;
+	switch_time_t now_ms = switch_micro_time_now() / 1000;
+	uint32_t latency, bucket;
+
+	if (!globals.wake_stats || zstr(token)) {
+		return;
+	}
+
+	switch_mutex_lock(globals.wake_mutex);
+	wake_pending_sweep(now_ms);
+
+	if ((pending = switch_core_hash_find(globals.wake_pending_hash, token))) {
+		switch_core_hash_delete(globals.wake_pending_hash, token);
+
+		latency = (uint32_t)(now_ms - pending->push_ms);
+		stats = wake_stats_get(token, NULL, 0);
+		stats->ring[stats->pos] = latency;
+		stats->pos = (stats->pos + 1) % APN_WAKE_RING;
+		if (stats->count < APN_WAKE_RING) {
+			stats->count++;
+		}
+		stats->misses = 0;
+
+		platform_stats = wake_platform_get(pending->platform);
+		for (bucket = 0; bucket < APN_WAKE_BUCKETS && latency >= (250U << bucket); bucket++);
+		platform_stats->buckets[bucket]++;
+
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. Device with token '%s' woke up in %u ms\n", token, latency);
+		wake_stats_persist(token, pending->type, pending->platform, stats);
+		wake_pending_free(pending);
+	}
+
+	switch_mutex_unlock(globals.wake_mutex);
+
+	wake_stats_flush();
+}
+
+/* How long (ms) wait REGISTER of device after push, 0 - unknown */
+static uint32_t wake_token_timeout(const char *token, const char *latencies, uint32_t misses)
+{
+	wake_stats_t *stats;
+	uint32_t timeout = 0;
+
+	switch_mutex_lock(globals.wake_mutex);
+	/*Token without samples and misses has nothing to cache*/
+	if ((stats = switch_core_hash_find(globals.wake_hash, token)) || !zstr(latencies) || misses) {
+		stats = wake_stats_get(token, latencies, misses);
+		if (stats->count >= globals.wake_min_samples) {
+			timeout = wake_percentile(stats->ring, stats->count, 99) * globals.wake_timeout_factor / 100 + globals.wake_timeout_margin;
+		} else if (globals.wake_dead_misses && stats->misses >= globals.wake_dead_misses) {
+			timeout = globals.wake_dead_timeout;
+		}
+	}
+	switch_mutex_unlock(globals.wake_mutex);
+
+	return timeout;
+}
+
+static int wake_item_compare(const void *a, const void *b)
+{
+	uint32_t ta = (uint32_t) cJSON_GetObjectItem(*(cJSON **) a, "wake_timeout")->valueint;
+	uint32_t tb = (uint32_t) cJSON_GetObjectItem(*(cJSON **) b, "wake_timeout")->valueint;
+
+	/*Unknown latency goes last*/
+	if (ta == tb) return 0;
+	if (!ta) return 1;
+	if (!tb) return -1;
+	return ta < tb ? -1 : 1;
+}
+
+/* Order tokens by wake up latency, returns wake deadline of all devices (ms) or 0 if some is unknown */
+static uint32_t wake_order_tokens(callback_t *cbt)
+{
+	cJSON **items = NULL, *item;
+	uint32_t deadline = 0;
+	int size = cJSON_GetArraySize(cbt->array), i;
+
+	if (!globals.wake_stats || size <= 0) {
+		return 0;
+	}
+
+	switch_zmalloc(items, sizeof(*items) * size);
+
+	for (i = 0; i < size; i++) {
+		cJSON *latencies, *misses;
+		uint32_t timeout;
+
+		item = cJSON_GetArrayItem(cbt->array, i);
+		latencies = cJSON_GetObjectItem(item, "latencies");
+		misses = cJSON_GetObjectItem(item, "misses");
+		timeout = wake_token_timeout(cJSON_GetObjectCstr(item, "token"),
+									 latencies ? latencies->valuestring : NULL,
+									 misses ? (uint32_t) misses->valueint : 0);
+		cJSON_AddItemToObject(item, "wake_timeout", cJSON_CreateNumber(timeout));
+		items[i] = item;
+
+		if (i == 0 || (deadline && timeout && timeout > deadline)) {
+			deadline = timeout;
+		} else if (!timeout) {
+			deadline = 0;
+		}
+	}
+
+	qsort(items, size, sizeof(*items), wake_item_compare);
+
+	/*Rebuild array in new order*/
+	while (cbt->array->child) {
+		item = cbt->array->child;
+		cbt->array->child = item->next;
+		item->next = item->prev = NULL;
+	}
+	for (i = 0; i < size; i++) {
+		cJSON_AddItemToArray(cbt->array, items[i]);
+	}
+
+	switch_safe_free(items);
+
+	return deadline;
+}
+
+static void wake_stats_destroy(void)
+{
+	switch_hash_index_t *hi;
+	const void *key;
+	void *val;
+
+	if (globals.wake_hash) {
+		while ((hi = switch_core_hash_first(globals.wake_hash))) {
+			switch_core_hash_this(hi, &key, NULL, &val);
+			switch_core_hash_delete(globals.wake_hash, (const char *) key);
+			free(val);
+		}
+		switch_core_hash_destroy(&globals.wake_hash);
+	}
+	globals.wake_cache_count = 0;
+	wake_stats_flush();
+
+	if (globals.wake_pending_hash) {
+		while ((hi = switch_core_hash_first(globals.wake_pending_hash))) {
+			switch_core_hash_this(hi, &key, NULL, &val);
+			switch_core_hash_delete(globals.wake_pending_hash, (const char *) key);
+			wake_pending_free((wake_pending_t *) val);
+		}
+		switch_core_hash_destroy(&globals.wake_pending_hash);
+	}
+
+	if (globals.wake_platform_hash) {
+		switch_core_hash_destroy(&globals.wake_platform_hash);
+	}
+}
+
+static void wake_stats_dump(switch_stream_handle_t *stream)
+{
+	switch_hash_index_t *hi;
+	const void *key;
+	void *val;
+	uint32_t i;
+
+	switch_mutex_lock(globals.wake_mutex);
+	for (hi = switch_core_hash_first(globals.wake_platform_hash); hi; hi = switch_core_hash_next(&hi)) {
+		wake_platform_t *stats;
+
+		switch_core_hash_this(hi, &key, NULL, &val);
+		stats = (wake_platform_t *) val;
+
+		stream->write_function(stream, "%s: misses %u\n", (const char *) key, stats->misses);
+		for (i = 0; i <= APN_WAKE_BUCKETS; i++) {
+			if (i < APN_WAKE_BUCKETS) {
+				stream->write_function(stream, "  < %6u ms: %u\n", 250U << i, stats->buckets[i]);
+			} else {
+				stream->write_function(stream, "  >=%6u ms: %u\n", 250U << (i - 1), stats->buckets[i]);
+			}
+		}
+	}
+	switch_mutex_unlock(globals.wake_mutex);
+}
+
+/* In-memory token store: "type/user@realm" -> tokens, in front of push_tokens.
+ * Periodically saved to versioned snapshot file which is mapped on load, so pushes work without db from the first second */
+#define APN_TOKEN_JOURNAL_KEEP 30
+#define APN_SNAPSHOT_MAGIC "APNSNAP"
+#define APN_SNAPSHOT_VERSION 1
+
+struct token_rec_obj {
+	const char *token;
+	const char *app_id;
+	const char *platform;
+	switch_bool_t owned;
+};
+typedef struct token_rec_obj token_rec_t;
+
+struct token_set_obj {
+	uint32_t count;
+	token_rec_t *recs;
+};
+typedef struct token_set_obj token_set_t;
+
+enum token_op_type {
+	TOKEN_OP_PUT,
+	TOKEN_OP_REMOVE
+};
+
+/* Recent change of store, replayed to the new store before swap of reconcile.
+ * REGISTER reaches db later (register batch, queue manager), so the journal keeps changes made
+ * register_flush_interval + APN_TOKEN_JOURNAL_KEEP before the reconcile SELECT too */
+struct token_op_obj {
+	enum token_op_type type;
+	switch_time_t at;
+	char *key;
+	char *token;
+	char *app_id;
+	char *platform;
+	struct token_op_obj *next;
+};
+typedef struct token_op_obj token_op_t;
+
+/* Snapshot layout: header, sets, records, strings arena. All references are offsets in arena */
+struct snapshot_header_obj {
+	char magic[8];
+	uint32_t version;
+	uint32_t checksum;
+	uint32_t set_count;
+	uint32_t rec_count;
+	uint64_t sets_off;
+	uint64_t recs_off;
+	uint64_t arena_off;
+	uint64_t arena_size;
+	uint64_t file_size;
+};
+typedef struct snapshot_header_obj snapshot_header_t;
+
+struct snapshot_set_obj {
+	uint32_t key_off;
+	uint32_t first_rec;
+	uint32_t rec_count;
+};
+typedef struct snapshot_set_obj snapshot_set_t;
+
+struct snapshot_rec_obj {
+	uint32_t token_off;
+	uint32_t app_id_off;
+	uint32_t platform_off;
+};
+typedef struct snapshot_rec_obj snapshot_rec_t;
+
+static char *token_store_key(const char *user, const char *realm, const char *type)
+{
+	return switch_mprintf("%s/%s@%s", type, user, realm);
+}
+
+/* realm, app_id and platform have low cardinality, keep one copy of each */
+static const char *token_store_intern(const char *str)
+{
+	const char *ret;
+
+	switch_mutex_lock(globals.token_store_intern_mutex);
+	if (!(ret = switch_core_hash_find(globals.token_store_intern, str))) {
+		ret = switch_core_strdup(globals.pool, str);
+		switch_core_hash_insert(globals.token_store_intern, ret, ret);
+	}
+	switch_mutex_unlock(globals.token_store_intern_mutex);
+
+	return ret;
+}
+
+static void token_set_free(token_set_t *set)
+{
+	uint32_t i;
+
+	if (!set) {
+		return;
+	}
+
+	for (i = 0; i < set->count; i++) {
+		if (set->recs[i].owned) {
+			free((char *) set->recs[i].token);
+		}
+	}
+	switch_safe_free(set->recs);
+	free(set);
+}
+
+static void token_sets_destroy(switch_hash_t **sets)
+{
+	switch_hash_index_t *hi;
+	const void *key;
+	void *val;
+
+	if (!*sets) {
+		return;
+	}
+
+	while ((hi = switch_core_hash_first(*sets))) {
+		switch_core_hash_this(hi, &key, NULL, &val);
+		switch_core_hash_delete(*sets, (const char *) key);
+		token_set_free((token_set_t *) val);
+	}
+	switch_core_hash_destroy(sets);
+}
+
+static void token_set_append(token_set_t *set, const char *token, const char *app_id, const char *platform, switch_bool_t copy)
+{
+	token_rec_t *recs = realloc(set->recs, sizeof(*recs) * (set->count + 1));
+
+	switch_assert(recs);
+	set->recs = recs;
+	set->recs[set->count].token = copy ? strdup(token) : token;
+	set->recs[set->count].owned = copy;
+	set->recs[set->count].app_id = token_store_intern(app_id);
+	set->recs[set->count].platform = token_store_intern(platform);
+	set->count++;
+}
+
+/* create == SWITCH_TRUE: store is complete, so absent key means user has no tokens yet */
+static void token_sets_put(switch_hash_t *sets, const char *key, const char *token, const char *app_id, const char *platform, switch_bool_t create)
+{
+	token_set_t *set;
+	uint32_t i;
+
+	if (!(set = switch_core_hash_find(sets, key))) {
+		if (!create) {
+			return;
+		}
+		switch_zmalloc(set, sizeof(*set));
+		switch_core_hash_insert(sets, key, set);
+	}
+
+	for (i = 0; i < set->count; i++) {
+		if (!strcmp(set->recs[i].token, token) && !strcmp(set->recs[i].app_id, app_id)) {
+			set->recs[i].platform = token_store_intern(platform);
+			return;
+		}
+	}
+
+	token_set_append(set, token, app_id, platform, SWITCH_TRUE);
+}
+
+static void token_sets_remove(switch_hash_t *sets, const char *key, const char *token)
+{
+	token_set_t *set;
+	uint32_t i;
+
+	if (!(set = switch_core_hash_find(sets, key))) {
+		return;
+	}
+
+	for (i = 0; i < set->count; i++) {
+		if (!strcmp(set->recs[i].token, token)) {
+			if (set->recs[i].owned) {
+				free((char *) set->recs[i].token);
+			}
+			memmove(&set->recs[i], &set->recs[i + 1], sizeof(token_rec_t) * (set->count - i - 1));
+			set->count--;
+			i--;
+		}
+	}
+}
+
+static void token_store_journal_free(token_op_t *op)
+{
+	token_op_t *next;
+
+	for (; op; op = next) {
+		next = op->next;
+		switch_safe_free(op->key);
+		switch_safe_free(op->token);
+		switch_safe_free(op->app_id);
+		switch_safe_free(op->platform);
+		free(op);
+	}
+}
+
+/* Time from change of store till its row is surely in db */
+static switch_time_t token_store_journal_keep(void)
+{
+	return (switch_time_t) globals.register_flush_interval * 1000 + (switch_time_t) APN_TOKEN_JOURNAL_KEEP * 1000000;
+}
+
+/* Caller holds write lock of store. Journal is in time order, old head is dropped */
+static void token_store_journal_prune(switch_time_t before)
+{
+	token_op_t *op;
+
+	while ((op = globals.token_store_journal) && op->at < before) {
+		globals.token_store_journal = op->next;
+		op->next = NULL;
+		token_store_journal_free(op);
+	}
+	if (!globals.token_store_journal) {
+		globals.token_store_journal_tail = NULL;
+	}
+}
+
+/* Caller holds write lock of store */
+static void token_store_journal(enum token_op_type type, const char *key, const char *token, const char *app_id, const char *platform)
+{
+	token_op_t *op;
+
+	switch_zmalloc(op, sizeof(*op));
+	op->type = type;
+	op->at = switch_time_ref();
+	op->key = strdup(key);
+	op->token = strdup(token);
+	op->app_id = app_id ? strdup(app_id) : NULL;
+	op->platform = platform ? strdup(platform) : NULL;
+
+	token_store_journal_prune(op->at - token_store_journal_keep());
+	if (globals.token_store_journal_tail) {
+		globals.token_store_journal_tail->next = op;
+	} else {
+		globals.token_store_journal = op;
+	}
+	globals.token_store_journal_tail = op;
+}
+
+static switch_bool_t token_store_lookup(const char *user, const char *realm, const char *type, callback_t *cbt)
+{
+	token_set_t *set;
+	char *key;
+	uint32_t i;
+	switch_bool_t found = SWITCH_FALSE;
+
+	if (!globals.token_store) {
+		return SWITCH_FALSE;
+	}
+
+	key = token_store_key(user, realm, type);
+
+	switch_thread_rwlock_rdlock(globals.token_store_rwlock);
+	if ((set = switch_core_hash_find(globals.token_store_sets, key)) && set->count) {
+		for (i = 0; i < set->count; i++) {
+			cJSON *item = cJSON_CreateObject();
+			cJSON_AddItemToArray(cbt->array, item);
+			cJSON_AddItemToObject(item, "platform", cJSON_CreateString(set->recs[i].platform));
+			cJSON_AddItemToObject(item, "app_id", cJSON_CreateString(set->recs[i].app_id));
+			cJSON_AddItemToObject(item, "token", cJSON_CreateString(set->recs[i].token));
+		}
+		found = SWITCH_TRUE;
+	}
+	switch_thread_rwlock_unlock(globals.token_store_rwlock);
+
+	switch_safe_free(key);
+
+	return found;
+}
+
+/* Cache result of db lookup */
+static void token_store_fill(const char *user, const char *realm, const char *type, cJSON *array)
+{
+	token_set_t *set, *old;
+	cJSON *item;
+	char *key;
+
+	if (!globals.token_store || cJSON_GetArraySize(array) <= 0) {
+		return;
+	}
+
+	key = token_store_key(user, realm, type);
+	switch_zmalloc(set, sizeof(*set));
+
+	cJSON_ArrayForEach(item, array) {
+		token_set_append(set, cJSON_GetObjectCstr(item, "token"), cJSON_GetObjectCstr(item, "app_id"), cJSON_GetObjectCstr(item, "platform"), SWITCH_TRUE);
+	}
+
+	switch_thread_rwlock_wrlock(globals.token_store_rwlock);
+	if ((old = switch_core_hash_delete(globals.token_store_sets, key))) {
+		token_set_free(old);
+	}
+	switch_core_hash_insert(globals.token_store_sets, key, set);
+	cJSON_ArrayForEach(item, array) {
+		token_store_journal(TOKEN_OP_PUT, key, cJSON_GetObjectCstr(item, "token"), cJSON_GetObjectCstr(item, "app_id"), cJSON_GetObjectCstr(item, "platform"));
+	}
+	switch_thread_rwlock_unlock(globals.token_store_rwlock);
+
+	switch_safe_free(key);
+}
+
+static void token_store_put(const char *user, const char *realm, const char *type, const char *token, const char *app_id, const char *platform)
+{
+	char *key;
+
+	if (!globals.token_store) {
+		return;
+	}
+
+	key = token_store_key(user, realm, type);
+
+	switch_thread_rwlock_wrlock(globals.token_store_rwlock);
+	token_sets_put(globals.token_store_sets, key, token, app_id, platform, globals.token_store_complete);
+	token_store_journal(TOKEN_OP_PUT, key, token, app_id, platform);
+	switch_thread_rwlock_unlock(globals.token_store_rwlock);
+
+	switch_safe_free(key);
+}
+
+/* The same tuple is already known, so REGISTER is refresh only */
+static switch_bool_t token_store_has(const char *user, const char *realm, const char *type, const char *token, const char *app_id, const char *platform)
+{
+	token_set_t *set;
+	char *key;
+	uint32_t i;
+	switch_bool_t found = SWITCH_FALSE;
+
+	if (!globals.token_store) {
+		return SWITCH_FALSE;
+	}
+
+	key = token_store_key(user, realm, type);
+
+	switch_thread_rwlock_rdlock(globals.token_store_rwlock);
+	if ((set = switch_core_hash_find(globals.token_store_sets, key))) {
+		for (i = 0; i < set->count && !found; i++) {
+			found = !strcmp(set->recs[i].token, token) && !strcmp(set->recs[i].app_id, app_id) && !strcmp(set->recs[i].platform, platform);
+		}
+	}
+	switch_thread_rwlock_unlock(globals.token_store_rwlock);
+
+	switch_safe_free(key);
+
+	return found;
+}
+
+static void token_store_remove(const char *user, const char *realm, const char *type, const char *token)
+{
+	char *key;
+
+	if (!globals.token_store || zstr(user) || zstr(realm)) {
+		return;
+	}
+
+	key = token_store_key(user, realm, type);
+
+	switch_thread_rwlock_wrlock(globals.token_store_rwlock);
+	token_sets_remove(globals.token_store_sets, key, token);
+	token_store_journal(TOKEN_OP_REMOVE, key, token, NULL, NULL);
+	switch_thread_rwlock_unlock(globals.token_store_rwlock);
+
+	switch_safe_free(key);
+}
+
+static uint32_t snapshot_checksum(const unsigned char *data, switch_size_t len)
+{
+	uint32_t hash = 2166136261U;
+	switch_size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= data[i];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+struct snapshot_builder_obj {
+	switch_hash_t *offsets;
+	char *arena;
+	switch_size_t arena_size;
+	switch_size_t arena_len;
+};
+typedef struct snapshot_builder_obj snapshot_builder_t;
+
+static uint32_t snapshot_string(snapshot_builder_t *builder, const char *str)
+{
+	void *found;
+	switch_size_t len = strlen(str) + 1;
+	uint32_t off;
+
+	if ((found = switch_core_hash_find(builder->offsets, str))) {
+		return (uint32_t)((intptr_t) found - 1);
+	}
+
+	if (builder->arena_len + len > builder->arena_size) {
+		builder->arena_size = (builder->arena_size + len) * 2;
+		builder->arena = realloc(builder->arena, builder->arena_size);
+		switch_assert(builder->arena);
+	}
+
+	off = (uint32_t) builder->arena_len;
+	memcpy(builder->arena + builder->arena_len, str, len);
+	builder->arena_len += len;
+	switch_core_hash_insert(builder->offsets, str, (void *)(intptr_t)(off + 1));
+
+	return off;
+}
+
+static switch_status_t token_store_snapshot_write(void)
+{
+	snapshot_builder_t builder = { 0 };
+	snapshot_header_t header;
+	snapshot_set_t *sets = NULL;
+	snapshot_rec_t *recs = NULL;
+	uint32_t set_count = 0, rec_count = 0, set_size = 0, rec_size = 0, i;
+	switch_hash_index_t *hi;
+	char *tmp_path = NULL, *body = NULL;
+	switch_size_t body_len;
+	switch_status_t status = SWITCH_STATUS_FALSE;
+	int fd = -1;
+
+	memset(&header, 0, sizeof(header));
+	switch_core_hash_init(&builder.offsets);
+
+	switch_thread_rwlock_rdlock(globals.token_store_rwlock);
+	for (hi = switch_core_hash_first(globals.token_store_sets); hi; hi = switch_core_hash_next(&hi)) {
+		const void *key;
+		void *val;
+		token_set_t *set;
+
+		switch_core_hash_this(hi, &key, NULL, &val);
+		set = (token_set_t *) val;
+		if (!set->count) {
+			continue;
+		}
+
+		if (set_count == set_size) {
+			set_size = set_size ? set_size * 2 : 1024;
+			sets = realloc(sets, sizeof(*sets) * set_size);
+		}
+		sets[set_count].key_off = snapshot_string(&builder, (const char *) key);
+		sets[set_count].first_rec = rec_count;
+		sets[set_count].rec_count = set->count;
+		set_count++;
+
+		for (i = 0; i < set->count; i++) {
+			if (rec_count == rec_size) {
+				rec_size = rec_size ? rec_size * 2 : 1024;
+				recs = realloc(recs, sizeof(*recs) * rec_size);
+			}
+			recs[rec_count].token_off = snapshot_string(&builder, set->recs[i].token);
+			recs[rec_count].app_id_off = snapshot_string(&builder, set->recs[i].app_id);
+			recs[rec_count].platform_off = snapshot_string(&builder, set->recs[i].platform);
+			rec_count++;
+		}
+	}
+	switch_thread_rwlock_unlock(globals.token_store_rwlock);
+
+	memcpy(header.magic, APN_SNAPSHOT_MAGIC, sizeof(APN_SNAPSHOT_MAGIC));
+	header.version = APN_SNAPSHOT_VERSION;
+	header.set_count = set_count;
+	header.rec_count = rec_count;
+	header.sets_off = sizeof(header);
+	header.recs_off = header.sets_off + sizeof(snapshot_set_t) * set_count;
+	header.arena_off = header.recs_off + sizeof(snapshot_rec_t) * rec_count;
+	header.arena_size = builder.arena_len;
+	header.file_size = header.arena_off + header.arena_size;
+
+	body_len = header.file_size - sizeof(header);
+	switch_zmalloc(body, body_len + 1);
+	if (set_count) {
+		memcpy(body, sets, sizeof(snapshot_set_t) * set_count);
+	}
+	if (rec_count) {
+		memcpy(body + (header.recs_off - sizeof(header)), recs, sizeof(snapshot_rec_t) * rec_count);
+	}
+	if (builder.arena_len) {
+		memcpy(body + (header.arena_off - sizeof(header)), builder.arena, builder.arena_len);
+	}
+	header.checksum = snapshot_checksum((unsigned char *) body, body_len);
+
+	/*Write new file and rename, mapped old snapshot stays valid*/
+	tmp_path = switch_mprintf("%s.tmp", globals.token_snapshot_path);
+	if ((fd = open(tmp_path, O_CREAT | O_TRUNC | O_WRONLY, 0640)) < 0) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Can't open token snapshot %s: %s\n", tmp_path, strerror(errno));
+		goto end;
+	}
+
+	if (write(fd, &header, sizeof(header)) != (ssize_t) sizeof(header) || write(fd, body, body_len) != (ssize_t) body_len || fsync(fd)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Can't write token snapshot %s: %s\n", tmp_path, strerror(errno));
+		goto end;
+	}
+
+	if (rename(tmp_path, globals.token_snapshot_path)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Can't rename token snapshot %s: %s\n", tmp_path, strerror(errno));
+		goto end;
+	}
+
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. Token snapshot saved: %u users, %u tokens\n", set_count, rec_count);
+	status = SWITCH_STATUS_SUCCESS;
+
+end:
+	if (fd >= 0) {
+		close(fd);
+	}
+	switch_safe_free(tmp_path);
+	switch_safe_free(body);
+	switch_safe_free(sets);
+	switch_safe_free(recs);
+	switch_safe_free(builder.arena);
+	switch_core_hash_destroy(&builder.offsets);
+
+	return status;
+}
+
+static switch_status_t token_store_snapshot_load(void)
+{
+	snapshot_header_t *header;
+	snapshot_set_t *sets;
+	snapshot_rec_t *recs;
+	const char *arena;
+	struct stat st;
+	void *map = NULL;
+	uint32_t i, j;
+	int fd;
+
+	if ((fd = open(globals.token_snapshot_path, O_RDONLY)) < 0) {
+		return SWITCH_STATUS_FALSE;
+	}
+
+	if (fstat(fd, &st) || st.st_size < (off_t) sizeof(*header) ||
+		(map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return SWITCH_STATUS_FALSE;
+	}
+	close(fd);
+
+	header = (snapshot_header_t *) map;
+	if (memcmp(header->magic, APN_SNAPSHOT_MAGIC, sizeof(APN_SNAPSHOT_MAGIC)) || header->version != APN_SNAPSHOT_VERSION ||
+		header->file_size != (uint64_t) st.st_size ||
+		header->recs_off != header->sets_off + sizeof(snapshot_set_t) * (uint64_t) header->set_count ||
+		header->arena_off != header->recs_off + sizeof(snapshot_rec_t) * (uint64_t) header->rec_count ||
+		header->arena_off + header->arena_size != header->file_size ||
+		(header->arena_size && ((const char *) map)[header->file_size - 1] != '\0') ||
+		header->checksum != snapshot_checksum((unsigned char *) map + sizeof(*header), header->file_size - sizeof(*header))) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Token snapshot %s is broken or has other version, ignore it\n", globals.token_snapshot_path);
+		munmap(map, st.st_size);
+		return SWITCH_STATUS_FALSE;
+	}
+
+	sets = (snapshot_set_t *) ((char *) map + header->sets_off);
+	recs = (snapshot_rec_t *) ((char *) map + header->recs_off);
+	arena = (const char *) map + header->arena_off;
+
+	switch_thread_rwlock_wrlock(globals.token_store_rwlock);
+	for (i = 0; i < header->set_count; i++) {
+		token_set_t *set;
+
+		if (sets[i].key_off >= header->arena_size || (uint64_t) sets[i].first_rec + sets[i].rec_count > header->rec_count) {
+			continue;
+		}
+
+		switch_zmalloc(set, sizeof(*set));
+		for (j = sets[i].first_rec; j < sets[i].first_rec + sets[i].rec_count; j++) {
+			if (recs[j].token_off >= header->arena_size || recs[j].app_id_off >= header->arena_size || recs[j].platform_off >= header->arena_size) {
+				continue;
+			}
+			/*Token strings are used right from mapped file*/
+			token_set_append(set, arena + recs[j].token_off, arena + recs[j].app_id_off, arena + recs[j].platform_off, SWITCH_FALSE);
+		}
+		token_set_free(switch_core_hash_delete(globals.token_store_sets, arena + sets[i].key_off));
+		switch_core_hash_insert(globals.token_store_sets, arena + sets[i].key_off, set);
+	}
+	globals.token_store_map = map;
+	globals.token_store_map_size = st.st_size;
+	globals.token_store_complete = SWITCH_TRUE;
+	switch_thread_rwlock_unlock(globals.token_store_rwlock);
+
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Token snapshot loaded: %u users, %u tokens\n", header->set_count, header->rec_count);
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+static int token_store_reconcile_callback(void *pArg, int argc, char **argv, char **columnNames)
+{
+	switch_hash_t *sets = (switch_hash_t *) pArg;
+	char *key;
+
+	if (argc < 8 || zstr(argv[0]) || zstr(argv[1]) || zstr(argv[2]) || zstr(argv[3]) || zstr(argv[4]) || zstr(argv[5])) {
+		return 0;
+	}
+
+	key = token_store_key(argv[0], argv[1], argv[2]);
+	token_sets_put(sets, key, argv[5], argv[4], argv[3], SWITCH_TRUE);
+	switch_safe_free(key);
+
+	if (globals.wake_stats && !zstr(argv[6])) {
+		switch_mutex_lock(globals.wake_mutex);
+		wake_stats_get(argv[5], argv[6], zstr(argv[7]) ? 0 : (uint32_t) strtoul(argv[7], NULL, 10));
+		switch_mutex_unlock(globals.wake_mutex);
+	}
+
+	return 0;
+}
+
+/* Rebuild store from push_token_entries, changes made meanwhile and those which may not be in db yet are replayed from journal */
+static void token_store_reconcile(void)
+{
+	switch_hash_t *sets = NULL, *old = NULL;
+	token_op_t *op;
+	switch_time_t start = switch_time_now(), from = switch_time_ref() - token_store_journal_keep();
+
+	switch_core_hash_init(&sets);
+	mod_apn_execute_sql_callback("SELECT t.extension, r.name, ty.name, p.name, a.name, t.token, w.latencies, w.misses FROM push_token_entries t "
+								 "JOIN push_realms r ON r.id = t.realm_ref "
+								 "JOIN push_apps a ON a.id = t.app_ref "
+								 "JOIN push_types ty ON ty.id = t.type_ref "
+								 "JOIN push_platforms p ON p.id = t.platform_ref "
+								 "LEFT JOIN push_token_wake w ON w.token = t.token AND w.type = ty.name",
+								 token_store_reconcile_callback, sets);
+
+	switch_thread_rwlock_wrlock(globals.token_store_rwlock);
+	token_store_journal_prune(from);
+	for (op = globals.token_store_journal; op; op = op->next) {
+		if (op->type == TOKEN_OP_PUT) {
+			token_sets_put(sets, op->key, op->token, op->app_id, op->platform, SWITCH_TRUE);
+		} else {
+			token_sets_remove(sets, op->key, op->token);
+		}
+	}
+
+	old = globals.token_store_sets;
+	globals.token_store_sets = sets;
+	globals.token_store_complete = SWITCH_TRUE;
+	switch_thread_rwlock_unlock(globals.token_store_rwlock);
+
+	token_sets_destroy(&old);
+
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. Token store reconciled with db in %" SWITCH_TIME_T_FMT " ms\n", (switch_time_now() - start) / 1000);
+}
+
+static void *SWITCH_THREAD_FUNC token_store_thread_run(switch_thread_t *thread, void *obj)
+{
+	time_t now, next_snapshot, next_reconcile;
+
+	token_store_reconcile();
+
+	now = switch_epoch_time_now(NULL);
+	next_snapshot = now + globals.token_snapshot_interval;
+	next_reconcile = now + globals.token_reconcile_interval;
+
+	while (globals.running) {
+		switch_yield(200000);
+		now = switch_epoch_time_now(NULL);
+
+		if (globals.token_reconcile_interval && now >= next_reconcile) {
+			token_store_reconcile();
+			next_reconcile = now + globals.token_reconcile_interval;
+		}
+
+		if (!zstr(globals.token_snapshot_path) && now >= next_snapshot) {
+			token_store_snapshot_write();
+			next_snapshot = now + globals.token_snapshot_interval;
+		}
+	}
+
+	if (!zstr(globals.token_snapshot_path)) {
+		token_store_snapshot_write();
+	}
+
+	return NULL;
+}
+
+static void token_store_start(void)
+{
+	if (!globals.token_store) {
+		return;
+	}
+
+	if (!zstr(globals.token_snapshot_path)) {
+		token_store_snapshot_load();
+	}
+
+	launch_thread(&globals.token_store_thread, token_store_thread_run, NULL);
+}
+
+static void token_store_destroy(void)
+{
+	if (!globals.token_store_rwlock) {
+		return;
+	}
+
+	switch_thread_rwlock_wrlock(globals.token_store_rwlock);
+	token_sets_destroy(&globals.token_store_sets);
+	token_store_journal_free(globals.token_store_journal);
+	globals.token_store_journal = NULL;
+	globals.token_store_journal_tail = NULL;
+	if (globals.token_store_map) {
+		munmap(globals.token_store_map, globals.token_store_map_size);
+		globals.token_store_map = NULL;
+	}
+	switch_thread_rwlock_unlock(globals.token_store_rwlock);
+
+	if (globals.token_store_intern) {
+		switch_core_hash_destroy(&globals.token_store_intern);
+	}
+}
+
+static void token_store_dump(switch_stream_handle_t *stream)
+{
+	switch_hash_index_t *hi;
+	uint32_t set_count = 0, rec_count = 0;
+
+	if (!globals.token_store) {
+		stream->write_function(stream, "token store is disabled\n");
+		return;
+	}
+
+	switch_thread_rwlock_rdlock(globals.token_store_rwlock);
+	for (hi = switch_core_hash_first(globals.token_store_sets); hi; hi = switch_core_hash_next(&hi)) {
+		const void *key;
+		void *val;
+
+		switch_core_hash_this(hi, &key, NULL, &val);
+		set_count++;
+		rec_count += ((token_set_t *) val)->count;
+	}
+	if (globals.fingerprints) {
+		switch_mutex_lock(globals.fingerprints_mutex);
+		stream->write_function(stream, "register fingerprints: %u of %u, evicted %u\n", globals.fingerprints_used, globals.fingerprints_size,
+							   globals.fingerprints_evicted);
+		switch_mutex_unlock(globals.fingerprints_mutex);
+	}
+
+	stream->write_function(stream, "users: %u\ntokens: %u\ncomplete: %s\nsnapshot: %s (%s)\n", set_count, rec_count,
+						   globals.token_store_complete ? "true" : "false", switch_str_nil(globals.token_snapshot_path),
+						   globals.token_store_map ? "mapped" : "not mapped");
+	switch_thread_rwlock_unlock(globals.token_store_rwlock);
+}
+
+static void db_get_tokens_array(char *user, char *realm, char *type, callback_t *cbt)
+{
+	const char *args[3];
+	char realm_ref[16], type_ref[16];
+
+	if (zstr(user) || zstr(realm)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. No parameters for get token. user: '%s', realm: '%s'\n", user, realm);
+		return;
+	}
+
+	if (token_store_lookup(user, realm, type, cbt)) {
+		return;
+	}
+
+	/*Realm or type which never registered has no tokens*/
+	if (apn_dim_ref(APN_DIM_REALM, realm, SWITCH_FALSE, realm_ref, sizeof(realm_ref)) &&
+		apn_dim_ref(APN_DIM_TYPE, type, SWITCH_FALSE, type_ref, sizeof(type_ref))) {
+		args[0] = user;
+		args[1] = realm_ref;
+		args[2] = type_ref;
+		apn_stmt_read(APN_STMT_SELECT_TOKENS, args, sql2str_callback, cbt);
+	}
+
+	token_store_fill(user, realm, type, cbt->array);
+}
+
+static void add_item_to_event(switch_event_t *event, char *name, cJSON *obj)
+{
+	if (zstr(name) || !event || !obj) {
+		return;
+	}
+
+	switch_event_del_header(event, name);
+	if (obj->type == cJSON_String && obj->valuestring && !zstr(obj->valuestring)) {
+		switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, name, obj->valuestring);
+	}
+}
+
+static push_inflight_t *push_inflight_acquire(const char *uuid)
+{
+	push_inflight_t *inflight = NULL;
+
+	if (zstr(uuid)) {
+		return NULL;
+	}
+
+	switch_mutex_lock(globals.inflight_mutex);
+	if ((inflight = switch_core_hash_find(globals.inflight_hash, uuid))) {
+		inflight->refs++;
+	}
+	switch_mutex_unlock(globals.inflight_mutex);
+
+	return inflight;
+}
+
+static void push_inflight_release(push_inflight_t **inflight_p)
+{
+	push_inflight_t *inflight = *inflight_p;
+
+	if (!inflight) {
+		return;
+	}
+
+	switch_mutex_lock(globals.inflight_mutex);
+	if (--inflight->refs > 0) {
+		inflight = NULL;
+	}
+	switch_mutex_unlock(globals.inflight_mutex);
+
+	if (inflight) {
+		switch_safe_free(inflight->uuid);
+		switch_safe_free(inflight->type);
+		switch_safe_free(inflight->user);
+		switch_safe_free(inflight->realm);
+		if (inflight->sent) {
+			cJSON_Delete(inflight->sent);
+		}
+		free(inflight);
+	}
+	*inflight_p = NULL;
+}
+
+/* Registered by waiter, so pushes of its notification can be cancelled */
+static push_inflight_t *push_inflight_register(const char *uuid, const char *user, const char *realm)
+{
+	push_inflight_t *inflight;
+
+	switch_zmalloc(inflight, sizeof(*inflight));
+	inflight->uuid = strdup(uuid);
+	inflight->user = strdup(user);
+	inflight->realm = strdup(realm);
+	inflight->sent = cJSON_CreateArray();
+	inflight->refs = 1;
+
+	switch_mutex_lock(globals.inflight_mutex);
+	switch_core_hash_insert(globals.inflight_hash, inflight->uuid, inflight);
+	switch_mutex_unlock(globals.inflight_mutex);
+
+	return inflight;
+}
+
+static void push_inflight_unregister(push_inflight_t **inflight_p)
+{
+	if (!*inflight_p) {
+		return;
+	}
+
+	switch_mutex_lock(globals.inflight_mutex);
+	switch_core_hash_delete(globals.inflight_hash, (*inflight_p)->uuid);
+	switch_mutex_unlock(globals.inflight_mutex);
+
+	push_inflight_release(inflight_p);
+}
+
+static void push_inflight_sent(push_inflight_t *inflight, const char *type, cJSON *item)
+{
+	if (!inflight) {
+		return;
+	}
+
+	switch_mutex_lock(globals.inflight_mutex);
+	if (!inflight->type) {
+		inflight->type = strdup(type);
+	}
+	cJSON_AddItemToArray(inflight->sent, cJSON_Duplicate(item, 1));
+	switch_mutex_unlock(globals.inflight_mutex);
+}
+
+static int push_inflight_sent_count(push_inflight_t *inflight)
+{
+	int count = 0;
+
+	if (inflight) {
+		switch_mutex_lock(globals.inflight_mutex);
+		count = cJSON_GetArraySize(inflight->sent);
+		switch_mutex_unlock(globals.inflight_mutex);
+	}
+
+	return count;
+}
+
+/* Device won the call: abort outstanding sends and tell other devices with cancel push (if profile has cancel_template).
+ * Token which is part of winner contact doesn't get cancel push */
+static void push_inflight_cancel(push_inflight_t *inflight, const char *winner_contact)
+{
+	switch_event_t *event = NULL;
+	cJSON *others = NULL, *item;
+	char *json = NULL;
+
+	if (!inflight) {
+		return;
+	}
+
+	switch_mutex_lock(globals.inflight_mutex);
+	inflight->cancelled = SWITCH_TRUE;
+	/*Devices may be served by different routed profiles, cancel handler checks cancel_template of each*/
+	if (inflight->type) {
+		others = cJSON_CreateArray();
+		cJSON_ArrayForEach(item, inflight->sent) {
+			const char *token = cJSON_GetObjectCstr(item, "token");
+
+			if (!zstr(token) && (zstr(winner_contact) || !strstr(winner_contact, token))) {
+				cJSON_AddItemToArray(others, cJSON_Duplicate(item, 1));
+			}
+		}
+	}
+	switch_mutex_unlock(globals.inflight_mutex);
+
+	if (others && cJSON_GetArraySize(others) > 0 && (json = cJSON_PrintUnformatted(others)) &&
+		switch_event_create_subclass(&event, SWITCH_EVENT_CUSTOM, APN_CANCEL_SUBCLASS) == SWITCH_STATUS_SUCCESS) {
+		switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "uuid", inflight->uuid);
+		switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "type", inflight->type);
+		switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "user", inflight->user);
+		switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "realm", inflight->realm);
+		switch_event_add_body(event, "%s", json);
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. Send cancel push to %d other device(s) of %s@%s\n",
+						  cJSON_GetArraySize(others), inflight->user, inflight->realm);
+		switch_event_fire(&event);
+	}
+
+	switch_safe_free(json);
+	if (others) {
+		cJSON_Delete(others);
+	}
+}
+
+/* Send push to each token of array, track == SWITCH_FALSE for cancel pushes */
+static switch_bool_t push_send_tokens(switch_event_t *event, profile_t *profile, cJSON *tokens, switch_bool_t track)
+{
+	switch_bool_t res = SWITCH_FALSE;
+	const char *type = switch_event_get_header(event, "type");
+	push_inflight_t *inflight = track ? push_inflight_acquire(switch_event_get_header(event, "uuid")) : NULL;
+	cJSON *iterator;
+	int size = cJSON_GetArraySize(tokens), i;
+
+	for (i = 0; i < size; i++) {
+		if ((iterator = cJSON_GetArrayItem(tokens, i)) == NULL) {
+			break;
+		}
+		if (inflight && inflight->cancelled) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. Skip %d queued push(es) of '%s', call is taken\n", size - i, inflight->uuid);
+			break;
+		}
+		add_item_to_event(event, "token", cJSON_GetObjectItem(iterator, "token"));
+		add_item_to_event(event, "app_id", cJSON_GetObjectItem(iterator, "app_id"));
+		add_item_to_event(event, "platform", cJSON_GetObjectItem(iterator, "platform"));
+
+		if (mod_apn_send(event, profile, inflight)) {
+			res = SWITCH_TRUE;
+			push_inflight_sent(inflight, type, iterator);
+			if (track && !zstr(type) && !strcasecmp(type, "voip") &&
+				strcmp(switch_str_nil(switch_event_get_header(event, "realm")), APN_LOADTEST_REALM)) {
+				wake_track_push(cJSON_GetObjectCstr(iterator, "token"), type, cJSON_GetObjectCstr(iterator, "platform"));
+			}
+		}
+	}
+
+	push_inflight_release(&inflight);
+
+	return res;
+}
+
+/* Cancel push ("call answered elsewhere") to devices which lost the call, tokens are in body */
+static void push_cancel_event_handler(switch_event_t *event)
+{
+	const char *type = switch_event_get_header(event, "type");
+	const char *realm = switch_event_get_header(event, "realm");
+	char *body = switch_event_get_body(event);
+	profile_t *profile, cancel_profile;
+	cJSON *tokens = NULL, *iterator, *one;
+
+	if (zstr(type) || zstr(body)) {
+		return;
+	}
+
+	if (!(tokens = cJSON_Parse(body))) {
+		return;
+	}
+
+	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "payload", "{}");
+	cJSON_ArrayForEach(iterator, tokens) {
+		profile = push_route(type, cJSON_GetObjectCstr(iterator, "app_id"), cJSON_GetObjectCstr(iterator, "platform"), realm);
+		if (!profile || zstr(profile->cancel_template)) {
+			continue;
+		}
+
+		cancel_profile = *profile;
+		cancel_profile.post_data_template = profile->cancel_template;
+		cancel_profile.post_data = profile->cancel_data;
+		cancel_profile.platform_templates = NULL;
+		one = cJSON_CreateArray();
+		cJSON_AddItemToArray(one, cJSON_Duplicate(iterator, 1));
+		push_send_tokens(event, &cancel_profile, one, SWITCH_FALSE);
+		cJSON_Delete(one);
+	}
+
+	cJSON_Delete(tokens);
+}
+
+enum push_done_status {
+	PUSH_DONE_SENT,
+	PUSH_DONE_FAILED,
+	/*Nothing to send (no tokens, no profile, deadline expired)*/
+	PUSH_DONE_NOTHING
+};
+typedef void (*push_done_func_t)(enum push_done_status status, void *data);
+
+/* Notification split between routed profiles, response event goes when the last part is sent */
+struct push_job_group_obj {
+	int refs;
+	switch_bool_t res;
+	char *uuid;
+	uint32_t wake_deadline;
+	switch_time_t lookup_us;
+	push_done_func_t done;
+	void *done_data;
+};
+typedef struct push_job_group_obj push_job_group_t;
+
+struct push_job_obj {
+	push_job_group_t *group;
+	profile_t *profile;
+	switch_event_t *event;
+	cJSON *tokens;
+};
+typedef struct push_job_obj push_job_t;
+
+static void push_fire_response(const char *uuid, switch_bool_t res, uint32_t wake_deadline, switch_time_t lookup_us, switch_time_t http_us)
+{
+	switch_event_t *res_event;
+
+	if (zstr(uuid) || switch_event_create_subclass(&res_event, SWITCH_EVENT_CUSTOM, "mobile::push::response") != SWITCH_STATUS_SUCCESS) {
+		return;
+	}
+
+	switch_event_add_header_string(res_event, SWITCH_STACK_BOTTOM, "uuid", uuid);
+	switch_event_add_header_string(res_event, SWITCH_STACK_BOTTOM, "response", res ? "sent" : "notsent");
+	if (res && wake_deadline) {
+		switch_event_add_header(res_event, SWITCH_STACK_BOTTOM, "wake-deadline", "%u", wake_deadline);
+	}
+	if (lookup_us) {
+		switch_event_add_header(res_event, SWITCH_STACK_BOTTOM, "lookup-done", "%" SWITCH_TIME_T_FMT, lookup_us);
+	}
+	if (http_us) {
+		switch_event_add_header(res_event, SWITCH_STACK_BOTTOM, "http-done", "%" SWITCH_TIME_T_FMT, http_us);
+	}
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. Fire event mobile::push::response with ID: '%s' and result: '%s'\n", uuid, res ? "sent" : "notsent");
+	switch_event_fire(&res_event);
+	switch_event_destroy(&res_event);
+}
+
+static void push_job_group_release(push_job_group_t **group_p, switch_bool_t res)
+{
+	push_job_group_t *group = *group_p;
+	int refs;
+
+	*group_p = NULL;
+	switch_mutex_lock(globals.push_jobs_mutex);
+	if (res) {
+		group->res = SWITCH_TRUE;
+	}
+	refs = --group->refs;
+	switch_mutex_unlock(globals.push_jobs_mutex);
+
+	if (refs == 0) {
+		push_fire_response(group->uuid, group->res, group->wake_deadline, group->lookup_us, switch_time_ref());
+		if (group->done) {
+			group->done(group->res ? PUSH_DONE_SENT : PUSH_DONE_FAILED, group->done_data);
+		}
+		switch_safe_free(group->uuid);
+		free(group);
+	}
+}
+
+static void push_job_run(push_job_t *job)
+{
+	switch_bool_t res = push_send_tokens(job->event, job->profile, job->tokens, SWITCH_TRUE);
+
+	push_job_group_release(&job->group, res);
+	switch_event_destroy(&job->event);
+	cJSON_Delete(job->tokens);
+	free(job);
+}
+
+/* Queue of profile, inline only when it is full or module stops */
+static void push_job_submit(push_job_group_t *group, profile_t *profile, switch_event_t *event, cJSON *tokens)
+{
+	push_job_t *job;
+
+	switch_zmalloc(job, sizeof(*job));
+	switch_mutex_lock(globals.push_jobs_mutex);
+	group->refs++;
+	switch_mutex_unlock(globals.push_jobs_mutex);
+	job->group = group;
+	job->profile = profile;
+	job->tokens = tokens;
+	switch_event_dup(&job->event, event);
+
+	if (profile->send_queue && globals.running && switch_queue_trypush(profile->send_queue, job) == SWITCH_STATUS_SUCCESS) {
+		return;
+	}
+
+	push_job_run(job);
+}
+
+static void profile_workers_dump(switch_stream_handle_t *stream)
+{
+	switch_hash_index_t *hi;
+	profile_t *profile;
+
+	for (hi = switch_core_hash_first(globals.profile_hash); hi; hi = switch_core_hash_next(&hi)) {
+		const void *key;
+		void *val;
+
+		switch_core_hash_this(hi, &key, NULL, &val);
+		profile = (profile_t *) val;
+		if (profile->send_queue) {
+			stream->write_function(stream, "%s: type %s, workers %u, queued %u, batches queued %u\n", profile->name, profile->type, profile->workers,
+								   switch_queue_size(profile->send_queue), profile->batch_queue ? switch_queue_size(profile->batch_queue) : 0);
+		}
+	}
+}
+
+static void profile_workers_stop(void)
+{
+	switch_hash_index_t *hi;
+	profile_t *profile;
+	uint32_t i;
+
+	if (!globals.profile_hash) {
+		return;
+	}
+
+	for (hi = switch_core_hash_first(globals.profile_hash); hi; hi = switch_core_hash_next(&hi)) {
+		const void *key;
+		void *val;
+
+		switch_core_hash_this(hi, &key, NULL, &val);
+		profile = (profile_t *) val;
+		/*Wake workers blocked on empty queue*/
+		for (i = 0; profile->send_queue && i < profile->workers; i++) {
+			switch_queue_trypush(profile->send_queue, NULL);
+		}
+		for (i = 0; profile->worker_threads && i < profile->workers; i++) {
+			join_thread(&profile->worker_threads[i]);
+		}
+	}
+}
+
+static void push_batch_destroy(push_batch_t **batch_p)
+{
+	push_batch_t *batch = *batch_p;
+	uint32_t i;
+
+	*batch_p = NULL;
+	if (!batch) {
+		return;
+	}
+
+	for (i = 0; i < batch->groups_count; i++) {
+		push_job_group_release(&batch->groups[i], batch->sent);
+	}
+	switch_safe_free(batch->groups);
+	switch_event_destroy(&batch->event);
+	cJSON_Delete(batch->entries);
+	switch_safe_free(batch->payload);
+	free(batch);
+}
+
+/* Add tokens of user to pending batch with the same payload, full batch goes to sender right away */
+static switch_bool_t push_batch_add(profile_t *profile, push_job_group_t *group, switch_event_t *event, const char *payload,
+								   const char *user, const char *realm, cJSON *tokens)
+{
+	const char *key = zstr(payload) ? "" : payload;
+	switch_bool_t wake = SWITCH_FALSE;
+	push_batch_t *batch;
+	cJSON *iterator, *entry;
+
+	switch_mutex_lock(profile->batch_mutex);
+	cJSON_ArrayForEach(iterator, tokens) {
+		if (!(batch = switch_core_hash_find(profile->batches, key))) {
+			switch_zmalloc(batch, sizeof(*batch));
+			batch->profile = profile;
+			batch->payload = strdup(key);
+			batch->entries = cJSON_CreateArray();
+			batch->first_us = switch_time_ref();
+			switch_event_dup(&batch->event, event);
+			switch_core_hash_insert(profile->batches, batch->payload, batch);
+		}
+
+		entry = cJSON_CreateObject();
+		cJSON_AddItemToObject(entry, "token", cJSON_CreateString(switch_str_nil(cJSON_GetObjectCstr(iterator, "token"))));
+		cJSON_AddItemToObject(entry, "app_id", cJSON_CreateString(switch_str_nil(cJSON_GetObjectCstr(iterator, "app_id"))));
+		cJSON_AddItemToObject(entry, "platform", cJSON_CreateString(switch_str_nil(cJSON_GetObjectCstr(iterator, "platform"))));
+		cJSON_AddItemToObject(entry, "user", cJSON_CreateString(user));
+		cJSON_AddItemToObject(entry, "realm", cJSON_CreateString(realm));
+		cJSON_AddItemToArray(batch->entries, entry);
+
+		/*Notification is done when the last batch with its tokens is sent*/
+		if (!batch->groups_count || batch->groups[batch->groups_count - 1] != group) {
+			if (batch->groups_count == batch->groups_size) {
+				batch->groups_size = batch->groups_size ? batch->groups_size * 2 : 16;
+				batch->groups = realloc(batch->groups, sizeof(*batch->groups) * batch->groups_size);
+			}
+			switch_mutex_lock(globals.push_jobs_mutex);
+			group->refs++;
+			switch_mutex_unlock(globals.push_jobs_mutex);
+			batch->groups[batch->groups_count++] = group;
+		}
+
+		if (++batch->count >= profile->batch_max) {
+			switch_core_hash_delete(profile->batches, batch->payload);
+			if (!profile->batch_queue || switch_queue_trypush(profile->batch_queue, batch) != SWITCH_STATUS_SUCCESS) {
+				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "CARUSTO. Batch queue is full, drop %u push(es) of profile '%s'\n", batch->count, profile->name);
+				push_batch_destroy(&batch);
+			}
+			wake = SWITCH_TRUE;
+		} else if (batch->count == 1) {
+			wake = SWITCH_TRUE;
+		}
+	}
+	switch_mutex_unlock(profile->batch_mutex);
+
+	/*Full batch or new deadline: NULL job wakes worker waiting on send queue*/
+	if (wake && profile->send_queue) {
+		switch_queue_trypush(profile->send_queue, NULL);
+	}
+
+	return SWITCH_TRUE;
+}
+
+/* Move batches of profile older than batch_linger (all when force) to its batch queue,
+ * returns usec till the next pending batch is due, 0 when none is pending */
+static switch_interval_time_t push_batch_flush_due(profile_t *profile, switch_bool_t force)
+{
+	switch_hash_index_t *bi;
+	switch_time_t now = switch_time_ref(), due;
+	switch_interval_time_t wait = 0;
+	push_batch_t *batch;
+	const void *key;
+	void *val;
+
+	switch_mutex_lock(profile->batch_mutex);
+	for (bi = switch_core_hash_first(profile->batches); bi;) {
+		switch_core_hash_this(bi, &key, NULL, &val);
+		bi = switch_core_hash_next(&bi);
+		batch = (push_batch_t *) val;
+
+		due = batch->first_us + (switch_time_t) profile->batch_linger * 1000;
+		if (force || now >= due) {
+			switch_core_hash_delete(profile->batches, batch->payload);
+			if (switch_queue_trypush(profile->batch_queue, batch) != SWITCH_STATUS_SUCCESS) {
+				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "CARUSTO. Batch queue is full, drop %u push(es) of profile '%s'\n", batch->count, profile->name);
+				push_batch_destroy(&batch);
+			}
+		} else if (!wait || due - now < wait) {
+			wait = due - now;
+		}
+	}
+	switch_mutex_unlock(profile->batch_mutex);
+
+	return wait;
+}
+
+/* Result of token in batch response: {"token": "...", "code": 410, "reason": "Unregistered"} */
+static void push_batch_result(push_batch_t *batch, cJSON *result, uint32_t *sent)
+{
+	profile_t *profile = batch->profile;
+	const char *token = cJSON_GetObjectCstr(result, "token"), *reason;
+	http_response_t response;
+	cJSON *code, *entry;
+
+	if (zstr(token) || (!(code = cJSON_GetObjectItem(result, "code")) && !(code = cJSON_GetObjectItem(result, "status"))) || code->type != cJSON_Number) {
+		return;
+	}
+
+	memset(&response, 0, sizeof(response));
+	response.code = code->valueint;
+	if (!zstr((reason = cJSON_GetObjectCstr(result, "reason")))) {
+		switch_copy_string(response.body, reason, sizeof(response.body));
+	}
+
+	if (response.code >= 200 && response.code < 300) {
+		(*sent)++;
+	} else if (profile_should_evict(profile, &response)) {
+		cJSON_ArrayForEach(entry, batch->entries) {
+			if (!strcmp(token, cJSON_GetObjectCstr(entry, "token"))) {
+				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "CARUSTO. Token '%s' rejected by provider (%ld), evict it\n", token, response.code);
+				evict_token(cJSON_GetObjectCstr(entry, "user"), cJSON_GetObjectCstr(entry, "realm"), token,
+							switch_event_get_header(batch->event, "type"));
+				break;
+			}
+		}
+	}
+}
+
+static void push_batch_send(push_batch_t *batch)
+{
+	profile_t batch_profile = *batch->profile;
+	http_response_t response;
+	char *tokens = cJSON_PrintUnformatted(batch->entries);
+	cJSON *root = NULL, *results = NULL, *result;
+	uint32_t sent = 0;
+
+	/*One request for all tokens, url and body see ${tokens} and ${count}*/
+	batch_profile.post_data_template = batch_profile.batch_template;
+	batch_profile.post_data = batch_profile.batch_data;
+	batch_profile.platform_templates = NULL;
+	switch_event_del_header(batch->event, "tokens");
+	switch_event_add_header_string(batch->event, SWITCH_STACK_BOTTOM, "tokens", switch_str_nil(tokens));
+	switch_event_del_header(batch->event, "count");
+	switch_event_add_header(batch->event, SWITCH_STACK_BOTTOM, "count", "%u", batch->count);
+
+	memset(&response, 0, sizeof(response));
+	response.keep_data = SWITCH_TRUE;
+	do_curl(batch->event, &batch_profile, &response);
+
+	if (response.code < 200 || response.code >= 300) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "CARUSTO. Batch of %u push(es) of profile '%s' failed (%ld)\n", batch->count,
+						  batch_profile.name, response.code);
+		goto end;
+	}
+	batch->sent = SWITCH_TRUE;
+
+	/*Per token results: array or {"results": [...]}, missing result means sent*/
+	if (response.data && (root = cJSON_Parse(response.data))) {
+		results = root->type == cJSON_Array ? root : cJSON_GetObjectItem(root, "results");
+	}
+
+	if (results && results->type == cJSON_Array) {
+		cJSON_ArrayForEach(result, results) {
+			push_batch_result(batch, result, &sent);
+		}
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. Batch of profile '%s': %u push(es), %u result(s), %u sent\n",
+						  batch_profile.name, batch->count, cJSON_GetArraySize(results), sent);
+	} else {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. Batch of profile '%s': %u push(es) sent\n", batch_profile.name, batch->count);
+	}
+
+end:
+	if (root) {
+		cJSON_Delete(root);
+	}
+	switch_safe_free(response.data);
+	switch_safe_free(tokens);
+}
+
+/* Jobs of profile and its batches: pending ones are moved to batch_queue after batch_linger.
+ * Worker sleeps till the earliest batch is due or a job (NULL one is a wake up) comes */
+static void *SWITCH_THREAD_FUNC profile_worker_run(switch_thread_t *thread, void *obj)
+{
+	profile_t *profile = (profile_t *) obj;
+	switch_interval_time_t wait;
+	switch_status_t status;
+	push_batch_t *batch;
+	void *pop = NULL;
+
+	while (globals.running) {
+		wait = 0;
+		if (profile->batch_queue) {
+			wait = push_batch_flush_due(profile, SWITCH_FALSE);
+			if (switch_queue_trypop(profile->batch_queue, &pop) == SWITCH_STATUS_SUCCESS && pop) {
+				batch = (push_batch_t *) pop;
+				push_batch_send(batch);
+				push_batch_destroy(&batch);
+				continue;
+			}
+		}
+
+		status = wait ? switch_queue_pop_timeout(profile->send_queue, &pop, wait) : switch_queue_pop(profile->send_queue, &pop);
+		if (status == SWITCH_STATUS_SUCCESS && pop) {
+			push_job_run((push_job_t *) pop);
+		}
+	}
+
+	/*Send what is pending on shutdown*/
+	while (switch_queue_trypop(profile->send_queue, &pop) == SWITCH_STATUS_SUCCESS) {
+		if (pop) {
+			push_job_run((push_job_t *) pop);
+		}
+	}
+	if (profile->batch_queue) {
+		push_batch_flush_due(profile, SWITCH_TRUE);
+		while (switch_queue_trypop(profile->batch_queue, &pop) == SWITCH_STATUS_SUCCESS && pop) {
+			batch = (push_batch_t *) pop;
+			push_batch_send(batch);
+			push_batch_destroy(&batch);
+		}
+	}
+
+	return NULL;
+}
+
+static void profile_workers_start(void)
+{
+	switch_hash_index_t *hi;
+	profile_t *profile;
+	uint32_t i;
+
+	for (hi = switch_core_hash_first(globals.profile_hash); hi; hi = switch_core_hash_next(&hi)) {
+		const void *key;
+		void *val;
+
+		switch_core_hash_this(hi, &key, NULL, &val);
+		profile = (profile_t *) val;
+
+		switch_queue_create(&profile->send_queue, SWITCH_CORE_QUEUE_LEN, globals.pool);
+		if (profile->batches) {
+			switch_queue_create(&profile->batch_queue, SWITCH_CORE_QUEUE_LEN, globals.pool);
+		}
+		profile->worker_threads = switch_core_alloc(globals.pool, sizeof(switch_thread_t *) * profile->workers);
+		for (i = 0; i < profile->workers; i++) {
+			launch_thread(&profile->worker_threads[i], profile_worker_run, profile);
+		}
+	}
+}
+
+/* Look up tokens and send, done (optional) is called when all parts of notification are sent */
+static void push_notify(switch_event_t *event, push_done_func_t done, void *done_data)
+{
+	char *payload = NULL, *user = NULL, *realm = NULL, *type = NULL, *uuid = NULL, *json_tokens = NULL;
+	profile_t *profile = NULL, *routed;
+	callback_t cbt = { cJSON_CreateArray() };
+	switch_bool_t res = SWITCH_FALSE;
+	int size, i, j, routes_count = 0;
+	push_job_group_t *group = NULL;
+	profile_t **routes = NULL;
+	cJSON **route_tokens = NULL, *iterator;
+	switch_time_t lookup_us = 0;
+
+	payload = switch_event_get_body(event);
+	type = switch_event_get_header(event, "type");
+	user = switch_event_get_header(event, "user");
+	realm = switch_event_get_header(event, "realm");
+	uuid = switch_event_get_header(event, "uuid");
+
+	if (zstr(type) || zstr(user) || zstr(realm)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. No parameters, data: '%s', type: '%s', user: '%s', realm: '%s'\n", payload, type, user, realm);
+		goto end;
+	}
+
+	if (!(profile = switch_core_hash_find(globals.profile_hash, type)) && !globals.route_hash) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Profile '%s' not found\n", type);
+		goto end;
+	}
+
+	/*Event waited in queue longer than caller*/
+	if (push_deadline_left(event) == 0) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "CARUSTO. Drop push to %s@%s, deadline expired before send\n", user, realm);
+		goto end;
+	}
+
+	if (!zstr(payload)) {
+		switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "payload", payload);
+	}
+
+	db_get_tokens_array(user, realm, type, &cbt);
+	lookup_us = switch_time_ref();
+
+	if ((size = cJSON_GetArraySize(cbt.array)) == 0) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. No one token found for type: '%s', user: '%s', realm: '%s'\n", type, user, realm);
+		goto end;
+	}
+
+	switch_zmalloc(group, sizeof(*group));
+	group->refs = 1;
+	group->uuid = zstr(uuid) ? NULL : strdup(uuid);
+	group->lookup_us = lookup_us;
+	group->done = done;
+	group->done_data = done_data;
+	/*Fastest waking devices first*/
+	group->wake_deadline = wake_order_tokens(&cbt);
+
+	/*Split tokens by routed profile, keeping order*/
+	switch_zmalloc(routes, sizeof(profile_t *) * size);
+	switch_zmalloc(route_tokens, sizeof(cJSON *) * size);
+	cJSON_ArrayForEach(iterator, cbt.array) {
+		if (!(routed = push_route(type, cJSON_GetObjectCstr(iterator, "app_id"), cJSON_GetObjectCstr(iterator, "platform"), realm))) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. No profile for token '%s' of %s@%s\n",
+							  switch_str_nil(cJSON_GetObjectCstr(iterator, "token")), user, realm);
+			continue;
+		}
+		for (j = 0; j < routes_count && routes[j] != routed; j++);
+		if (j == routes_count) {
+			routes[routes_count] = routed;
+			route_tokens[routes_count++] = cJSON_CreateArray();
+		}
+		cJSON_AddItemToArray(route_tokens[j], cJSON_Duplicate(iterator, 1));
+	}
+
+	for (i = 0; i < routes_count; i++) {
+		/*Fan-out nobody waits for goes to relay in batches*/
+		if (routes[i]->batch_template && zstr(uuid)) {
+			push_batch_add(routes[i], group, event, payload, user, realm, route_tokens[i]);
+			cJSON_Delete(route_tokens[i]);
+		} else {
+			push_job_submit(group, routes[i], event, route_tokens[i]);
+		}
+	}
+
+end:
+	/*Group fires response when its last job or batch is done*/
+	if (group) {
+		push_job_group_release(&group, res);
+	} else {
+		push_fire_response(uuid, res, 0, lookup_us, 0);
+		if (done) {
+			done(PUSH_DONE_NOTHING, done_data);
+		}
+	}
+
+	switch_safe_free(routes);
+	switch_safe_free(route_tokens);
+	switch_safe_free(json_tokens);
+
+	if (cbt.array) {
+		cJSON_Delete(cbt.array);
+	}
+}
+
+/* Pending im push: appended to journal before send, done record is written after send */
+struct outbox_item_obj {
+	uint64_t id;
+	uint32_t segment;
+	uint32_t attempts;
+	switch_time_t next_at;
+	enum push_done_status status;
+	char *json;
+	struct outbox_item_obj *next;
+};
+typedef struct outbox_item_obj outbox_item_t;
+
+/* Journal file, removed when all its pushes are done */
+struct outbox_segment_obj {
+	uint32_t seq;
+	uint32_t live;
+	struct outbox_segment_obj *next;
+};
+typedef struct outbox_segment_obj outbox_segment_t;
+
+static void outbox_item_free(outbox_item_t **item_p)
+{
+	outbox_item_t *item = *item_p;
+
+	*item_p = NULL;
+	if (item) {
+		switch_safe_free(item->json);
+		free(item);
+	}
+}
+
+static char *outbox_segment_path(uint32_t seq)
+{
+	return switch_mprintf("%s%soutbox-%010u.log", globals.outbox_dir, SWITCH_PATH_SEPARATOR, seq);
+}
+
+static outbox_segment_t *outbox_segment_find(uint32_t seq)
+{
+	outbox_segment_t *segment;
+
+	for (segment = globals.outbox_segments; segment && segment->seq != seq; segment = segment->next);
+
+	return segment;
+}
+
+/* Only writer thread touches segments */
+static switch_bool_t outbox_segment_open(uint32_t seq)
+{
+	outbox_segment_t *segment, **tail;
+	char *path = outbox_segment_path(seq);
+
+	if (globals.outbox_fd >= 0) {
+		close(globals.outbox_fd);
+	}
+
+	if ((globals.outbox_fd = open(path, O_CREAT | O_APPEND | O_WRONLY, 0640)) < 0) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Can't open outbox segment %s: %s\n", path, strerror(errno));
+		switch_safe_free(path);
+		return SWITCH_FALSE;
+	}
+	switch_safe_free(path);
+
+	switch_zmalloc(segment, sizeof(*segment));
+	segment->seq = seq;
+	for (tail = &globals.outbox_segments; *tail; tail = &(*tail)->next);
+	*tail = segment;
+	globals.outbox_seq = seq;
+	globals.outbox_seq_size = 0;
+
+	return SWITCH_TRUE;
+}
+
+/* Remove closed segments without pending pushes */
+static void outbox_segment_gc(void)
+{
+	outbox_segment_t **segment_p = &globals.outbox_segments, *segment;
+	char *path;
+
+	while ((segment = *segment_p)) {
+		if (!segment->live && segment->seq != globals.outbox_seq) {
+			path = outbox_segment_path(segment->seq);
+			unlink(path);
+			switch_safe_free(path);
+			*segment_p = segment->next;
+			free(segment);
+		} else {
+			segment_p = &segment->next;
+		}
+	}
+}
+
+static void outbox_buffer_append(char **buf, switch_size_t *len, switch_size_t *size, const char *data, switch_size_t data_len)
+{
+	if (*len + data_len + 1 > *size) {
+		*size = (*len + data_len + 1) * 2;
+		*buf = realloc(*buf, *size);
+	}
+	memcpy(*buf + *len, data, data_len);
+	*len += data_len;
+}
+
+/* Group commit: records of all new and finished pushes go with one write and one fsync */
+static void outbox_commit(outbox_item_t *added, outbox_item_t *finished)
+{
+	char *buf = NULL, line[64];
+	switch_size_t len = 0, size = 0, written = 0;
+	ssize_t n;
+	outbox_item_t *item, *next;
+	outbox_segment_t *segment;
+
+	for (item = added; item; item = item->next) {
+		switch_snprintf(line, sizeof(line), "A %" SWITCH_UINT64_T_FMT " ", item->id);
+		outbox_buffer_append(&buf, &len, &size, line, strlen(line));
+		outbox_buffer_append(&buf, &len, &size, item->json, strlen(item->json));
+		outbox_buffer_append(&buf, &len, &size, "\n", 1);
+	}
+	for (item = finished; item; item = item->next) {
+		switch_snprintf(line, sizeof(line), "D %" SWITCH_UINT64_T_FMT "\n", item->id);
+		outbox_buffer_append(&buf, &len, &size, line, strlen(line));
+	}
+
+	if (len && globals.outbox_fd >= 0) {
+		while (written < len && (n = write(globals.outbox_fd, buf + written, len - written)) > 0) {
+			written += n;
+		}
+		if (written < len || fsync(globals.outbox_fd)) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Can't write outbox segment %u: %s\n", globals.outbox_seq, strerror(errno));
+		}
+		globals.outbox_seq_size += len;
+	}
+	switch_safe_free(buf);
+
+	segment = outbox_segment_find(globals.outbox_seq);
+	for (item = added; item; item = item->next) {
+		item->segment = globals.outbox_seq;
+		if (segment) {
+			segment->live++;
+		}
+		globals.outbox_live++;
+	}
+	for (item = finished; item; item = next) {
+		next = item->next;
+		if ((segment = outbox_segment_find(item->segment)) && segment->live) {
+			segment->live--;
+		}
+		globals.outbox_live--;
+		outbox_item_free(&item);
+	}
+
+	if (globals.outbox_seq_size >= globals.outbox_segment_size) {
+		outbox_segment_open(globals.outbox_seq + 1);
+	}
+	outbox_segment_gc();
+}
+
+static void outbox_inflight_add(int delta)
+{
+	switch_mutex_lock(globals.outbox_mutex);
+	globals.outbox_inflight += delta;
+	switch_mutex_unlock(globals.outbox_mutex);
+}
+
+static uint32_t outbox_inflight_get(void)
+{
+	uint32_t inflight;
+
+	switch_mutex_lock(globals.outbox_mutex);
+	inflight = globals.outbox_inflight;
+	switch_mutex_unlock(globals.outbox_mutex);
+
+	return inflight;
+}
+
+/* Called by whoever sent the last part of notification */
+static void outbox_push_done(enum push_done_status status, void *data)
+{
+	outbox_item_t *item = (outbox_item_t *) data;
+
+	item->status = status;
+	switch_queue_push(globals.outbox_done, item);
+	outbox_inflight_add(-1);
+}
+
+static void *SWITCH_THREAD_FUNC outbox_writer_run(switch_thread_t *thread, void *obj)
+{
+	outbox_item_t *added, **added_tail, *finished, *retry = NULL, *item, **item_p;
+	void *pop = NULL;
+	switch_time_t now;
+
+	/*After sender, wait for pushes still in workers and batches till drain deadline*/
+	while (!globals.outbox_sender_done || switch_queue_size(globals.outbox_in) || switch_queue_size(globals.outbox_done) ||
+		   (outbox_inflight_get() && switch_time_ref() < globals.outbox_drain_deadline)) {
+		added = NULL;
+		added_tail = &added;
+		finished = NULL;
+
+		/*Wait for first push, take everything what came within commit interval*/
+		if (switch_queue_pop_timeout(globals.outbox_in, &pop, globals.outbox_commit_interval * 1000) == SWITCH_STATUS_SUCCESS && pop) {
+			do {
+				item = (outbox_item_t *) pop;
+				*added_tail = item;
+				added_tail = &item->next;
+			} while (switch_queue_trypop(globals.outbox_in, &pop) == SWITCH_STATUS_SUCCESS && pop);
+		}
+
+		while (switch_queue_trypop(globals.outbox_done, &pop) == SWITCH_STATUS_SUCCESS && pop) {
+			item = (outbox_item_t *) pop;
+			/*Gateway is down, keep push and try later (on next start when stopping)*/
+			if (item->status == PUSH_DONE_FAILED && item->attempts < globals.outbox_max_attempts && globals.outbox_stopping) {
+				outbox_item_free(&item);
+			} else if (item->status == PUSH_DONE_FAILED && item->attempts < globals.outbox_max_attempts) {
+				item->next_at = switch_time_ref() + (switch_time_t) globals.outbox_retry_interval * 1000000;
+				item->next = retry;
+				retry = item;
+				globals.outbox_retrying++;
+			} else {
+				if (item->status == PUSH_DONE_FAILED) {
+					switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "CARUSTO. Drop im push %" SWITCH_UINT64_T_FMT " after %u attempts\n",
+									  item->id, item->attempts);
+				}
+				item->next = finished;
+				finished = item;
+			}
+		}
+
+		if (added || finished) {
+			outbox_commit(added, finished);
+		}
+
+		for (item = added; item; item = added) {
+			added = item->next;
+			item->next = NULL;
+			switch_queue_push(globals.outbox_send, item);
+		}
+
+		now = switch_time_ref();
+		for (item_p = &retry; !globals.outbox_stopping && (item = *item_p);) {
+			if (item->next_at <= now) {
+				*item_p = item->next;
+				item->next = NULL;
+				globals.outbox_retrying--;
+				outbox_inflight_add(1);
+				switch_queue_push(globals.outbox_send, item);
+			} else {
+				item_p = &item->next;
+			}
+		}
+	}
+
+	/*Pushes waiting for retry stay in journal till next start*/
+	while ((item = retry)) {
+		retry = item->next;
+		outbox_item_free(&item);
+	}
+
+	if (globals.outbox_fd >= 0) {
+		close(globals.outbox_fd);
+		globals.outbox_fd = -1;
+	}
+
+	return NULL;
+}
+
+static void *SWITCH_THREAD_FUNC outbox_sender_run(switch_thread_t *thread, void *obj)
+{
+	void *pop = NULL;
+	outbox_item_t *item;
+	switch_event_t *event = NULL;
+
+	while (!globals.outbox_stopping || (switch_time_ref() < globals.outbox_drain_deadline && outbox_inflight_get())) {
+		if (switch_queue_pop_timeout(globals.outbox_send, &pop, 100000) != SWITCH_STATUS_SUCCESS || !pop) {
+			continue;
+		}
+
+		item = (outbox_item_t *) pop;
+		item->attempts++;
+		if (switch_event_create_json(&event, item->json) != SWITCH_STATUS_SUCCESS) {
+			outbox_push_done(PUSH_DONE_NOTHING, item);
+			continue;
+		}
+		push_notify(event, outbox_push_done, item);
+		switch_event_destroy(&event);
+	}
+
+	if (outbox_inflight_get()) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "CARUSTO. Outbox drain timeout, %u im push(es) are left for next start\n",
+						  outbox_inflight_get());
+	}
+	globals.outbox_sender_done = SWITCH_TRUE;
+
+	return NULL;
+}
+
+/* im push is journaled and sent by outbox, voip is worthless after the call and stays in memory */
+static switch_bool_t outbox_append(switch_event_t *event)
+{
+	const char *type = switch_event_get_header(event, "type");
+	outbox_item_t *item;
+	cJSON *json = NULL;
+
+	if (!globals.outbox_in || globals.outbox_stopping || zstr(type) || strcasecmp(type, "im")) {
+		return SWITCH_FALSE;
+	}
+
+	if (switch_event_serialize_json_obj(event, &json) != SWITCH_STATUS_SUCCESS) {
+		return SWITCH_FALSE;
+	}
+
+	switch_zmalloc(item, sizeof(*item));
+	item->json = cJSON_PrintUnformatted(json);
+	cJSON_Delete(json);
+
+	switch_mutex_lock(globals.outbox_mutex);
+	item->id = globals.outbox_next_id++;
+	globals.outbox_inflight++;
+	switch_mutex_unlock(globals.outbox_mutex);
+
+	if (!item->json || switch_queue_trypush(globals.outbox_in, item) != SWITCH_STATUS_SUCCESS) {
+		outbox_inflight_add(-1);
+		outbox_item_free(&item);
+		return SWITCH_FALSE;
+	}
+
+	return SWITCH_TRUE;
+}
+
+static int outbox_seq_cmp(const void *a, const void *b)
+{
+	uint32_t sa = *(const uint32_t *) a, sb = *(const uint32_t *) b;
+
+	return sa < sb ? -1 : sa > sb;
+}
+
+/* Replay journal: pushes without done record are written to new segment and sent again */
+static void outbox_recover(void)
+{
+	switch_dir_t *dir = NULL;
+	char name[256], *path, *line = NULL, *json, *p;
+	const char *file;
+	uint32_t *seqs = NULL, count = 0, size = 0, seq, i;
+	size_t line_size = 0;
+	ssize_t line_len;
+	switch_hash_t *pending = NULL;
+	switch_hash_index_t *hi;
+	outbox_item_t *item, *recovered = NULL, **tail = &recovered;
+	uint64_t id;
+	FILE *fp;
+
+	if (switch_dir_open(&dir, globals.outbox_dir, globals.pool) != SWITCH_STATUS_SUCCESS) {
+		return;
+	}
+	while ((file = switch_dir_next_file(dir, name, sizeof(name)))) {
+		if (sscanf(file, "outbox-%u.log", &seq) == 1) {
+			if (count == size) {
+				size = size ? size * 2 : 16;
+				seqs = realloc(seqs, sizeof(*seqs) * size);
+			}
+			seqs[count++] = seq;
+		}
+	}
+	switch_dir_close(dir);
+
+	if (!count) {
+		return;
+	}
+	qsort(seqs, count, sizeof(*seqs), outbox_seq_cmp);
+
+	switch_core_hash_init(&pending);
+	for (i = 0; i < count; i++) {
+		path = outbox_segment_path(seqs[i]);
+		if ((fp = fopen(path, "r"))) {
+			while ((line_len = getline(&line, &line_size, fp)) > 0) {
+				if (line[line_len - 1] == '\n') {
+					line[line_len - 1] = '\0';
+				}
+				/*Torn tail of segment is skipped*/
+				if (strlen(line) < 3 || line[1] != ' ' || !(id = strtoull(line + 2, &p, 10))) {
+					continue;
+				}
+				switch_snprintf(name, sizeof(name), "%" SWITCH_UINT64_T_FMT, id);
+				if (id >= globals.outbox_next_id) {
+					globals.outbox_next_id = id + 1;
+				}
+				if (line[0] == 'A' && *p == ' ' && (json = p + 1) && *json == '{') {
+					switch_zmalloc(item, sizeof(*item));
+					item->id = id;
+					item->json = strdup(json);
+					if (switch_core_hash_find(pending, name)) {
+						outbox_item_free(&item);
+					} else {
+						switch_core_hash_insert(pending, name, item);
+					}
+				} else if (line[0] == 'D' && (item = switch_core_hash_delete(pending, name))) {
+					outbox_item_free(&item);
+				}
+			}
+			fclose(fp);
+		}
+		switch_safe_free(path);
+	}
+	switch_safe_free(line);
+
+	for (hi = switch_core_hash_first(pending); hi; hi = switch_core_hash_next(&hi)) {
+		const void *key;
+		void *val;
+
+		switch_core_hash_this(hi, &key, NULL, &val);
+		*tail = (outbox_item_t *) val;
+		tail = &(*tail)->next;
+	}
+	switch_core_hash_destroy(&pending);
+
+	/*Pending pushes move to new segment, old ones are removed*/
+	if (outbox_segment_open(seqs[count - 1] + 1)) {
+		outbox_commit(recovered, NULL);
+		for (i = 0; i < count; i++) {
+			path = outbox_segment_path(seqs[i]);
+			unlink(path);
+			switch_safe_free(path);
+		}
+	}
+
+	for (i = 0; (item = recovered); i++) {
+		recovered = item->next;
+		item->next = NULL;
+		outbox_inflight_add(1);
+		switch_queue_push(globals.outbox_send, item);
+	}
+	if (i) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "CARUSTO. Recovered %u im push(es) from outbox\n", i);
+	}
+
+	switch_safe_free(seqs);
+}
+
+static void outbox_start(void)
+{
+	if (!globals.outbox) {
+		return;
+	}
+
+	if (switch_dir_make_recursive(globals.outbox_dir, SWITCH_DEFAULT_DIR_PERMS, globals.pool) != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Can't create outbox dir %s, im pushes aren't journaled\n", globals.outbox_dir);
+		return;
+	}
+
+	globals.outbox_fd = -1;
+	globals.outbox_next_id = 1;
+	switch_mutex_init(&globals.outbox_mutex, SWITCH_MUTEX_NESTED, globals.pool);
+	switch_queue_create(&globals.outbox_send, SWITCH_CORE_QUEUE_LEN, globals.pool);
+	switch_queue_create(&globals.outbox_done, SWITCH_CORE_QUEUE_LEN, globals.pool);
+
+	outbox_recover();
+	if (globals.outbox_fd < 0 && !outbox_segment_open(globals.outbox_seq + 1)) {
+		return;
+	}
+
+	switch_queue_create(&globals.outbox_in, SWITCH_CORE_QUEUE_LEN, globals.pool);
+	launch_thread(&globals.outbox_writer_thread, outbox_writer_run, NULL);
+	launch_thread(&globals.outbox_sender_thread, outbox_sender_run, NULL);
+}
+
+/* Send what is queued until outbox_drain_timeout, the rest is recovered on next start */
+static void outbox_stop(void)
+{
+	if (!globals.outbox_writer_thread) {
+		return;
+	}
+
+	globals.outbox_drain_deadline = switch_time_ref() + (switch_time_t) globals.outbox_drain_timeout * 1000;
+	globals.outbox_stopping = SWITCH_TRUE;
+	join_thread(&globals.outbox_sender_thread);
+	join_thread(&globals.outbox_writer_thread);
+}
+
+static void outbox_dump(switch_stream_handle_t *stream)
+{
+	if (!globals.outbox_writer_thread) {
+		stream->write_function(stream, "outbox: disabled\n");
+		return;
+	}
+
+	stream->write_function(stream, "outbox: segment %u (%" SWITCH_SIZE_T_FMT " bytes), pending %u, retrying %u, queued %u, in flight %u\n",
+						   globals.outbox_seq, globals.outbox_seq_size, globals.outbox_live, globals.outbox_retrying,
+						   switch_queue_size(globals.outbox_send), outbox_inflight_get());
+}
+
+static void push_event_handler(switch_event_t *event)
+{
+	if (outbox_append(event)) {
+		return;
+	}
+
+	push_notify(event, NULL, NULL);
+}
+
+static char *get_url_from_contact(char *buf)
+{
+	char *url = NULL, *e;
+
+	switch_assert(buf);
+
+	while(*buf == ' ') {
+		buf++;
+	}
+
+	if (*buf == '"') {
+		buf++;
+		if((e = strchr(buf, '"'))) {
+			buf = e+1;
+		}
+	}
+
+	while(*buf == ' ') {
+		buf++;
+	}
+
+	url = strchr(buf, '<');
+
+	if (url && (e = switch_find_end_paren(url, '<', '>'))) {
+		url++;
+		url = strdup(url);
+		e = strchr(url, '>');
+		*e = '\0';
+	} else {
+		if (url) buf++;
+		url = strdup(buf);
+	}
+	return url;
+}
+
+static void waiters_inc(void)
+{
+	switch_mutex_lock(globals.waiters_mutex);
+	globals.waiters++;
+	switch_mutex_unlock(globals.waiters_mutex);
+}
+
+static void waiters_dec(void)
+{
+	switch_mutex_lock(globals.waiters_mutex);
+	if (globals.waiters) {
+		globals.waiters--;
+	}
+	switch_mutex_unlock(globals.waiters_mutex);
+}
+
+static uint32_t waiters_count(void)
+{
+	uint32_t count;
+
+	switch_mutex_lock(globals.waiters_mutex);
+	count = globals.waiters;
+	switch_mutex_unlock(globals.waiters_mutex);
+
+	return count;
+}
+
+static void wakeup_fire_local(const char *node, const char *username, const char *realm, const char *contact,
+							  const char *call_id, const char *profile_name)
+{
+	switch_event_t *event = NULL;
+
+	if (switch_event_create_subclass(&event, SWITCH_EVENT_CUSTOM, APN_WAKEUP_SUBCLASS) != SWITCH_STATUS_SUCCESS) {
+		return;
+	}
+
+	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "node", node);
+	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "username", username);
+	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "realm", realm);
+	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "contact", contact);
+	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "call-id", call_id);
+	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "profile-name", profile_name);
+	switch_event_fire(&event);
+}
+
+static char *wakeup_key(const char *user, const char *realm)
+{
+	char *key = switch_mprintf("%s@%s", switch_str_nil(user), switch_str_nil(realm)), *p;
+
+	for (p = key; *p; p++) {
+		*p = (char) switch_tolower(*p);
+	}
+
+	return key;
+}
+
+static void wakeup_bus_publish(switch_event_t *event)
+{
+	if (globals.wakeup_bus && globals.wakeup_bus->publish) {
+		globals.wakeup_bus->publish(event);
+	}
+}
+
+static void wakeup_bus_watch(const char *id, const char *user, const char *realm, uint32_t timelimit)
+{
+	if (globals.wakeup_bus && globals.wakeup_bus->watch) {
+		globals.wakeup_bus->watch(id, user, realm, timelimit);
+	}
+}
+
+static void wakeup_bus_unwatch(const char *id)
+{
+	if (globals.wakeup_bus && globals.wakeup_bus->unwatch) {
+		globals.wakeup_bus->unwatch(id);
+	}
+}
+
+/* loopback: deliver to own node, useful for tests of waiter logic without cluster.
+ * Waiters don't listen sofia::register then, so each REGISTER reaches them once, via the bus */
+static void wakeup_loopback_publish(switch_event_t *event)
+{
+	if (!waiters_count()) {
+		return;
+	}
+
+	wakeup_fire_local("loopback",
+					  switch_event_get_header(event, "username"),
+					  switch_event_get_header(event, "realm"),
+					  switch_event_get_header(event, "contact"),
+					  switch_event_get_header(event, "call-id"),
+					  switch_event_get_header(event, "profile-name"));
+}
+
+/* db: waiters are announced in push_waiters, REGISTER of waited user@realm goes to shared push_wakeups table,
+ * which is polled by nodes with active waiters */
+static void wakeup_db_publish(switch_event_t *event)
+{
+	char *sql = NULL, *contact = NULL, *key = NULL;
+	const char *event_contact = switch_event_get_header(event, "contact");
+	void *waited = NULL;
+
+	if (zstr(event_contact)) {
+		return;
+	}
+
+	/*Nobody else waits for this device, nothing to write*/
+	key = wakeup_key(switch_event_get_header(event, "username"), switch_event_get_header(event, "realm"));
+	switch_mutex_lock(globals.wakeup_remote_mutex);
+	if (globals.wakeup_remote) {
+		waited = switch_core_hash_find(globals.wakeup_remote, key);
+	}
+	switch_mutex_unlock(globals.wakeup_remote_mutex);
+	switch_safe_free(key);
+
+	if (!waited) {
+		return;
+	}
+
+	/*Route remote INVITE via this node, device connection (NAT/TCP) is here*/
+	if (!zstr(globals.wakeup_bus_route)) {
+		char *url = get_url_from_contact((char *) event_contact);
+		char *path = switch_mprintf("<%s>", globals.wakeup_bus_route);
+		char path_encoded[512] = "";
+
+		switch_url_encode(path, path_encoded, sizeof(path_encoded));
+		contact = switch_mprintf("<%s;fs_path=%s>", url, path_encoded);
+		switch_safe_free(path);
+		switch_safe_free(url);
+	}
+
+	sql = switch_mprintf("INSERT INTO push_wakeups (node, username, realm, contact, call_id, profile_name, created_ms) "
+						 "VALUES ('%q', '%q', '%q', '%q', '%q', '%q', %" SWITCH_TIME_T_FMT ")",
+						 globals.wakeup_bus_node,
+						 switch_str_nil(switch_event_get_header(event, "username")),
+						 switch_str_nil(switch_event_get_header(event, "realm")),
+						 contact ? contact : event_contact,
+						 switch_str_nil(switch_event_get_header(event, "call-id")),
+						 switch_str_nil(switch_event_get_header(event, "profile-name")),
+						 switch_micro_time_now() / 1000);
+	execute_sql_now(&sql);
+	switch_safe_free(sql);
+	switch_safe_free(contact);
+}
+
+static void wakeup_db_watch(const char *id, const char *user, const char *realm, uint32_t timelimit)
+{
+	char *sql = switch_mprintf("INSERT INTO push_waiters (node, waiter_id, username, realm, expires_ms) VALUES ('%q', '%q', '%q', '%q', %" SWITCH_TIME_T_FMT ")",
+							   globals.wakeup_bus_node, id, user, realm, switch_micro_time_now() / 1000 + (switch_time_t) timelimit * 1000);
+
+	/*Don't hold the call for it*/
+	switch_sql_queue_manager_push(globals.qm, sql, 0, SWITCH_TRUE);
+	switch_safe_free(sql);
+}
+
+static void wakeup_db_unwatch(const char *id)
+{
+	char *sql = switch_mprintf("DELETE FROM push_waiters WHERE node = '%q' AND waiter_id = '%q'", globals.wakeup_bus_node, id);
+
+	switch_sql_queue_manager_push(globals.qm, sql, 0, SWITCH_TRUE);
+	switch_safe_free(sql);
+}
+
+static int wakeup_remote_callback(void *pArg, int argc, char **argv, char **columnNames)
+{
+	switch_hash_t *remote = (switch_hash_t *) pArg;
+	char *key;
+
+	if (argc < 2 || zstr(argv[0]) || zstr(argv[1])) {
+		return 0;
+	}
+
+	key = wakeup_key(argv[0], argv[1]);
+	switch_core_hash_insert(remote, key, (void *) 1);
+	switch_safe_free(key);
+
+	return 0;
+}
+
+/* Reload set of user@realm waited on other nodes */
+static void wakeup_remote_refresh(switch_time_t now_ms)
+{
+	switch_hash_t *remote = NULL, *old = NULL;
+	char *sql;
+
+	switch_core_hash_init(&remote);
+	sql = switch_mprintf("SELECT username, realm FROM push_waiters WHERE node <> '%q' AND expires_ms >= %" SWITCH_TIME_T_FMT,
+						 globals.wakeup_bus_node, now_ms);
+	mod_apn_execute_sql_callback(sql, wakeup_remote_callback, remote);
+	switch_safe_free(sql);
+
+	switch_mutex_lock(globals.wakeup_remote_mutex);
+	old = globals.wakeup_remote;
+	globals.wakeup_remote = remote;
+	switch_mutex_unlock(globals.wakeup_remote_mutex);
+
+	if (old) {
+		switch_core_hash_destroy(&old);
+	}
+}
+
+struct wakeup_poll_obj {
+	switch_hash_t *seen;
+	switch_time_t now_ms;
+};
+typedef struct wakeup_poll_obj wakeup_poll_t;
+
+static int wakeup_db_poll_callback(void *pArg, int argc, char **argv, char **columnNames)
+{
+	wakeup_poll_t *poll = (wakeup_poll_t *) pArg;
+	char *key = NULL;
+
+	if (argc < 7 || zstr(argv[0]) || zstr(argv[5])) {
+		return 0;
+	}
+
+	/*Rows are read with overlap, skip already delivered*/
+	key = switch_mprintf("%s/%s/%s", argv[0], argv[5], argv[6]);
+	if (!switch_core_hash_find(poll->seen, key)) {
+		switch_core_hash_insert(poll->seen, key, (void *)(intptr_t) poll->now_ms);
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. Wake up of %s@%s from node %s\n", argv[1], argv[2], argv[0]);
+		wakeup_fire_local(argv[0], argv[1], argv[2], argv[3], argv[5], argv[4]);
+	}
+	switch_safe_free(key);
+
+	return 0;
+}
+
+static void *SWITCH_THREAD_FUNC wakeup_db_thread_run(switch_thread_t *thread, void *obj)
+{
+	wakeup_poll_t poll = { 0 };
+	switch_time_t from_ms = 0, gc_ms = 0;
+	const switch_time_t overlap_ms = 2000, keep_ms = 60000;
+
+	switch_core_hash_init(&poll.seen);
+
+	while (globals.running) {
+		switch_yield(globals.wakeup_bus_poll_interval * 1000);
+		poll.now_ms = switch_micro_time_now() / 1000;
+
+		/*Small table of active waiters, read by every node*/
+		wakeup_remote_refresh(poll.now_ms);
+
+		if (!waiters_count()) {
+			from_ms = 0;
+		} else {
+			char *sql;
+
+			if (!from_ms) {
+				from_ms = poll.now_ms - overlap_ms;
+			}
+
+			sql = switch_mprintf("SELECT node, username, realm, contact, profile_name, call_id, created_ms FROM push_wakeups "
+								 "WHERE created_ms >= %" SWITCH_TIME_T_FMT " AND node <> '%q'", from_ms, globals.wakeup_bus_node);
+			mod_apn_execute_sql_callback(sql, wakeup_db_poll_callback, &poll);
+			switch_safe_free(sql);
+
+			/*Tolerate clock skew and queue manager delay on other nodes*/
+			from_ms = poll.now_ms - overlap_ms;
+		}
+
+		if (poll.now_ms - gc_ms > keep_ms) {
+			switch_hash_index_t *hi;
+			char *sql;
+
+			gc_ms = poll.now_ms;
+
+			for (hi = switch_core_hash_first(poll.seen); hi;) {
+				const void *key;
+				void *val;
+
+				switch_core_hash_this(hi, &key, NULL, &val);
+				hi = switch_core_hash_next(&hi);
+				if (poll.now_ms - (switch_time_t)(intptr_t) val > overlap_ms * 2) {
+					switch_core_hash_delete(poll.seen, (const char *) key);
+				}
+			}
+
+			sql = switch_mprintf("DELETE FROM push_wakeups WHERE node = '%q' AND created_ms < %" SWITCH_TIME_T_FMT,
+								 globals.wakeup_bus_node, poll.now_ms - keep_ms);
+			execute_sql_now(&sql);
+			switch_safe_free(sql);
+
+			/*Waiters left by restart or crash of this node*/
+			sql = switch_mprintf("DELETE FROM push_waiters WHERE node = '%q' AND expires_ms < %" SWITCH_TIME_T_FMT,
+								 globals.wakeup_bus_node, poll.now_ms);
+			execute_sql_now(&sql);
+			switch_safe_free(sql);
+		}
+	}
+
+	switch_core_hash_destroy(&poll.seen);
+
+	switch_mutex_lock(globals.wakeup_remote_mutex);
+	if (globals.wakeup_remote) {
+		switch_core_hash_destroy(&globals.wakeup_remote);
+	}
+	switch_mutex_unlock(globals.wakeup_remote_mutex);
+
+	return NULL;
+}
+
+static switch_status_t wakeup_db_start(void)
+{
+	launch_thread(&globals.wakeup_bus_thread, wakeup_db_thread_run, NULL);
+	return SWITCH_STATUS_SUCCESS;
+}
+
+static void wakeup_db_stop(void)
+{
+	join_thread(&globals.wakeup_bus_thread);
+}
+
+static wakeup_bus_t wakeup_bus_backends[] = {
+	{ "loopback", NULL, wakeup_loopback_publish, NULL, NULL, NULL },
+	{ "db", wakeup_db_start, wakeup_db_publish, wakeup_db_stop, wakeup_db_watch, wakeup_db_unwatch },
+	{ NULL, NULL, NULL, NULL, NULL, NULL }
+};
+
+static wakeup_bus_t *wakeup_bus_find(const char *name)
+{
+	wakeup_bus_t *bus;
+
+	for (bus = wakeup_bus_backends; bus->name; bus++) {
+		if (!strcasecmp(bus->name, name)) {
+			return bus;
+		}
+	}
+
+	return NULL;
+}
+
+static void originate_register_event_handler(switch_event_t *event)
+{
+	char *dest = NULL;
+	originate_register_t *originate_data = (struct originate_register_data *)event->bind_user_data;
+	char *event_username = NULL, *event_realm = NULL, *event_call_id = NULL, *event_contact = NULL, *event_profile = NULL;
+	char *destination = NULL, *leg = NULL;
+	const char *domain_name = NULL, *dial_user = NULL, *update_reg = NULL, *node = NULL;
+	uint32_t timelimit_sec = 0;
+
+	switch_memory_pool_t *pool;
+	switch_mutex_t *handles_mutex;
+
+	if (!originate_data) {
+		return;
+	}
+
+	pool = originate_data->pool;
+	handles_mutex = originate_data->mutex;
+	domain_name = originate_data->realm;
+	dial_user = originate_data->user;
+
+	update_reg = switch_event_get_header(event, "update-reg");
+	if (!zstr(update_reg) && switch_true(update_reg)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. Update existing registration, skip originate\n");
+		return;
+	}
+
+	/*Own REGISTERs come as sofia::register already*/
+	if (!zstr(globals.wakeup_bus_node) && !zstr(node = switch_event_get_header(event, "node")) && !strcmp(node, globals.wakeup_bus_node)) {
+		return;
+	}
+
+	event_username = switch_event_get_header(event, "username");
+	event_realm = switch_event_get_header(event, "realm");
+	event_call_id = switch_event_get_header(event, "call-id");
+	event_contact = switch_event_get_header(event, "contact");
+	event_profile = switch_event_get_header(event, "profile-name");
+
+	if (zstr(event_username) || zstr(event_realm) || zstr(event_call_id) || zstr(event_profile) ||  zstr(event_contact) || zstr(domain_name) || zstr(dial_user)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. No parameter for originate call via sofia::register\n");
+		return;
+	}
+
+	if (strcasecmp(event_realm, domain_name) || strcasecmp(event_username, dial_user)) {
+		return;
+	}
+
+	dest = get_url_from_contact(event_contact);
+
+	if (zstr(dest)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. No destination contact data string\n");
+		goto end;
+	}
+
+	timelimit_sec = *originate_data->timelimit;
+
+	leg = switch_mprintf("[registration_token=%s,originate_timeout=%u]sofia/%s/%s", event_call_id, timelimit_sec, event_profile, dest);
+
+	switch_mutex_lock(handles_mutex);
+	/*The same registration could be refreshed within the window*/
+	if (originate_data->legs && strstr(originate_data->legs, leg)) {
+		switch_mutex_unlock(handles_mutex);
+		goto end;
+	}
+
+	originate_data->legs = originate_data->legs ? switch_core_sprintf(pool, "%s,%s", originate_data->legs, leg) : switch_core_strdup(pool, leg);
+	originate_data->legs_count++;
+	originate_data->contact = originate_data->contact ? switch_core_sprintf(pool, "%s,%s", originate_data->contact, event_contact)
+													  : switch_core_strdup(pool, event_contact);
+	if (!originate_data->register_us) {
+		originate_data->register_us = switch_time_ref();
+	}
+
+	destination = switch_mprintf("%s:_:[originate_timeout=%u,enable_send_apn=false,apn_wait_any_register=%s]apn_wait/%s@%s",
+								 originate_data->legs,
+								 timelimit_sec,
+								 originate_data->wait_any_register == SWITCH_TRUE ? "true" : "false",
+								 event_username,
+								 event_realm);
+	originate_data->destination = switch_core_strdup(pool, destination);
+	switch_mutex_unlock(handles_mutex);
+
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. Try originate to '%s' (by registration event)\n", destination);
+
+end:
+	switch_safe_free(leg);
+	switch_safe_free(destination);
+	switch_safe_free(dest);
+}
+
+/* Device registered directly a moment ago, so sofia contact leg of the call will ring it */
+static void register_fresh_touch(const char *user, const char *realm, const char *token, uint32_t expires)
+{
+	switch_hash_index_t *hi;
+	time_t now = switch_epoch_time_now(NULL), *until;
+	char *key;
+
+	if (!globals.fresh_register_window || !globals.fresh_hash) {
+		return;
+	}
+
+	key = switch_mprintf("%s@%s/%s", user, realm, token);
+
+	switch_mutex_lock(globals.fresh_mutex);
+	if (!(until = switch_core_hash_find(globals.fresh_hash, key))) {
+		switch_zmalloc(until, sizeof(*until));
+		switch_core_hash_insert(globals.fresh_hash, key, until);
+	}
+	*until = now + (expires && expires < globals.fresh_register_window ? expires : globals.fresh_register_window);
+
+	/*Drop stale entries once per window*/
+	if (now >= globals.fresh_sweep_at) {
+		for (hi = switch_core_hash_first(globals.fresh_hash); hi;) {
+			const void *hkey;
+			void *val;
+
+			switch_core_hash_this(hi, &hkey, NULL, &val);
+			hi = switch_core_hash_next(&hi);
+			if (*(time_t *) val <= now) {
+				switch_core_hash_delete(globals.fresh_hash, (const char *) hkey);
+				free(val);
+			}
+		}
+		globals.fresh_sweep_at = now + globals.fresh_register_window;
+	}
+	switch_mutex_unlock(globals.fresh_mutex);
+
+	switch_safe_free(key);
+}
+
+/* SWITCH_TRUE when every voip token of user has fresh registration */
+static switch_bool_t register_fresh_all(const char *user, const char *realm)
+{
+	callback_t cbt = { cJSON_CreateArray() };
+	switch_bool_t ret = SWITCH_FALSE;
+	time_t now = switch_epoch_time_now(NULL), *until;
+	cJSON *item;
+	char *key;
+
+	if (!globals.fresh_register_window || !globals.fresh_hash) {
+		goto end;
+	}
+
+	db_get_tokens_array((char *) user, (char *) realm, "voip", &cbt);
+
+	switch_mutex_lock(globals.fresh_mutex);
+	cJSON_ArrayForEach(item, cbt.array) {
+		key = switch_mprintf("%s@%s/%s", user, realm, cJSON_GetObjectCstr(item, "token"));
+		until = switch_core_hash_find(globals.fresh_hash, key);
+		switch_safe_free(key);
+		if (!until || *until <= now) {
+			ret = SWITCH_FALSE;
+			break;
+		}
+		ret = SWITCH_TRUE;
+	}
+	switch_mutex_unlock(globals.fresh_mutex);
+
+end:
+	cJSON_Delete(cbt.array);
+
+	return ret;
+}
+
+static void register_fresh_destroy(void)
+{
+	switch_hash_index_t *hi;
+	const void *key;
+	void *val;
+
+	if (!globals.fresh_hash) {
+		return;
+	}
+
+	while ((hi = switch_core_hash_first(globals.fresh_hash))) {
+		switch_core_hash_this(hi, &key, NULL, &val);
+		switch_core_hash_delete(globals.fresh_hash, (const char *) key);
+		free(val);
+	}
+	switch_core_hash_destroy(&globals.fresh_hash);
+}
+
+static void register_fresh_dump(switch_stream_handle_t *stream)
+{
+	if (!globals.fresh_hash) {
+		return;
+	}
+
+	switch_mutex_lock(globals.fresh_mutex);
+	stream->write_function(stream, "fresh registrations: window %u sec, delay %u ms, deferred %" SWITCH_UINT64_T_FMT
+						   ", suppressed %" SWITCH_UINT64_T_FMT "\n", globals.fresh_register_window, globals.fresh_register_delay,
+						   globals.fresh_deferred, globals.fresh_suppressed);
+	switch_mutex_unlock(globals.fresh_mutex);
+}
+
+static void register_store_token(const char *token, const char *user, const char *realm, const char *app_id, const char *type, const char *platform)
+{
+	enum register_op op;
+
+	if (globals.fingerprints) {
+		enum fingerprint_state state = fingerprint_check(type, token, user, realm, app_id, platform);
+
+		/*Periodic refresh with the same token, nothing to write*/
+		if (state == FINGERPRINT_SAME) {
+			return;
+		}
+		op = state == FINGERPRINT_TOUCH ? REGISTER_TOUCH : REGISTER_UPSERT;
+	} else {
+		op = token_store_has(user, realm, type, token, app_id, platform) ? REGISTER_TOUCH : REGISTER_UPSERT;
+	}
+
+	token_store_put(user, realm, type, token, app_id, platform);
+
+	if (!register_enqueue(op, token, user, realm, app_id, type, platform)) {
+		const char *args[] = { token, user, realm, app_id, type, platform };
+		apn_token_refs_t refs;
+
+		/*Queue is full or not started yet*/
+		if (apn_token_refs_resolve(&refs, args)) {
+			apn_stmt_exec(APN_STMT_UPSERT_TOKEN, refs.args, NULL, NULL);
+		}
+	}
+}
+
+static void register_event_handler(switch_event_t *event)
+{
+	char *event_user = NULL, *event_realm = NULL, *event_contact = NULL;
+	char *contact_ptr = NULL, *voip_token = NULL, *im_token = NULL, *platform = NULL, *foo = NULL, *app_id = NULL;
+	char *update_reg = NULL;
+
+	update_reg = switch_event_get_header(event, "update-reg");
+	if (!zstr(update_reg) && switch_true(update_reg)) {
+		return;
+	}
+
+	event_contact = switch_event_get_header(event, "contact");
+	if (zstr(event_contact)) {
+		return;
+	}
+
+	contact_ptr = app_id = voip_token = im_token = platform = strdup(event_contact);
+
+	if (zstr(contact_ptr)) {
+		goto end;
+	}
+
+	/*Get contact parameter pn-os */
+	if (!zstr(globals.contact_platform_param) && (foo = strcasestr(platform, globals.contact_platform_param))) {
+		platform = foo + strlen(globals.contact_platform_param) + 1;
+	} else {
+		platform = NULL;
+	}
+
+	/*Get contact parameter pn-voip-tok */
+	if (!zstr(globals.contact_voip_token_param) && (foo = strcasestr(voip_token, globals.contact_voip_token_param))) {
+		voip_token = foo + strlen(globals.contact_voip_token_param) + 1;
+	} else {
+		voip_token = NULL;
+	}
+
+	/*Get contact parameter pn-im-tok */
+	if (!zstr(globals.contact_im_token_param) && (foo = strcasestr(im_token, globals.contact_im_token_param))) {
+		im_token = foo + strlen(globals.contact_im_token_param) + 1;
+	} else {
+		im_token = NULL;
+	}
+
+	/*Get contact parameter app-id */
+	if (!zstr(globals.contact_app_id_param) && (foo = strcasestr(app_id, globals.contact_app_id_param))) {
+		app_id = foo + strlen(globals.contact_app_id_param) + 1;
+	} else {
+		app_id = NULL;
+	}
+
+	if (voip_token && (foo = strchr(voip_token, ';')) != NULL) {
+		*foo = '\0';
+	}
+	if (im_token && (foo = strchr(im_token, ';')) != NULL) {
+		*foo = '\0';
+	}
+	if (app_id && (foo = strchr(app_id, ';')) != NULL) {
+		*foo = '\0';
+	}
+	if (platform && (foo = strchr(platform, ';')) != NULL) {
+		*foo = '\0';
+	}
+
+	if (zstr(app_id) || (zstr(voip_token) && zstr(im_token)) || zstr(platform)) {
+		goto end;
+	}
+
+	event_user = switch_event_get_header(event, "from-user");
+	event_realm = switch_event_get_header(event, "realm");
+
+	if (zstr(event_user) || zstr(event_realm)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. No parameter\n");
+		goto end;
+	}
+
+	/*New registration of push capable device, wake up waiters on other nodes*/
+	wakeup_bus_publish(event);
+
+	if (!zstr(voip_token)) {
+		const char *expires = switch_event_get_header(event, "expires");
+
+		wake_track_register(voip_token);
+		register_fresh_touch(event_user, event_realm, voip_token, zstr(expires) ? 0 : (uint32_t) strtoul(expires, NULL, 10));
+	}
+
+	/*Add new or refresh existing VoIP token*/
+	if (!zstr(voip_token)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. Store VoIP token: '%s' to push_tokens for user %s@%s and application: %s\n", voip_token, event_user, event_realm, app_id);
+		register_store_token(voip_token, event_user, event_realm, app_id, "voip", platform);
+	}
+
+	/*Add new or refresh existing IM token*/
+	if (!zstr(im_token)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. Store IM token: '%s' to push_tokens for user %s@%s and application: %s\n", im_token, event_user, event_realm, app_id);
+		register_store_token(im_token, event_user, event_realm, app_id, "im", platform);
+	}
+
+	end:
+	switch_safe_free(contact_ptr);
+}
+
+static switch_bool_t apn_schema_exec(switch_cache_db_handle_t *dbh, const char *sql)
+{
+	char *err = NULL;
+
+	switch_cache_db_execute_sql(dbh, (char *) sql, &err);
+	if (err) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "SQL ERR: [%s]\n%s\n", err, sql);
+		free(err);
+		return SWITCH_FALSE;
+	}
+
+	return SWITCH_TRUE;
+}
+
+static switch_bool_t apn_schema_has_table(switch_cache_db_handle_t *dbh, const char *table)
+{
+	char *sql = switch_mprintf("SELECT count(*) FROM %s", table), *err = NULL;
+
+	switch_cache_db_execute_sql(dbh, sql, &err);
+	switch_safe_free(sql);
+	if (err) {
+		free(err);
+		return SWITCH_FALSE;
+	}
+
+	return SWITCH_TRUE;
+}
+
+/* Create push_token_entries with dimension tables, rows of old push_tokens table are moved there once
+ * and the table is kept as push_tokens_legacy */
+static switch_bool_t apn_schema_migrate(switch_cache_db_handle_t *dbh)
+{
+	static const char *legacy_columns[APN_DIM_MAX] = { "realm", "app_id", "type", "platform" };
+	/*sqlite doesn't have serial, INTEGER primary key is alias of rowid there*/
+	const char *serial = globals.db_kind == APN_DB_CORE ? "INTEGER" : "serial";
+	switch_bool_t legacy = apn_schema_has_table(dbh, "push_tokens"), ok = SWITCH_TRUE;
+	char *sql = NULL, count[32] = "", *err = NULL;
+	int i;
+
+	if (!apn_schema_exec(dbh, "BEGIN")) {
+		return SWITCH_FALSE;
+	}
+
+	for (i = 0; ok && i < APN_DIM_MAX; i++) {
+		if (apn_schema_has_table(dbh, apn_dim_tables[i])) {
+			continue;
+		}
+		sql = switch_mprintf("CREATE TABLE %s ("
+								"id			%s NOT NULL,"
+								"name		VARCHAR(255) NOT NULL,"
+								"CONSTRAINT %s_pkey PRIMARY KEY (id),"
+								"CONSTRAINT %s_name UNIQUE (name)"
+							 ")", apn_dim_tables[i], serial, apn_dim_tables[i], apn_dim_tables[i]);
+		ok = apn_schema_exec(dbh, sql);
+		switch_safe_free(sql);
+	}
+
+	if (ok) {
+		sql = switch_mprintf("CREATE TABLE push_token_entries ("
+								"id				%s NOT NULL,"
+								"token			VARCHAR(255) NOT NULL,"
+								"extension		VARCHAR(255) NOT NULL,"
+								"realm_ref		INTEGER NOT NULL,"
+								"app_ref		INTEGER NOT NULL,"
+								"type_ref		SMALLINT NOT NULL,"
+								"platform_ref	SMALLINT NOT NULL,"
+								"last_update	timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP,"
+								"CONSTRAINT push_token_entries_pkey PRIMARY KEY (id),"
+								"%s"
+								"CONSTRAINT push_token_entries_realm FOREIGN KEY (realm_ref) REFERENCES push_realms (id),"
+								"CONSTRAINT push_token_entries_app FOREIGN KEY (app_ref) REFERENCES push_apps (id),"
+								"CONSTRAINT push_token_entries_type FOREIGN KEY (type_ref) REFERENCES push_types (id),"
+								"CONSTRAINT push_token_entries_platform FOREIGN KEY (platform_ref) REFERENCES push_platforms (id)"
+							 ")", serial,
+							 /*Key of ON CONFLICT, odbc backends get it as index after the migration (MySQL may limit length of index key)*/
+							 globals.db_kind == APN_DB_ODBC ? "" : "CONSTRAINT push_token_entries_unique UNIQUE (token, extension, realm_ref, app_ref, type_ref),");
+		ok = apn_schema_exec(dbh, sql);
+		switch_safe_free(sql);
+	}
+
+	ok = ok && apn_schema_exec(dbh, "CREATE INDEX push_token_entries_user ON push_token_entries (extension, realm_ref, type_ref)");
+	if (globals.db_kind == APN_DB_ODBC) {
+		ok = ok && apn_schema_exec(dbh, "CREATE INDEX push_token_entries_token ON push_token_entries (token)");
+	}
+
+	if (ok && legacy) {
+		for (i = 0; ok && i < APN_DIM_MAX; i++) {
+			sql = switch_mprintf("INSERT INTO %s (name) SELECT DISTINCT %s FROM push_tokens", apn_dim_tables[i], legacy_columns[i]);
+			ok = apn_schema_exec(dbh, sql);
+			switch_safe_free(sql);
+		}
+
+		/*Only the first of duplicates left by old versions is moved, legacy table is kept as is (MySQL refuses DELETE reading its own target)*/
+		ok = ok && apn_schema_exec(dbh, "INSERT INTO push_token_entries (token, extension, realm_ref, app_ref, type_ref, platform_ref, last_update) "
+								   "SELECT t.token, t.extension, r.id, a.id, ty.id, p.id, t.last_update FROM push_tokens t "
+								   "JOIN push_realms r ON r.name = t.realm JOIN push_apps a ON a.name = t.app_id "
+								   "JOIN push_types ty ON ty.name = t.type JOIN push_platforms p ON p.name = t.platform "
+								   "WHERE t.id IN (SELECT min(id) FROM push_tokens GROUP BY token, extension, realm, app_id, type)");
+		ok = ok && apn_schema_exec(dbh, "ALTER TABLE push_tokens RENAME TO push_tokens_legacy");
+	}
+
+	if (!ok) {
+		apn_schema_exec(dbh, "ROLLBACK");
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "CARUSTO. Couldn't create push_token_entries%s\n",
+						  legacy ? " from push_tokens, table is left as is" : "");
+		return SWITCH_FALSE;
+	}
+
+	if (!apn_schema_exec(dbh, "COMMIT")) {
+		return SWITCH_FALSE;
+	}
+
+	/*Out of transaction, failed statement mustn't abort it. Old MySQL may refuse key of two VARCHAR(255) columns*/
+	if (globals.db_kind == APN_DB_ODBC &&
+		!apn_schema_exec(dbh, "CREATE UNIQUE INDEX push_token_entries_unique ON push_token_entries (token, extension, realm_ref, app_ref, type_ref)")) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "CARUSTO. No unique key on push_token_entries, concurrent upserts may store duplicate rows "
+						  "(skipped on read)\n");
+	}
+
+	if (legacy) {
+		switch_cache_db_execute_sql2str(dbh, "SELECT count(*) FROM push_token_entries", count, sizeof(count), &err);
+		switch_safe_free(err);
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "CARUSTO. Moved %s token(s) to push_token_entries, old table is kept as push_tokens_legacy\n", count);
+	}
+
+	return SWITCH_TRUE;
+}
+
+static int init_sql(void)
+{
+	/*Kept for external readers of former push_tokens table, module itself reads push_token_entries*/
+	char view_sql[] =
+		"CREATE VIEW push_tokens AS "
+			"SELECT t.id, t.token, t.extension, r.name AS realm, a.name AS app_id, ty.name AS type, p.name AS platform, t.last_update "
+			"FROM push_token_entries t "
+			"JOIN push_realms r ON r.id = t.realm_ref "
+			"JOIN push_apps a ON a.id = t.app_ref "
+			"JOIN push_types ty ON ty.id = t.type_ref "
+			"JOIN push_platforms p ON p.id = t.platform_ref";
+	char wake_sql[] =
+		"CREATE TABLE push_token_wake ("
+			"token			VARCHAR(255) NOT NULL,"
+			"type			VARCHAR(255) NOT NULL,"
+			"platform		VARCHAR(255) NOT NULL,"
+			"latencies		VARCHAR(255) NOT NULL DEFAULT '',"
+			"misses			INTEGER NOT NULL DEFAULT 0,"
+			"CONSTRAINT push_token_wake_pkey PRIMARY KEY (token, type)"
+		");";
+	char waiters_sql[] =
+		"CREATE TABLE push_waiters ("
+			"node			VARCHAR(255) NOT NULL,"
+			"waiter_id		VARCHAR(255) NOT NULL,"
+			"username		VARCHAR(255) NOT NULL,"
+			"realm			VARCHAR(255) NOT NULL,"
+			"expires_ms		BIGINT NOT NULL"
+		");";
+	char wakeup_sql[] =
+		"CREATE TABLE push_wakeups ("
+			"node			VARCHAR(255) NOT NULL,"
+			"username		VARCHAR(255) NOT NULL,"
+			"realm			VARCHAR(255) NOT NULL,"
+			"contact		VARCHAR(1024) NOT NULL,"
+			"call_id		VARCHAR(255) NOT NULL,"
+			"profile_name	VARCHAR(255) NOT NULL,"
+			"created_ms		BIGINT NOT NULL"
+		");";
+
+	switch_cache_db_handle_t *dbh = mod_apn_get_db_handle();
+
+	if (!dbh) {
+		return 0;
+	}
+
+	if (!apn_schema_has_table(dbh, "push_token_entries") && !apn_schema_migrate(dbh)) {
+		switch_cache_db_release_db_handle(&dbh);
+		return 0;
+	}
+
+	switch_cache_db_test_reactive(dbh, "SELECT count(*) FROM push_tokens", NULL, view_sql);
+
+	switch_cache_db_test_reactive(dbh, "SELECT count(*) FROM push_token_wake", NULL, wake_sql);
+
+	if (globals.wakeup_bus && !strcasecmp(globals.wakeup_bus->name, "db")) {
+		switch_cache_db_test_reactive(dbh, "SELECT count(*) FROM push_wakeups", NULL, wakeup_sql);
+		switch_cache_db_test_reactive(dbh, "SELECT count(*) FROM push_waiters", NULL, waiters_sql);
+	}
+
+	switch_cache_db_release_db_handle(&dbh);
+
+	return 1;
+}
+
+static void response_event_handler(switch_event_t *event)
+{
+	char *uuid = NULL, *response = NULL, *wake_deadline = NULL, *lookup_done = NULL, *http_done = NULL;
+	response_t *data = (response_t *)event->bind_user_data;
+
+	uuid = switch_event_get_header(event, "uuid");
+	if (zstr(uuid) || !data) {
+		return;
+	}
+
+	if (strcmp(uuid, data->uuid) != 0) {
+		return;
+	}
+
+	response = switch_event_get_header(event, "response");
+	if (zstr(response)) {
+		return;
+	}
+
+	wake_deadline = switch_event_get_header(event, "wake-deadline");
+	lookup_done = switch_event_get_header(event, "lookup-done");
+	http_done = switch_event_get_header(event, "http-done");
+
+	switch_mutex_lock(data->mutex);
+	if (!strcasecmp(response, "sent")) {
+		data->state = MOD_APN_SENT;
+	} else {
+		data->state = MOD_APN_NOTSENT;
+	}
+	data->response_ms = switch_micro_time_now() / 1000;
+	data->wake_deadline = zstr(wake_deadline) ? 0 : (uint32_t) strtoul(wake_deadline, NULL, 10);
+	data->lookup_us = zstr(lookup_done) ? 0 : (switch_time_t) strtoll(lookup_done, NULL, 10);
+	data->http_us = zstr(http_done) ? 0 : (switch_time_t) strtoll(http_done, NULL, 10);
+	data->response_us = switch_time_ref();
+	switch_mutex_unlock(data->mutex);
+}
+
+/* Waiter of device wake up: push notification state and REGISTER of the device.
+ * Created by apn_wait or in advance by apn_prepush (then kept in registry until apn_wait of the same call takes it) */
+struct apn_waiter_obj {
+	switch_memory_pool_t *pool;
+	char *key;
+	originate_register_t originate;
+	response_t response;
+	uint32_t timelimit;
+	time_t expires;
+	switch_time_t push_us;
+	push_inflight_t *inflight;
+	switch_event_node_t *register_node;
+	switch_event_node_t *wakeup_node;
+	switch_event_node_t *response_node;
+};
+typedef struct apn_waiter_obj apn_waiter_t;
+
+static char *apn_waiter_key(switch_core_session_t *session, const char *user, const char *realm)
+{
+	if (!session) {
+		return NULL;
+	}
+
+	return switch_mprintf("%s/%s@%s", switch_core_session_get_uuid(session), user, realm);
+}
+
+static void apn_waiter_destroy(apn_waiter_t **waiter_p)
+{
+	apn_waiter_t *waiter = *waiter_p;
+	switch_memory_pool_t *pool;
+
+	if (!waiter) {
+		return;
+	}
+
+	if (waiter->response_node) {
+		switch_event_unbind(&waiter->response_node);
+	}
+	if (waiter->register_node) {
+		switch_event_unbind(&waiter->register_node);
+	}
+	if (waiter->wakeup_node) {
+		switch_event_unbind(&waiter->wakeup_node);
+		wakeup_bus_unwatch(waiter->response.uuid);
+		waiters_dec();
+	}
+	if (waiter->response.mutex) {
+		switch_mutex_destroy(waiter->response.mutex);
+	}
+	push_inflight_unregister(&waiter->inflight);
+
+	pool = waiter->pool;
+	switch_core_destroy_memory_pool(&pool);
+	*waiter_p = NULL;
+}
+
+/* Stop listening REGISTER, destination is found */
+static void apn_waiter_unbind_register(apn_waiter_t *waiter)
+{
+	if (waiter->register_node) {
+		switch_event_unbind(&waiter->register_node);
+	}
+	if (waiter->wakeup_node) {
+		switch_event_unbind(&waiter->wakeup_node);
+		wakeup_bus_unwatch(waiter->response.uuid);
+		waiters_dec();
+	}
+}
+
+static apn_waiter_t *apn_waiter_create(const char *user, const char *realm, uint32_t timelimit, switch_bool_t wait_any_register)
+{
+	switch_memory_pool_t *pool = NULL;
+	apn_waiter_t *waiter = NULL;
+
+	if (switch_core_new_memory_pool(&pool) != SWITCH_STATUS_SUCCESS || !pool) {
+		return NULL;
+	}
+
+	waiter = switch_core_alloc(pool, sizeof(*waiter));
+	memset(waiter, 0, sizeof(*waiter));
+	waiter->pool = pool;
+	waiter->timelimit = timelimit;
+	waiter->expires = switch_epoch_time_now(NULL) + timelimit;
+
+	switch_uuid_str(waiter->response.uuid, sizeof(waiter->response.uuid));
+	waiter->response.state = MOD_APN_UNDEFINE;
+	switch_mutex_init(&waiter->response.mutex, SWITCH_MUTEX_NESTED, pool);
+	waiter->inflight = push_inflight_register(waiter->response.uuid, user, realm);
+
+	waiter->originate.pool = pool;
+	waiter->originate.realm = switch_core_strdup(pool, realm);
+	waiter->originate.user = switch_core_strdup(pool, user);
+	waiter->originate.timelimit = &waiter->timelimit;
+	waiter->originate.wait_any_register = wait_any_register;
+	switch_mutex_init(&waiter->originate.mutex, SWITCH_MUTEX_NESTED, pool);
+
+	/*Bind to event 'sofia::register' for originate call to registration, loopback bus delivers them instead*/
+	if (!globals.wakeup_bus || strcasecmp(globals.wakeup_bus->name, "loopback")) {
+		switch_event_bind_removable("apn_originate_register", SWITCH_EVENT_CUSTOM, "sofia::register", originate_register_event_handler, &waiter->originate, &waiter->register_node);
+	}
+
+	/*Bind to wake up bus event for registrations received by other nodes*/
+	if (globals.wakeup_bus) {
+		switch_event_bind_removable("apn_originate_register", SWITCH_EVENT_CUSTOM, APN_WAKEUP_SUBCLASS, originate_register_event_handler, &waiter->originate, &waiter->wakeup_node);
+		wakeup_bus_watch(waiter->response.uuid, user, realm, timelimit);
+		waiters_inc();
+	}
+
+	if ((switch_event_bind_removable(modname, SWITCH_EVENT_CUSTOM, "mobile::push::response", response_event_handler, &waiter->response, &waiter->response_node) != SWITCH_STATUS_SUCCESS)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Couldn't bind event!\n");
+		apn_waiter_destroy(&waiter);
+	}
+
+	return waiter;
+}
+
+/*Create event 'mobile::push::notification' for send push notification*/
+static void apn_waiter_fire_push(apn_waiter_t *waiter)
+{
+	switch_event_t *event = NULL;
+
+	if (switch_event_create_subclass(&event, SWITCH_EVENT_CUSTOM, "mobile::push::notification") == SWITCH_STATUS_SUCCESS) {
+		switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "uuid", waiter->response.uuid);
+		switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "type", "voip");
+		switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "user", waiter->originate.user);
+		switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "realm", waiter->originate.realm);
+		/*Push is useless after call stops waiting*/
+		switch_event_add_header(event, SWITCH_STACK_BOTTOM, "deadline-ms", "%" SWITCH_INT64_T_FMT,
+								(int64_t)(switch_micro_time_now() / 1000 + (switch_time_t) waiter->timelimit * 1000));
+		switch_event_add_body(event, "{\"content-available\":true,\"custom\":[{\"name\":\"content-message\",\"value\":\"incomming call\"}]}");
+		waiter->push_us = switch_time_ref();
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. Fire event APN for User: %s@%s\n", waiter->originate.user, waiter->originate.realm);
+		switch_event_fire(&event);
+	}
+}
+
+/* Caller holds globals.waiter_mutex */
+static void apn_waiter_registry_sweep(void)
+{
+	switch_hash_index_t *hi;
+	time_t now = switch_epoch_time_now(NULL);
+
+	for (hi = switch_core_hash_first(globals.waiter_hash); hi;) {
+		const void *key;
+		void *val;
+		apn_waiter_t *waiter;
+
+		switch_core_hash_this(hi, &key, NULL, &val);
+		hi = switch_core_hash_next(&hi);
+		waiter = (apn_waiter_t *) val;
+
+		if (waiter->expires <= now) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. Pre-push waiter '%s' expired\n", waiter->key);
+			switch_core_hash_delete(globals.waiter_hash, waiter->key);
+			apn_waiter_destroy(&waiter);
+		}
+	}
+}
+
+static switch_status_t apn_waiter_registry_add(apn_waiter_t *waiter)
+{
+	switch_status_t status = SWITCH_STATUS_SUCCESS;
+
+	switch_mutex_lock(globals.waiter_mutex);
+	apn_waiter_registry_sweep();
+	if (switch_core_hash_find(globals.waiter_hash, waiter->key)) {
+		status = SWITCH_STATUS_INUSE;
+	} else {
+		switch_core_hash_insert(globals.waiter_hash, waiter->key, waiter);
+	}
+	switch_mutex_unlock(globals.waiter_mutex);
+
+	return status;
+}
+
+/* Take ownership of waiter created by apn_prepush */
+static apn_waiter_t *apn_waiter_registry_take(const char *key)
+{
+	apn_waiter_t *waiter = NULL;
+
+	if (zstr(key)) {
+		return NULL;
+	}
+
+	switch_mutex_lock(globals.waiter_mutex);
+	apn_waiter_registry_sweep();
+	if ((waiter = switch_core_hash_find(globals.waiter_hash, key))) {
+		switch_core_hash_delete(globals.waiter_hash, key);
+	}
+	switch_mutex_unlock(globals.waiter_mutex);
+
+	return waiter;
+}
+
+static void apn_waiter_registry_destroy(void)
+{
+	switch_hash_index_t *hi;
+
+	if (!globals.waiter_hash) {
+		return;
+	}
+
+	switch_mutex_lock(globals.waiter_mutex);
+	while ((hi = switch_core_hash_first(globals.waiter_hash))) {
+		const void *key;
+		void *val;
+		apn_waiter_t *waiter;
+
+		switch_core_hash_this(hi, &key, NULL, &val);
+		waiter = (apn_waiter_t *) val;
+		switch_core_hash_delete(globals.waiter_hash, waiter->key);
+		apn_waiter_destroy(&waiter);
+	}
+	switch_mutex_unlock(globals.waiter_mutex);
+
+	switch_core_hash_destroy(&globals.waiter_hash);
+}
+
+#define APN_PREPUSH_SYNTAX "<user>[@<realm>] [<timeout>]"
+SWITCH_STANDARD_APP(apn_prepush_function)
+{
+	char *mydata = NULL, *argv[2] = { 0 }, *user = NULL, *realm = NULL, *key = NULL;
+	uint32_t timelimit = 60;
+	apn_waiter_t *waiter = NULL;
+	int argc;
+
+	if (zstr(data) || !(mydata = strdup(data))) {
+		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, "USAGE: apn_prepush %s\n", APN_PREPUSH_SYNTAX);
+		return;
+	}
+
+	argc = switch_split(mydata, ' ', argv);
+	user = argv[0];
+
+	if ((realm = strchr(user, '@'))) {
+		*realm++ = '\0';
+	} else {
+		realm = switch_core_get_domain(SWITCH_FALSE);
+	}
+
+	if (argc > 1) {
+		int tmp = (int)strtol(argv[1], NULL, 10);
+		if (tmp > 0) {
+			timelimit = (uint32_t) tmp;
+		}
+	}
+
+	if (zstr(user) || zstr(realm) || !(waiter = apn_waiter_create(user, realm, timelimit, SWITCH_FALSE))) {
+		goto end;
+	}
+
+	key = apn_waiter_key(session, user, realm);
+	waiter->key = switch_core_strdup(waiter->pool, key);
+
+	if (apn_waiter_registry_add(waiter) != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "CARUSTO. Push to %s@%s already sent for this call\n", user, realm);
+		apn_waiter_destroy(&waiter);
+		goto end;
+	}
+
+	/*Direct leg will ring the device, apn_wait decides about push*/
+	if (register_fresh_all(user, realm)) {
+		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "CARUSTO. %s@%s registered recently, no pre-push\n", user, realm);
+		goto end;
+	}
+
+	apn_waiter_fire_push(waiter);
+
+end:
+	switch_safe_free(key);
+	switch_safe_free(mydata);
+}
+
+/* Timeline of push for call: offsets (ms) from start of apn_wait to channel variables and mobile::push::trace event.
+ * Negative offset of push means it was sent in advance by apn_prepush */
+static void apn_waiter_trace(apn_waiter_t *waiter, switch_core_session_t *session, switch_time_t start_us, switch_time_t originate_us,
+							 switch_call_cause_t cause)
+{
+	struct {
+		const char *name;
+		switch_time_t us;
+	} points[6];
+	switch_channel_t *channel = session ? switch_core_session_get_channel(session) : NULL;
+	switch_event_t *event = NULL;
+	char name[64], value[32];
+	int i, n = 0;
+
+	if (!globals.push_trace || !waiter) {
+		return;
+	}
+
+	points[n].name = "push_queued";
+	points[n++].us = waiter->push_us;
+	switch_mutex_lock(waiter->response.mutex);
+	points[n].name = "lookup_done";
+	points[n++].us = waiter->response.lookup_us;
+	points[n].name = "http_done";
+	points[n++].us = waiter->response.http_us;
+	points[n].name = "response";
+	points[n++].us = waiter->response.response_us;
+	switch_mutex_unlock(waiter->response.mutex);
+	switch_mutex_lock(waiter->originate.mutex);
+	points[n].name = "register";
+	points[n++].us = waiter->originate.register_us;
+	switch_mutex_unlock(waiter->originate.mutex);
+	points[n].name = "originate";
+	points[n++].us = originate_us;
+
+	if (session && switch_event_create_subclass(&event, SWITCH_EVENT_CUSTOM, APN_TRACE_SUBCLASS) == SWITCH_STATUS_SUCCESS) {
+		switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "uuid", switch_core_session_get_uuid(session));
+		switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "user", waiter->originate.user);
+		switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "realm", waiter->originate.realm);
+		switch_event_add_header(event, SWITCH_STACK_BOTTOM, "wait_start", "%" SWITCH_TIME_T_FMT, start_us);
+		switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "originate_cause", switch_channel_cause2str(cause));
+	}
+
+	for (i = 0; i < n; i++) {
+		if (!points[i].us) {
+			continue;
+		}
+
+		switch_snprintf(name, sizeof(name), "apn_trace_%s_ms", points[i].name);
+		switch_snprintf(value, sizeof(value), "%" SWITCH_TIME_T_FMT, (points[i].us - start_us) / 1000);
+		if (channel) {
+			switch_channel_set_variable(channel, name, value);
+		}
+		if (event) {
+			switch_event_add_header(event, SWITCH_STACK_BOTTOM, points[i].name, "%" SWITCH_TIME_T_FMT, points[i].us);
+		}
+	}
+
+	if (channel) {
+		switch_channel_set_variable(channel, "apn_trace_originate_cause", switch_channel_cause2str(cause));
+	}
+
+	if (event) {
+		switch_event_fire(&event);
+	}
+}
+
+/* fake user_wait */
+switch_endpoint_interface_t *apn_wait_endpoint_interface;
+static switch_call_cause_t apn_wait_outgoing_channel(switch_core_session_t *session,
+			 switch_event_t *var_event,
+			 switch_caller_profile_t *outbound_profile,
+			 switch_core_session_t **new_session, switch_memory_pool_t **pool, switch_originate_flag_t flags,
+			 switch_call_cause_t *cancel_cause);
+
+switch_io_routines_t apn_wait_io_routines = {
+		/*.outgoing_channel */ apn_wait_outgoing_channel
+};
 
-		if (!zstr(im_count) && strtol(im_count, NULL, 10) == 0) {
-			/*Add new IM token to DB*/
-			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. Add new IM token: '%s' to push_tokens for user %s@%s and application: %s\n", im_token, event_user, event_realm, app_id);
-			query = switch_mprintf("INSERT INTO push_tokens (token, extension, realm, app_id, type, platform) VALUES ('%q', '%q', '%q', '%q', 'im', '%q')", im_token, event_user, event_realm, app_id, platform);
-			execute_sql_now(&query);
-			switch_safe_free(query);
+static switch_call_cause_t apn_wait_outgoing_channel(switch_core_session_t *session,
+			 switch_event_t *var_event,
+			 switch_caller_profile_t *outbound_profile,
+			 switch_core_session_t **new_session, switch_memory_pool_t **_pool, switch_originate_flag_t flags,
+			 switch_call_cause_t *cancel_cause)
+{
+	switch_call_cause_t cause = SWITCH_CAUSE_NONE;
+	uint32_t timelimit_sec = 0;
+	uint32_t current_timelimit = 0;
+	char *user = NULL, *domain = NULL, *dup_domain = NULL, *key = NULL;
+	char *var_val = NULL;
+	switch_channel_t *channel = NULL;
+	switch_memory_pool_t *pool = NULL;
+	char *cid_name_override = NULL, *cid_num_override = NULL;
+	apn_waiter_t *waiter = NULL;
+	char *destination = NULL;
+	switch_bool_t wait_any_register = SWITCH_FALSE, send_push = SWITCH_TRUE;
+	switch_bool_t adaptive = globals.adaptive_wake_timeout;
+	uint32_t fork_grace = globals.fork_grace, legs_count = 0;
+	switch_time_t register_us = 0, push_at_us = 0;
+	switch_time_t start = 0, start_us = switch_time_ref(), originate_us = 0;
+	int diff = 0;
+
+	if (var_event && !zstr(switch_event_get_header(var_event, "originate_reg_token"))) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Skip originate in case have custom originate token registration\n");
+		return cause;
+	}
+
+	start = switch_epoch_time_now(NULL);
+	switch_core_new_memory_pool(&pool);
+
+	if (!pool) {
+		return cause;
+	}
+
+	if (session) {
+		channel = switch_core_session_get_channel(session);
+	}
+
+	if (!outbound_profile || zstr(outbound_profile->destination_number)) {
+		goto done;
+	}
+
+	user = switch_core_strdup(pool, outbound_profile->destination_number);
+	if (!user) {
+		goto done;
+	}
+
+	if ((domain = strchr(user, '@'))) {
+		*domain++ = '\0';
+	} else {
+		domain = switch_core_get_domain(SWITCH_TRUE);
+		dup_domain = domain;
+	}
+
+	if (!domain) {
+		goto done;
+	}
+
+	if (var_event) {
+		cid_name_override = switch_event_get_header(var_event, "origination_caller_id_name");
+		cid_num_override = switch_event_get_header(var_event, "origination_caller_id_number");
+		if ((var_val = switch_event_get_header(var_event, "originate_timeout"))) {
+			int tmp = (int)strtol(var_val, NULL, 10);
+			if (tmp > 0) {
+				timelimit_sec = (uint32_t) tmp;
+			}
+		}
+	}
+
+	if (timelimit_sec <= 0) {
+		timelimit_sec = 60;
+	}
+
+	current_timelimit = timelimit_sec;
+
+	if (var_event && switch_true(switch_event_get_header(var_event, "apn_wait_any_register"))) {
+		wait_any_register = SWITCH_TRUE;
+	}
+
+	if (var_event && (var_val = switch_event_get_header(var_event, "apn_adaptive_timeout"))) {
+		adaptive = switch_true(var_val) ? SWITCH_TRUE : SWITCH_FALSE;
+	}
+
+	if (var_event && (var_val = switch_event_get_header(var_event, "apn_fork_grace"))) {
+		fork_grace = (uint32_t) strtoul(var_val, NULL, 10);
+	}
+
+	/*Push could be already sent by apn_prepush of this call*/
+	key = apn_waiter_key(session, user, domain);
+	if ((waiter = apn_waiter_registry_take(key))) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. Attach to pre-push waiter of %s@%s\n", user, domain);
+		switch_mutex_lock(waiter->originate.mutex);
+		waiter->timelimit = current_timelimit;
+		waiter->originate.wait_any_register = wait_any_register;
+		switch_mutex_unlock(waiter->originate.mutex);
+		/*Waiter row of pre-push may expire sooner than this call waits*/
+		if (waiter->wakeup_node) {
+			wakeup_bus_watch(waiter->response.uuid, user, domain, current_timelimit);
+		}
+	} else if (!(waiter = apn_waiter_create(user, domain, current_timelimit, wait_any_register))) {
+		goto done;
+	} else if (var_event && (var_val = switch_event_get_header(var_event, "enable_send_apn")) && !zstr(var_val) && !switch_true(var_val)) {
+		send_push = SWITCH_FALSE;
+	}
+
+	/*Pre-push may have been held back by fresh registration too*/
+	if (send_push && !waiter->push_us) {
+		if (!register_fresh_all(user, domain)) {
+			apn_waiter_fire_push(waiter);
+		} else if (globals.fresh_register_delay) {
+			/*Devices registered just now, push only if direct leg didn't take the call meanwhile*/
+			push_at_us = switch_time_ref() + (switch_time_t) globals.fresh_register_delay * 1000;
+			switch_mutex_lock(globals.fresh_mutex);
+			globals.fresh_deferred++;
+			switch_mutex_unlock(globals.fresh_mutex);
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. %s@%s registered recently, defer push for %u ms\n", user, domain, globals.fresh_register_delay);
+		} else {
+			switch_mutex_lock(globals.fresh_mutex);
+			globals.fresh_suppressed++;
+			switch_mutex_unlock(globals.fresh_mutex);
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. %s@%s registered recently, skip push\n", user, domain);
+		}
+	}
+
+	while (current_timelimit > 0) {
+		diff = (int)(switch_epoch_time_now(NULL) - start);
+		current_timelimit = timelimit_sec - diff;
+
+		switch_mutex_lock(waiter->originate.mutex);
+		waiter->timelimit = current_timelimit;
+		switch_mutex_unlock(waiter->originate.mutex);
+
+		if (wait_any_register != SWITCH_TRUE) {
+			switch_mutex_lock(waiter->response.mutex);
+			if (waiter->response.state == MOD_APN_NOTSENT) {
+				switch_mutex_unlock(waiter->response.mutex);
+				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. Event APN don't sent to %s@%s, so stop wait for incoming register\n", user, domain);
+				break;
+			}
+			/*Devices of user never woke up so late, don't hold the caller*/
+			if (adaptive && waiter->response.state == MOD_APN_SENT && waiter->response.wake_deadline &&
+				switch_micro_time_now() / 1000 - waiter->response.response_ms > waiter->response.wake_deadline) {
+				switch_mutex_unlock(waiter->response.mutex);
+				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. Devices of %s@%s didn't wake up within %u ms, stop wait for incoming register\n",
+								  user, domain, waiter->response.wake_deadline);
+				break;
+			}
+			switch_mutex_unlock(waiter->response.mutex);
+		}
+
+		if (session) {
+			switch_ivr_parse_all_messages(session);
+		}
+
+		if (channel && !switch_channel_ready(channel)) {
+			break;
+		}
+
+		if (cancel_cause && *cancel_cause > 0) {
+			break;
+		}
+
+		if (push_at_us && switch_time_ref() >= push_at_us) {
+			push_at_us = 0;
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. Direct leg didn't take the call, send deferred push to %s@%s\n", user, domain);
+			apn_waiter_fire_push(waiter);
+		}
+
+		switch_mutex_lock(waiter->originate.mutex);
+		legs_count = waiter->originate.legs_count;
+		register_us = waiter->originate.register_us;
+		/*Other pushed devices of user may wake up a bit later, give them grace window to ring all together*/
+		if (!zstr(waiter->originate.destination) &&
+			(!fork_grace || (int) legs_count >= push_inflight_sent_count(waiter->inflight) ||
+			 switch_time_ref() - register_us >= (switch_time_t) fork_grace * 1000)) {
+			destination = switch_core_strdup(pool, waiter->originate.destination);
+		}
+		switch_mutex_unlock(waiter->originate.mutex);
+
+		if (!zstr(destination)) {
+			/*Unbind from 'sofia::register' event for current originate route*/
+			apn_waiter_unbind_register(waiter);
+
+			/*First device wins, stop pushing to others*/
+			push_inflight_cancel(waiter->inflight, waiter->originate.contact);
+
+#if SWITCH_LESS_THAN(1,8)
+			if (switch_ivr_originate(session, new_session, &cause, destination, current_timelimit, NULL,
+					cid_name_override, cid_num_override, outbound_profile, var_event, flags,
+					cancel_cause) == SWITCH_STATUS_SUCCESS) {
+#else
+			if (switch_ivr_originate(session, new_session, &cause, destination, current_timelimit, NULL,
+					cid_name_override, cid_num_override, outbound_profile, var_event, flags,
+					cancel_cause, NULL) == SWITCH_STATUS_SUCCESS) {
+#endif
+				const char *context;
+				switch_caller_profile_t *cp;
+				switch_channel_t *new_channel = NULL;
+
+				originate_us = switch_time_ref();
+				new_channel = switch_core_session_get_channel(*new_session);
+
+				if ((context = switch_channel_get_variable(new_channel, "context"))) {
+					if ((cp = switch_channel_get_caller_profile(new_channel))) {
+						cp->context = switch_core_strdup(cp->pool, context);
+					}
+				}
+				switch_core_session_rwunlock(*new_session);
+			} else {
+				originate_us = switch_time_ref();
+			}
+			break;
+		}
+		switch_cond_next();
+		switch_yield(1000);
+	}
+
+done:
+	if (push_at_us) {
+		switch_mutex_lock(globals.fresh_mutex);
+		globals.fresh_suppressed++;
+		switch_mutex_unlock(globals.fresh_mutex);
+	}
+	apn_waiter_trace(waiter, session, start_us, originate_us, cause);
+	apn_waiter_destroy(&waiter);
+	switch_safe_free(key);
+	switch_safe_free(dup_domain);
+	if (pool) {
+		switch_core_destroy_memory_pool(&pool);
+	}
+
+	return cause;
+}
+
+static int bench_callback(void *pArg, int argc, char **argv, char **columnNames)
+{
+	return 0;
+}
+
+/* Insert of new tokens of scratch user apn-bench@realm: sql text, then prepared statement. Rows are deleted afterwards */
+static void apn_bench_upsert(int count, const char *realm, switch_stream_handle_t *stream)
+{
+	const char *row[6];
+	apn_token_refs_t refs;
+	switch_time_t start, text_us, prepared_us;
+	char token[64] = "", *query = NULL;
+	int i;
+
+	row[0] = token; row[1] = "apn-bench"; row[2] = realm; row[3] = "apn-bench"; row[4] = "voip"; row[5] = "bench";
+	if (!apn_token_refs_resolve(&refs, row)) {
+		return;
+	}
+
+	start = switch_time_now();
+	for (i = 0; i < count; i++) {
+		switch_snprintf(token, sizeof(token), "apn-bench-%d", i);
+		if (globals.db_kind == APN_DB_ODBC) {
+			/*UPDATE + INSERT are sql text on such backends anyway*/
+			apn_stmt_exec(APN_STMT_UPSERT_TOKEN, refs.args, NULL, NULL);
 		} else {
-			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. IM token: '%s' for user %s@%s and application: %s already exists\n", im_token, event_user, event_realm, app_id);
-			query = switch_mprintf("UPDATE push_tokens SET last_update = CURRENT_TIMESTAMP WHERE token = '%q' AND extension = '%q' AND realm = '%q' AND app_id = '%q' AND type = 'im'", im_token, event_user, event_realm, app_id);
-			execute_sql_now(&query);
+			query = apn_stmt_render(APN_STMT_UPSERT_TOKEN, refs.args, SWITCH_FALSE);
+			mod_apn_execute_sql_callback(query, bench_callback, NULL);
 			switch_safe_free(query);
 		}
 	}
+	text_us = switch_time_now() - start;
+
+	start = switch_time_now();
+	for (i = 0; i < count; i++) {
+		switch_snprintf(token, sizeof(token), "apn-bench-%d", count + i);
+		apn_stmt_exec(APN_STMT_UPSERT_TOKEN, refs.args, NULL, NULL);
+	}
+	prepared_us = switch_time_now() - start;
+
+	query = switch_mprintf("DELETE FROM push_token_entries WHERE extension = 'apn-bench' AND realm_ref = %s", refs.args[2]);
+	mod_apn_execute_sql_callback(query, bench_callback, NULL);
+	switch_safe_free(query);
+
+	stream->write_function(stream, "upsert sql text: %.0f stmt/s\n", text_us ? count * 1000000.0 / text_us : 0.0);
+	stream->write_function(stream, "upsert prepared: %.0f stmt/s\n", prepared_us ? count * 1000000.0 / prepared_us : 0.0);
+}
+
+static void apn_bench_sql(int count, char *user, char *realm, switch_stream_handle_t *stream)
+{
+	switch_time_t start, text_us, prepared_us;
+	const char *args[3];
+	char *query = NULL, realm_ref[16], type_ref[16];
+	int i;
+
+	apn_dim_ref(APN_DIM_REALM, realm, SWITCH_FALSE, realm_ref, sizeof(realm_ref));
+	apn_dim_ref(APN_DIM_TYPE, "voip", SWITCH_FALSE, type_ref, sizeof(type_ref));
+	args[0] = user;
+	args[1] = realm_ref;
+	args[2] = type_ref;
+
+	start = switch_time_now();
+	for (i = 0; i < count; i++) {
+		query = apn_stmt_render(APN_STMT_SELECT_TOKENS, args, SWITCH_FALSE);
+		mod_apn_execute_sql_callback(query, bench_callback, NULL);
+		switch_safe_free(query);
+	}
+	text_us = switch_time_now() - start;
+
+	start = switch_time_now();
+	for (i = 0; i < count; i++) {
+		apn_stmt_exec(APN_STMT_SELECT_TOKENS, args, bench_callback, NULL);
+	}
+	prepared_us = switch_time_now() - start;
+
+	stream->write_function(stream, "statements: %d\n", count);
+	stream->write_function(stream, "sql text: %.0f stmt/s\n", text_us ? count * 1000000.0 / text_us : 0.0);
+	stream->write_function(stream, "prepared: %.0f stmt/s\n", prepared_us ? count * 1000000.0 / prepared_us : 0.0);
+
+	apn_bench_upsert(count, realm, stream);
+}
+
+/* Single value of query, "n/a" when backend doesn't support it (dbstat of sqlite, size functions of pgsql) */
+static const char *apn_schema_value(switch_cache_db_handle_t *dbh, char *sql, char *buf, switch_size_t len)
+{
+	char *err = NULL;
+
+	if (!switch_cache_db_execute_sql2str(dbh, sql, buf, len, &err) || err || zstr(buf)) {
+		switch_safe_free(err);
+		switch_snprintf(buf, len, "n/a");
+	}
+	switch_safe_free(sql);
+
+	return buf;
+}
+
+struct schema_sample_obj {
+	char *extension;
+	char *realm;
+	char *type;
+};
+typedef struct schema_sample_obj schema_sample_t;
+
+static int schema_sample_callback(void *pArg, int argc, char **argv, char **columnNames)
+{
+	schema_sample_t *sample = (schema_sample_t *) pArg;
+
+	if (argc >= 3 && !sample->extension) {
+		sample->extension = strdup(switch_str_nil(argv[0]));
+		sample->realm = strdup(switch_str_nil(argv[1]));
+		sample->type = strdup(switch_str_nil(argv[2]));
+	}
+
+	return 1;
+}
+
+/* Rows, table and index size of token tables, lookup latency with dimension ids and (if it's still there) with old push_tokens */
+static void apn_schema_stats(int count, switch_stream_handle_t *stream)
+{
+	const char *tables[] = { "push_token_entries", "push_tokens_legacy", "push_realms", "push_apps", "push_types", "push_platforms" };
+	switch_cache_db_handle_t *dbh = NULL;
+	schema_sample_t sample = { 0 };
+	char rows[32], data[32], index[32], realm_ref[16], type_ref[16], *sql = NULL, *err = NULL;
+	const char *args[3];
+	switch_time_t start;
+	int i, n;
+
+	if (!(dbh = mod_apn_get_db_handle())) {
+		stream->write_function(stream, "-ERR Error Opening DB\n");
+		return;
+	}
+
+	for (i = 0; i < (int) (sizeof(tables) / sizeof(tables[0])); i++) {
+		if (!apn_schema_has_table(dbh, tables[i])) {
+			continue;
+		}
+
+		apn_schema_value(dbh, switch_mprintf("SELECT count(*) FROM %s", tables[i]), rows, sizeof(rows));
+		if (globals.db_kind == APN_DB_PGSQL) {
+			apn_schema_value(dbh, switch_mprintf("SELECT pg_table_size('%s')", tables[i]), data, sizeof(data));
+			apn_schema_value(dbh, switch_mprintf("SELECT pg_indexes_size('%s')", tables[i]), index, sizeof(index));
+		} else if (globals.db_kind == APN_DB_CORE) {
+			apn_schema_value(dbh, switch_mprintf("SELECT SUM(pgsize) FROM dbstat WHERE name = '%s'", tables[i]), data, sizeof(data));
+			apn_schema_value(dbh, switch_mprintf("SELECT SUM(s.pgsize) FROM dbstat s JOIN sqlite_master m ON m.name = s.name "
+												 "WHERE m.tbl_name = '%s' AND m.type = 'index'", tables[i]), index, sizeof(index));
+		} else {
+			switch_snprintf(data, sizeof(data), "n/a");
+			switch_snprintf(index, sizeof(index), "n/a");
+		}
+		stream->write_function(stream, "%s: rows %s, table %s bytes, indexes %s bytes\n", tables[i], rows, data, index);
+	}
+
+	switch_cache_db_execute_sql_callback(dbh, "SELECT t.extension, r.name, ty.name FROM push_token_entries t "
+										 "JOIN push_realms r ON r.id = t.realm_ref JOIN push_types ty ON ty.id = t.type_ref LIMIT 1",
+										 schema_sample_callback, &sample, &err);
+	switch_safe_free(err);
+
+	if (!sample.extension) {
+		stream->write_function(stream, "no tokens for lookup latency\n");
+		goto end;
+	}
+
+	/*Both as sql text, so only schema differs*/
+	apn_dim_ref(APN_DIM_REALM, sample.realm, SWITCH_FALSE, realm_ref, sizeof(realm_ref));
+	apn_dim_ref(APN_DIM_TYPE, sample.type, SWITCH_FALSE, type_ref, sizeof(type_ref));
+	args[0] = sample.extension;
+	args[1] = realm_ref;
+	args[2] = type_ref;
+	sql = apn_stmt_render(APN_STMT_SELECT_TOKENS, args, SWITCH_FALSE);
+	start = switch_time_now();
+	for (n = 0; n < count; n++) {
+		switch_cache_db_execute_sql_callback(dbh, sql, bench_callback, NULL, &err);
+		switch_safe_free(err);
+	}
+	stream->write_function(stream, "lookup of %s@%s (%d times): push_token_entries %.3f ms", sample.extension, sample.realm, count,
+						   (switch_time_now() - start) / 1000.0 / count);
+	switch_safe_free(sql);
+
+	if (apn_schema_has_table(dbh, "push_tokens_legacy")) {
+		sql = switch_mprintf("SELECT t.platform, t.app_id, t.token, w.latencies, w.misses FROM push_tokens_legacy t "
+							 "LEFT JOIN push_token_wake w ON w.token = t.token AND w.type = t.type "
+							 "WHERE t.extension = '%q' AND t.realm = '%q' AND t.type = '%q'", sample.extension, sample.realm, sample.type);
+		start = switch_time_now();
+		for (n = 0; n < count; n++) {
+			switch_cache_db_execute_sql_callback(dbh, sql, bench_callback, NULL, &err);
+			switch_safe_free(err);
+		}
+		stream->write_function(stream, ", push_tokens_legacy %.3f ms", (switch_time_now() - start) / 1000.0 / count);
+		switch_safe_free(sql);
+	}
+	stream->write_function(stream, "\n");
+
+end:
+	switch_safe_free(sample.extension);
+	switch_safe_free(sample.realm);
+	switch_safe_free(sample.type);
+	switch_cache_db_release_db_handle(&dbh);
+}
+
+struct bench_db_obj {
+	int count;
+	const char *user;
+	char realm_ref[16];
+	char type_ref[16];
+	switch_mutex_t *serialize;
+};
+typedef struct bench_db_obj bench_db_t;
+
+static void *SWITCH_THREAD_FUNC bench_db_thread_run(switch_thread_t *thread, void *obj)
+{
+	bench_db_t *bench = (bench_db_t *) obj;
+	const char *args[3];
+	int i;
+
+	args[0] = bench->user;
+	args[1] = bench->realm_ref;
+	args[2] = bench->type_ref;
+
+	for (i = 0; i < bench->count; i++) {
+		if (bench->serialize) {
+			switch_mutex_lock(bench->serialize);
+		}
+		apn_stmt_exec(APN_STMT_SELECT_TOKENS, args, bench_callback, NULL);
+		if (bench->serialize) {
+			switch_mutex_unlock(bench->serialize);
+		}
+	}
+
+	return NULL;
+}
+
+/* Lookups from parallel threads, with one global lock (as before) and without it */
+static void apn_bench_db(int threads, int count, char *user, char *realm, switch_stream_handle_t *stream)
+{
+	switch_memory_pool_t *pool = NULL;
+	switch_threadattr_t *thd_attr = NULL;
+	switch_thread_t **workers;
+	switch_time_t start, elapsed[2];
+	bench_db_t bench = { 0 };
+	switch_status_t st;
+	int pass, i;
+
+	switch_core_new_memory_pool(&pool);
+	workers = switch_core_alloc(pool, sizeof(*workers) * threads);
+	switch_threadattr_create(&thd_attr, pool);
+	switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+
+	bench.count = count;
+	bench.user = user;
+	apn_dim_ref(APN_DIM_REALM, realm, SWITCH_FALSE, bench.realm_ref, sizeof(bench.realm_ref));
+	apn_dim_ref(APN_DIM_TYPE, "voip", SWITCH_FALSE, bench.type_ref, sizeof(bench.type_ref));
+
+	for (pass = 0; pass < 2; pass++) {
+		if (pass == 0) {
+			switch_mutex_init(&bench.serialize, SWITCH_MUTEX_NESTED, pool);
+		} else {
+			bench.serialize = NULL;
+		}
+
+		start = switch_time_now();
+		for (i = 0; i < threads; i++) {
+			switch_thread_create(&workers[i], thd_attr, bench_db_thread_run, &bench, pool);
+		}
+		for (i = 0; i < threads; i++) {
+			switch_thread_join(&st, workers[i]);
+		}
+		elapsed[pass] = switch_time_now() - start;
+	}
+
+	stream->write_function(stream, "threads: %d\nlookups: %d\n", threads, threads * count);
+	stream->write_function(stream, "global lock: %.0f lookup/s\n", elapsed[0] ? threads * count * 1000000.0 / elapsed[0] : 0.0);
+	stream->write_function(stream, "sharded: %.0f lookup/s\n", elapsed[1] ? threads * count * 1000000.0 / elapsed[1] : 0.0);
+
+	switch_core_destroy_memory_pool(&pool);
+}
+
+/* Load test job: pushes to scratch tokens go the real path (lookup, routing, workers), only url is replaced by sink */
+struct loadtest_obj {
+	switch_memory_pool_t *pool;
+	char id[SWITCH_UUID_FORMATTED_LENGTH + 1];
+	char *type;
+	char *url;
+	int count;
+	int concurrency;
+	int rate;
+	int next;
+	int inflight;
+	int completed;
+	int sent;
+	int failed;
+	int nothing;
+	switch_bool_t finished;
+	switch_time_t start;
+	switch_time_t elapsed;
+	uint32_t *latencies;
+	switch_mutex_t *mutex;
+};
+typedef struct loadtest_obj loadtest_t;
+
+struct loadtest_push_obj {
+	loadtest_t *test;
+	int n;
+	switch_time_t begin;
+};
+typedef struct loadtest_push_obj loadtest_push_t;
 
-	end:
-	switch_safe_free(contact_ptr);
+static int loadtest_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return x < y ? -1 : x > y;
 }
 
-static int init_sql(void)
+static void loadtest_token(int n, char *user, switch_size_t user_len, char *token, switch_size_t token_len)
 {
-	char sql[] =
-		"CREATE TABLE push_tokens ("
-			"id				serial NOT NULL,"
-			"token			VARCHAR(255) NOT NULL,"
-			"extension		VARCHAR(255) NOT NULL,"
-			"realm			VARCHAR(255) NOT NULL,"
-			"app_id			VARCHAR(255) NOT NULL,"
-			"type			VARCHAR(255) NOT NULL,"
-			"platform	    VARCHAR(255) NOT NULL,"
-			"last_update    timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP,"
-			"CONSTRAINT push_tokens_pkey PRIMARY KEY (id)"
-		");";
+	switch_snprintf(user, user_len, "loadtest-%d", n);
+	switch_snprintf(token, token_len, "%032x%032x", n, n);
+}
 
-	switch_cache_db_handle_t *dbh = mod_apn_get_db_handle();
+/* Store or drop scratch tokens of all synthetic users */
+static void loadtest_tokens(loadtest_t *test, switch_bool_t store)
+{
+	const char *args[6];
+	apn_token_refs_t refs;
+	char user[32], token[64], *sql = NULL;
+	int n;
+
+	args[0] = token; args[1] = user; args[2] = APN_LOADTEST_REALM; args[3] = "loadtest"; args[4] = test->type; args[5] = "loadtest";
+
+	for (n = 0; n < test->count; n++) {
+		loadtest_token(n, user, sizeof(user), token, sizeof(token));
+		if (!store) {
+			token_store_remove(user, APN_LOADTEST_REALM, test->type, token);
+			continue;
+		}
+		if (!apn_token_refs_resolve(&refs, args)) {
+			break;
+		}
+		apn_stmt_exec(APN_STMT_UPSERT_TOKEN, refs.args, NULL, NULL);
+		token_store_put(user, APN_LOADTEST_REALM, test->type, token, "loadtest", "loadtest");
+	}
 
-	if (!dbh) {
-		return 0;
+	if (!store && apn_dim_ref(APN_DIM_REALM, APN_LOADTEST_REALM, SWITCH_FALSE, user, sizeof(user))) {
+		sql = switch_mprintf("DELETE FROM push_token_entries WHERE realm_ref = %s", user);
+		execute_sql_now(&sql);
+		switch_safe_free(sql);
 	}
+}
 
-	switch_cache_db_test_reactive(dbh, "SELECT count(*) FROM push_tokens", NULL, sql);
-	switch_cache_db_release_db_handle(&dbh);
+static void loadtest_push_done(enum push_done_status status, void *data)
+{
+	loadtest_push_t *push = (loadtest_push_t *) data;
+	loadtest_t *test = push->test;
+
+	switch_mutex_lock(test->mutex);
+	test->latencies[test->completed++] = (uint32_t)(switch_time_ref() - push->begin);
+	if (status == PUSH_DONE_SENT) {
+		test->sent++;
+	} else if (status == PUSH_DONE_FAILED) {
+		test->failed++;
+	} else {
+		test->nothing++;
+	}
+	test->inflight--;
+	switch_mutex_unlock(test->mutex);
 
-	return 1;
+	free(push);
 }
 
-static void response_event_handler(switch_event_t *event)
+static void *SWITCH_THREAD_FUNC loadtest_thread_run(switch_thread_t *thread, void *obj)
 {
-	char *uuid = NULL, *response = NULL;
-	response_t *data = (response_t *)event->bind_user_data;
+	loadtest_t *test = (loadtest_t *) obj;
+	loadtest_push_t *push;
+	switch_event_t *event = NULL;
+	switch_time_t due, deadline;
+	char user[32], token[64];
+	int n, inflight;
+
+	loadtest_tokens(test, SWITCH_TRUE);
+	globals.loadtest_url = test->url;
+
+	test->start = switch_time_ref();
+	for (n = 0; n < test->count && globals.running; n++) {
+		/*Keep the pace to requested rate*/
+		if (test->rate > 0 && (due = test->start + (switch_time_t) n * 1000000 / test->rate) > switch_time_ref()) {
+			switch_sleep(due - switch_time_ref());
+		}
 
-	uuid = switch_event_get_header(event, "uuid");
-	if (zstr(uuid) || !data) {
-		return;
-	}
+		/*Not more than concurrency pushes in flight*/
+		for (;;) {
+			switch_mutex_lock(test->mutex);
+			inflight = test->inflight;
+			switch_mutex_unlock(test->mutex);
+			if (inflight < test->concurrency || !globals.running) {
+				break;
+			}
+			switch_yield(1000);
+		}
 
-	if (strcmp(uuid, data->uuid) != 0) {
-		return;
+		if (switch_event_create_subclass(&event, SWITCH_EVENT_CUSTOM, "mobile::push::notification") != SWITCH_STATUS_SUCCESS) {
+			break;
+		}
+		loadtest_token(n, user, sizeof(user), token, sizeof(token));
+		switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "type", test->type);
+		switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "user", user);
+		switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "realm", APN_LOADTEST_REALM);
+		switch_event_add_body(event, "%s", "{\"content-available\":true}");
+
+		switch_zmalloc(push, sizeof(*push));
+		push->test = test;
+		push->n = n;
+		push->begin = switch_time_ref();
+		switch_mutex_lock(test->mutex);
+		test->inflight++;
+		test->next++;
+		switch_mutex_unlock(test->mutex);
+
+		push_notify(event, loadtest_push_done, push);
+		switch_event_destroy(&event);
 	}
 
-	response = switch_event_get_header(event, "response");
-	if (zstr(response)) {
-		return;
+	/*Done callbacks point to the job, wait them*/
+	deadline = switch_time_ref() + (switch_time_t) APN_LOADTEST_DRAIN * 1000000;
+	for (;;) {
+		switch_mutex_lock(test->mutex);
+		inflight = test->inflight;
+		switch_mutex_unlock(test->mutex);
+		if (!inflight || switch_time_ref() > deadline) {
+			break;
+		}
+		switch_yield(10000);
 	}
+	test->elapsed = switch_time_ref() - test->start;
 
-	switch_mutex_lock(data->mutex);
-	if (!strcasecmp(response, "sent")) {
-		data->state = MOD_APN_SENT;
+	if (inflight) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "CARUSTO. Load test %s: %d push(es) still in flight\n", test->id, inflight);
 	} else {
-		data->state = MOD_APN_NOTSENT;
+		globals.loadtest_url = NULL;
 	}
-	switch_mutex_unlock(data->mutex);
+	loadtest_tokens(test, SWITCH_FALSE);
+
+	switch_mutex_lock(test->mutex);
+	qsort(test->latencies, test->completed, sizeof(uint32_t), loadtest_cmp);
+	test->finished = SWITCH_TRUE;
+	switch_mutex_unlock(test->mutex);
+
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "CARUSTO. Load test %s is finished, %d of %d push(es) sent\n", test->id, test->sent, test->next);
+
+	return NULL;
 }
 
-/* fake user_wait */
-switch_endpoint_interface_t *apn_wait_endpoint_interface;
-static switch_call_cause_t apn_wait_outgoing_channel(switch_core_session_t *session,
-			 switch_event_t *var_event,
-			 switch_caller_profile_t *outbound_profile,
-			 switch_core_session_t **new_session, switch_memory_pool_t **pool, switch_originate_flag_t flags,
-			 switch_call_cause_t *cancel_cause);
+/* Job with pushes still in flight is left allocated, its callbacks may come later */
+static void loadtest_free(void)
+{
+	loadtest_t *test = globals.loadtest;
 
-switch_io_routines_t apn_wait_io_routines = {
-		/*.outgoing_channel */ apn_wait_outgoing_channel
-};
+	join_thread(&globals.loadtest_thread);
+	globals.loadtest = NULL;
+	if (test && !test->inflight) {
+		switch_core_destroy_memory_pool(&test->pool);
+	}
+}
 
-static switch_call_cause_t apn_wait_outgoing_channel(switch_core_session_t *session,
-			 switch_event_t *var_event,
-			 switch_caller_profile_t *outbound_profile,
-			 switch_core_session_t **new_session, switch_memory_pool_t **_pool, switch_originate_flag_t flags,
-			 switch_call_cause_t *cancel_cause)
+/* Start load test in background, its result is shown by 'apn loadtest status' */
+static void apn_loadtest(const char *type, int count, int concurrency, int rate, const char *url, switch_stream_handle_t *stream)
 {
-	switch_call_cause_t cause = SWITCH_CAUSE_NONE;
-	uint32_t timelimit_sec = 0;
-	uint32_t current_timelimit = 0;
-	char *user = NULL, *domain = NULL, *dup_domain = NULL;
-	char *var_val = NULL;
-	switch_event_t *event = NULL;
-	switch_event_node_t *response_event = NULL, *register_event = NULL;
-	switch_channel_t *channel = NULL;
 	switch_memory_pool_t *pool = NULL;
-	char *cid_name_override = NULL, *cid_num_override = NULL;
-	originate_register_t originate_data = { 0, };
-	char *destination = NULL;
-	switch_bool_t wait_any_register = SWITCH_FALSE;
-	response_t apn_response = { {0, }, MOD_APN_UNDEFINE, NULL };
-	switch_time_t start = 0;
-	int diff = 0;
+	loadtest_t *test;
 
-	if (var_event && !zstr(switch_event_get_header(var_event, "originate_reg_token"))) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Skip originate in case have custom originate token registration\n");
-		return cause;
+	if (!switch_core_hash_find(globals.profile_hash, type) && !globals.route_hash) {
+		stream->write_function(stream, "-ERR profile '%s' not found\n", type);
+		return;
 	}
 
-	start = switch_epoch_time_now(NULL);
+	switch_mutex_lock(globals.loadtest_mutex);
+	if (globals.loadtest && !globals.loadtest->finished) {
+		stream->write_function(stream, "-ERR load test %s is running\n", globals.loadtest->id);
+		goto end;
+	}
+	loadtest_free();
+
 	switch_core_new_memory_pool(&pool);
+	test = switch_core_alloc(pool, sizeof(*test));
+	memset(test, 0, sizeof(*test));
+	test->pool = pool;
+	switch_uuid_str(test->id, sizeof(test->id));
+	test->type = switch_core_strdup(pool, type);
+	test->url = zstr(url) ? NULL : switch_core_strdup(pool, url);
+	test->count = count;
+	test->concurrency = concurrency;
+	test->rate = rate;
+	test->latencies = switch_core_alloc(pool, sizeof(uint32_t) * count);
+	switch_mutex_init(&test->mutex, SWITCH_MUTEX_NESTED, pool);
+
+	globals.loadtest = test;
+	launch_thread(&globals.loadtest_thread, loadtest_thread_run, test);
+	stream->write_function(stream, "+OK %s\n", test->id);
 
-	if (!pool) {
-		return cause;
-	}
+end:
+	switch_mutex_unlock(globals.loadtest_mutex);
+}
 
-	if (session) {
-		channel = switch_core_session_get_channel(session);
-	}
+static void apn_loadtest_dump(switch_stream_handle_t *stream)
+{
+	loadtest_t *test;
+	switch_time_t elapsed;
+	int n;
 
-	if (!outbound_profile || zstr(outbound_profile->destination_number)) {
-		goto done;
+	switch_mutex_lock(globals.loadtest_mutex);
+	if (!(test = globals.loadtest)) {
+		stream->write_function(stream, "-ERR no load test\n");
+		goto end;
 	}
 
-	user = switch_core_strdup(pool, outbound_profile->destination_number);
-	if (!user) {
-		goto done;
+	switch_mutex_lock(test->mutex);
+	elapsed = test->finished ? test->elapsed : test->start ? switch_time_ref() - test->start : 0;
+	n = test->completed;
+	stream->write_function(stream, "id: %s\nstate: %s\nurl: %s\npushes: %d of %d\ninflight: %d\nsent: %d\nfailed: %d\nnothing: %d\nconcurrency: %d\n",
+						   test->id, test->finished ? "finished" : "running", test->url ? test->url : "profile", test->next, test->count,
+						   test->inflight, test->sent, test->failed, test->nothing, test->concurrency);
+	stream->write_function(stream, "elapsed: %" SWITCH_TIME_T_FMT " ms\nthroughput: %.0f push/s\n", elapsed / 1000,
+						   elapsed ? n * 1000000.0 / elapsed : 0.0);
+	if (test->finished && n) {
+		stream->write_function(stream, "latency p50: %.1f ms\nlatency p90: %.1f ms\nlatency p99: %.1f ms\nlatency max: %.1f ms\n",
+							   test->latencies[(n - 1) * 50 / 100] / 1000.0, test->latencies[(n - 1) * 90 / 100] / 1000.0,
+							   test->latencies[(n - 1) * 99 / 100] / 1000.0, test->latencies[n - 1] / 1000.0);
 	}
+	switch_mutex_unlock(test->mutex);
 
-	if ((domain = strchr(user, '@'))) {
-		*domain++ = '\0';
-	} else {
-		domain = switch_core_get_domain(SWITCH_TRUE);
-		dup_domain = domain;
-	}
+end:
+	switch_mutex_unlock(globals.loadtest_mutex);
+}
 
-	if (!domain) {
-		goto done;
-	}
+#define APN_COMMANDS_USAGE "status|loadtest <type> <count> <concurrency> [<rate>|0] [<url>]|loadtest status|bench sql <count> [<user@realm>]|bench db <threads> <count> [<user@realm>]|wake stats|tokens stats|tokens snapshot|schema stats [<count>]"
+static switch_status_t apn_api_command(const char *cmd, switch_stream_handle_t *stream)
+{
+	char *mydata = strdup(cmd), *argv[8] = { 0 }, *user = "bench", *realm = NULL;
+	int argc;
 
-	switch_uuid_str(apn_response.uuid, sizeof(apn_response.uuid));
-	switch_mutex_init(&apn_response.mutex, SWITCH_MUTEX_NESTED, pool);
+	argc = switch_separate_string(mydata, ' ', argv, (sizeof(argv) / sizeof(argv[0])));
 
-	if (var_event) {
-		cid_name_override = switch_event_get_header(var_event, "origination_caller_id_name");
-		cid_num_override = switch_event_get_header(var_event, "origination_caller_id_number");
-		if ((var_val = switch_event_get_header(var_event, "originate_timeout"))) {
-			int tmp = (int)strtol(var_val, NULL, 10);
-			if (tmp > 0) {
-				timelimit_sec = (uint32_t) tmp;
+	if (argc >= 3 && !strcasecmp(argv[0], "bench") && !strcasecmp(argv[1], "sql")) {
+		int count = (int)strtol(argv[2], NULL, 10);
+
+		if (argc > 3) {
+			user = argv[3];
+			if ((realm = strchr(user, '@'))) {
+				*realm++ = '\0';
 			}
 		}
+		apn_bench_sql(count > 0 ? count : 1000, user, zstr(realm) ? "bench" : realm, stream);
+	} else if (argc >= 4 && !strcasecmp(argv[0], "bench") && !strcasecmp(argv[1], "db")) {
+		int threads = (int)strtol(argv[2], NULL, 10), count = (int)strtol(argv[3], NULL, 10);
+
+		if (argc > 4) {
+			user = argv[4];
+			if ((realm = strchr(user, '@'))) {
+				*realm++ = '\0';
+			}
+		}
+		apn_bench_db(threads > 0 && threads <= 256 ? threads : 8, count > 0 ? count : 1000, user, zstr(realm) ? "bench" : realm, stream);
+	} else if (argc >= 2 && !strcasecmp(argv[0], "loadtest") && !strcasecmp(argv[1], "status")) {
+		apn_loadtest_dump(stream);
+	} else if (argc >= 4 && !strcasecmp(argv[0], "loadtest")) {
+		int count = (int)strtol(argv[2], NULL, 10), concurrency = (int)strtol(argv[3], NULL, 10);
+		int rate = argc > 4 ? (int)strtol(argv[4], NULL, 10) : 0;
+
+		apn_loadtest(argv[1], count > 0 && count <= APN_LOADTEST_MAX_COUNT ? count : 1000,
+					 concurrency > 0 && concurrency <= APN_LOADTEST_MAX_CONCURRENCY ? concurrency : 8, rate > 0 ? rate : 0,
+					 argc > 5 ? argv[5] : NULL, stream);
+	} else if (argc >= 2 && !strcasecmp(argv[0], "tokens") && !strcasecmp(argv[1], "stats")) {
+		token_store_dump(stream);
+	} else if (argc >= 2 && !strcasecmp(argv[0], "schema") && !strcasecmp(argv[1], "stats")) {
+		int count = argc > 2 ? (int)strtol(argv[2], NULL, 10) : 0;
+
+		apn_schema_stats(count > 0 ? count : 100, stream);
+	} else if (argc >= 2 && !strcasecmp(argv[0], "tokens") && !strcasecmp(argv[1], "snapshot")) {
+		stream->write_function(stream, "%s\n", globals.token_store && token_store_snapshot_write() == SWITCH_STATUS_SUCCESS ? "+OK" : "-ERR");
+	} else if (argc >= 1 && !strcasecmp(argv[0], "status")) {
+		apn_dsn_dump(stream);
+		register_fresh_dump(stream);
+		conn_pool_dump(stream);
+		endpoint_dump(stream);
+		profile_workers_dump(stream);
+		outbox_dump(stream);
+	} else if (argc >= 2 && !strcasecmp(argv[0], "wake") && !strcasecmp(argv[1], "stats")) {
+		wake_stats_dump(stream);
+	} else {
+		stream->write_function(stream, "-USAGE: %s\n", APN_COMMANDS_USAGE);
 	}
 
-	if (timelimit_sec <= 0) {
-		timelimit_sec = 60;
-	}
-
-	current_timelimit = timelimit_sec;
+	switch_safe_free(mydata);
 
-	originate_data.pool = pool;
-	originate_data.realm = switch_core_strdup(pool, domain);
-	originate_data.user = switch_core_strdup(pool, user);
-	originate_data.destination = NULL;
-	originate_data.mutex = NULL;
-	originate_data.timelimit = 0;
-	originate_data.wait_any_register = SWITCH_FALSE;
+	return SWITCH_STATUS_SUCCESS;
+}
 
-	switch_mutex_init(&originate_data.mutex, SWITCH_MUTEX_NESTED, pool);
+#define APN_USAGE """{\"uuid\":\"\",\"realm\":\"\",\"user\":\"\",\"type\":\"[im|voip]\",\"payload\":{\"body\":\"\",\"sound\":\"\",\"\":[{\"name\":\"\",\"value\":\"\"},\"image\":\"\",\"category\":\"\"}}"""
+SWITCH_STANDARD_API(apn_api_function)
+{
+	char *pdata = NULL, *json_payload = NULL;
+	cJSON *root = NULL, *payload = NULL;
+	switch_event_t *event = NULL;
+	switch_status_t res = SWITCH_STATUS_FALSE;
 
-	if (var_event && switch_true(switch_event_get_header(var_event, "apn_wait_any_register"))) {
-		wait_any_register = originate_data.wait_any_register = SWITCH_TRUE;
+	if (!zstr(cmd) && *cmd != '{') {
+		return apn_api_command(cmd, stream);
 	}
 
-	originate_data.timelimit = &current_timelimit;
-
-	/*Bind to event 'sofia::register' for originate call to registration*/
-	switch_event_bind_removable("apn_originate_register", SWITCH_EVENT_CUSTOM, "sofia::register", originate_register_event_handler, &originate_data, &register_event);
-
-	if (wait_any_register == SWITCH_FALSE) {
-		if ((switch_event_bind_removable(modname, SWITCH_EVENT_CUSTOM, "mobile::push::response", response_event_handler, &apn_response, &response_event) != SWITCH_STATUS_SUCCESS)) {
-			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Couldn't bind event!\n");
-			goto done;
-		}
+	if (cmd) {
+		pdata = strdup(cmd);
 	}
 
-	/*Create event 'mobile::push::notification' for send push notification*/
-	if (!var_event || (var_event && (!(var_val = switch_event_get_header(var_event, "enable_send_apn")) || zstr(var_val) || switch_true(var_val)))) {
-		if (switch_event_create_subclass(&event, SWITCH_EVENT_CUSTOM, "mobile::push::notification") == SWITCH_STATUS_SUCCESS) {
-			switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "uuid", apn_response.uuid);
-			switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "type", "voip");
-			switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "user", user);
-			switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "realm", domain);
-			switch_event_add_body(event, "{\"content-available\":true,\"custom\":[{\"name\":\"content-message\",\"value\":\"incomming call\"}]}");
-			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. Fire event APN for User: %s@%s\n", user, domain);
-			switch_event_fire(&event);
-			switch_event_destroy(&event);
-		}
+	if (!pdata) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "No data\n");
+		stream->write_function(stream, "USAGE: %s", APN_USAGE);
+		goto end;
 	}
 
-	while (current_timelimit > 0) {
-		diff = (int)(switch_epoch_time_now(NULL) - start);
-		current_timelimit = timelimit_sec - diff;
-
-		if (wait_any_register != SWITCH_TRUE) {
-			switch_mutex_lock(apn_response.mutex);
-			if (apn_response.state == MOD_APN_NOTSENT) {
-				switch_mutex_unlock(apn_response.mutex);
-				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "CARUSTO. Event APN don't sent to %s@%s, so stop wait for incoming register\n", user, domain);
-				break;
-			}
-			switch_mutex_unlock(apn_response.mutex);
-		}
+	root = cJSON_Parse(pdata);
+	if (!root) {
+		stream->write_function(stream, "Wrong JSON data. USAGE: %s", APN_USAGE);
+		goto end;
+	}
 
-		if (session) {
-			switch_ivr_parse_all_messages(session);
-		}
+	if (switch_event_create(&event, SWITCH_EVENT_CUSTOM) != SWITCH_STATUS_SUCCESS) {
+		stream->write_function(stream, "Can't create event");
+		goto end;
+	}
 
-		if (channel && !switch_channel_ready(channel)) {
-			break;
-		}
+	payload = cJSON_GetObjectItem(root, "payload");
+	if (payload) {
+		json_payload = cJSON_PrintUnformatted(payload);
+		switch_event_add_body(event, json_payload);
+	}
+	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "type", cJSON_GetObjectCstr(root, "type"));
+	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "user", cJSON_GetObjectCstr(root, "user"));
+	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "realm", cJSON_GetObjectCstr(root, "realm"));
+	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "uuid", cJSON_GetObjectCstr(root, "uuid"));
 
-		if (cancel_cause && *cancel_cause > 0) {
-			break;
-		}
+	push_event_handler(event);
 
-		switch_mutex_lock(originate_data.mutex);
-		if (!zstr(originate_data.destination)) {
-			destination = switch_core_strdup(pool, originate_data.destination);
-		}
-		switch_mutex_unlock(originate_data.mutex);
+	res = SWITCH_STATUS_SUCCESS;
+	stream->write_function(stream, "Sent");
 
-		if (!zstr(destination)) {
-			/*Unbind from 'sofia::register' event for current originate route*/
-			if (register_event) {
-				switch_event_unbind(&register_event);
-				register_event = NULL;
-			}
+end:
 
+	if (event) {
+		switch_event_destroy(&event);
+	}
 
-#if SWITCH_LESS_THAN(1,8)
-			if (switch_ivr_originate(session, new_session, &cause, destination, current_timelimit, NULL,
-					cid_name_override, cid_num_override, outbound_profile, var_event, flags,
-					cancel_cause) == SWITCH_STATUS_SUCCESS) {
-#else
-			if (switch_ivr_originate(session, new_session, &cause, destination, current_timelimit, NULL,
-					cid_name_override, cid_num_override, outbound_profile, var_event, flags,
-					cancel_cause, NULL) == SWITCH_STATUS_SUCCESS) {
-#endif
-				const char *context;
-				switch_caller_profile_t *cp;
-				switch_channel_t *new_channel = NULL;
+	if (root) {
+		cJSON_Delete(root);
+	}
 
-				new_channel = switch_core_session_get_channel(*new_session);
+	switch_safe_free(json_payload);
+	switch_safe_free(pdata);
 
-				if ((context = switch_channel_get_variable(new_channel, "context"))) {
-					if ((cp = switch_channel_get_caller_profile(new_channel))) {
-						cp->context = switch_core_strdup(cp->pool, context);
-					}
-				}
-				switch_core_session_rwunlock(*new_session);
-			}
-			break;
-		}
-		switch_cond_next();
-		switch_yield(1000);
-	}
+	return res;
+}
 
-done:
-	if (response_event) {
-		switch_event_unbind(&response_event);
-		response_event = NULL;
-	}
-	if (register_event) {
-		switch_event_unbind(&register_event);
-		register_event = NULL;
-	}
-	if (apn_response.mutex) {
-		switch_mutex_destroy(apn_response.mutex);
-	}
-	switch_safe_free(dup_domain);
-	if (pool) {
-		switch_core_destroy_memory_pool(&pool);
+static void stop_threads(void)
+{
+	/*Drain im pushes while senders are still running*/
+	outbox_stop();
+	globals.running = 0;
+	/*Load test waits its pushes, so stop it before workers*/
+	join_thread(&globals.loadtest_thread);
+	/*Evict and register threads flush the rest of batch to queue manager, so stop them before queue manager*/
+	join_thread(&globals.evict_thread);
+	join_thread(&globals.register_thread);
+	profile_workers_stop();
+	/*Workers are done, requests which lost the race abort on next progress callback*/
+	push_attempts_stop();
+	if (globals.wakeup_bus && globals.wakeup_bus->stop) {
+		globals.wakeup_bus->stop();
 	}
-
-	return cause;
+	/*Save last snapshot*/
+	join_thread(&globals.token_store_thread);
+	join_thread(&globals.conn_keeper_thread);
+	join_thread(&globals.dsn_check_thread);
 }
 
 SWITCH_MODULE_LOAD_FUNCTION(mod_apn_load)
 {
 	switch_status_t status = SWITCH_STATUS_FALSE;
 	switch_api_interface_t *api_interface;
+	switch_application_interface_t *app_interface;
 
 	if ((status = do_config(pool) != SWITCH_STATUS_SUCCESS)) {
 		goto error;
@@ -1178,6 +8588,27 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_apn_load)
 	if (!init_sql()) {
 		goto error;
 	}
+	apn_dim_load();
+
+	globals.running = 1;
+	switch_queue_create(&globals.evict_queue, SWITCH_CORE_QUEUE_LEN, globals.pool);
+	launch_thread(&globals.evict_thread, evict_thread_run, NULL);
+	switch_queue_create(&globals.register_queue, SWITCH_CORE_QUEUE_LEN, globals.pool);
+	launch_thread(&globals.register_thread, register_thread_run, NULL);
+	push_attempts_start();
+	profile_workers_start();
+	outbox_start();
+
+	token_store_start();
+	launch_thread(&globals.conn_keeper_thread, conn_keeper_thread_run, NULL);
+	if (!zstr(globals.db_replica.dsn)) {
+		launch_thread(&globals.dsn_check_thread, apn_dsn_thread_run, &globals.db_replica);
+	}
+
+	if (globals.wakeup_bus && globals.wakeup_bus->start && globals.wakeup_bus->start() != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Couldn't start wake up bus '%s'\n", globals.wakeup_bus->name);
+		goto error;
+	}
 
 	/*Bind to event sofia::register for add new tokens from contact parameters*/
 	if ((switch_event_bind_removable(modname, SWITCH_EVENT_CUSTOM, "sofia::register", register_event_handler, NULL, &register_event) != SWITCH_STATUS_SUCCESS)) {
@@ -1191,10 +8622,19 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_apn_load)
 		goto error;
 	}
 
+	/*Bind to event mobile::push::cancel for send cancel push to devices which lost the call */
+	if ((switch_event_bind_removable(modname, SWITCH_EVENT_CUSTOM, APN_CANCEL_SUBCLASS, push_cancel_event_handler, NULL, &cancel_event) != SWITCH_STATUS_SUCCESS)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Couldn't bind event!\n");
+		goto error;
+	}
+
 	/* connect my internal structure to the blank pointer passed to me */
 	*module_interface = switch_loadable_module_create_module_interface(pool, modname);
 
-	SWITCH_ADD_API(api_interface, "apn", "APN Service", apn_api_function, APN_USAGE);
+	SWITCH_ADD_API(api_interface, "apn", "APN Service", apn_api_function, APN_USAGE "|" APN_COMMANDS_USAGE);
+
+	SWITCH_ADD_APP(app_interface, "apn_prepush", "Send VoIP push before dial", "Send VoIP push notification and wait device REGISTER, apn_wait of the same call attaches to it",
+				   apn_prepush_function, APN_PREPUSH_SYNTAX, SAF_SUPPORT_NOMEDIA);
 
 	apn_wait_endpoint_interface = (switch_endpoint_interface_t *) switch_loadable_module_create_interface(*module_interface, SWITCH_ENDPOINT_INTERFACE);
 	apn_wait_endpoint_interface->interface_name = "apn_wait";
@@ -1204,6 +8644,16 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_apn_load)
 	return SWITCH_STATUS_SUCCESS;
 
 error:
+	stop_threads();
+	apn_waiter_registry_destroy();
+	register_fresh_destroy();
+	apn_dim_destroy();
+	if (globals.inflight_hash) {
+		switch_core_hash_destroy(&globals.inflight_hash);
+	}
+	wake_stats_destroy();
+	token_store_destroy();
+	apn_db_conn_destroy_all();
 	if (globals.qm) {
 		switch_sql_queue_manager_destroy(&globals.qm);
 		globals.qm = NULL;
@@ -1216,7 +8666,12 @@ error:
 		switch_event_unbind(&push_event);
 		push_event = NULL;
 	}
+	if (cancel_event) {
+		switch_event_unbind(&cancel_event);
+		cancel_event = NULL;
+	}
 	if (globals.profile_hash) {
+		destroy_profile_headers();
 		switch_core_hash_destroy(&globals.profile_hash);
 		globals.profile_hash = NULL;
 	}
@@ -1226,6 +8681,17 @@ error:
 
 SWITCH_MODULE_SHUTDOWN_FUNCTION(mod_apn_shutdown)
 {
+	stop_threads();
+	loadtest_free();
+	apn_waiter_registry_destroy();
+	register_fresh_destroy();
+	apn_dim_destroy();
+	if (globals.inflight_hash) {
+		switch_core_hash_destroy(&globals.inflight_hash);
+	}
+	wake_stats_destroy();
+	token_store_destroy();
+	apn_db_conn_destroy_all();
 	if (globals.qm) {
 		switch_sql_queue_manager_destroy(&globals.qm);
 		globals.qm = NULL;
@@ -1238,7 +8704,12 @@ SWITCH_MODULE_SHUTDOWN_FUNCTION(mod_apn_shutdown)
 		switch_event_unbind(&push_event);
 		push_event = NULL;
 	}
+	if (cancel_event) {
+		switch_event_unbind(&cancel_event);
+		cancel_event = NULL;
+	}
 	if (globals.profile_hash) {
+		destroy_profile_headers();
 		switch_core_hash_destroy(&globals.profile_hash);
 		globals.profile_hash = NULL;
 	}